@@ -67,9 +67,11 @@ void InitModel(ArithCoder *arith_coder);
 void UpdateModel(ArithCoder *arith_coder, int symbol);
 void InitEncoder(ArithCoder *arith_coder);
 int EncodeSymbol(ArithCoder *a, BitStream *b, int symbol);
+int EncodeBypass(ArithCoder *a, BitStream *b, int bit);
 int DoneEncoder(ArithCoder *arith_coder, BitStream *bit_stream);
 int InitDecoder(ArithCoder *arith_coder, BitStream *bit_stream);
 int DecodeSymbol(ArithCoder *a, BitStream *b, int *symbol);
+int DecodeBypass(ArithCoder *a, BitStream *b, int *bit);
 
 #ifdef __cplusplus
 }
@@ -29,6 +29,16 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Called by a reader that ran out of data: blocks until the bytes before
+ * need are available or no more data will come, returns the end of the
+ * data available.
+ */
+typedef unsigned char *(*WaitFunc)(void *context, unsigned char *need);
+
 typedef struct
 {
   unsigned char *buffer;
@@ -37,8 +47,12 @@ typedef struct
 
   int buffer_size;
 
-  int bit_buffer;
-  int mask;
+  uint64_t bit_word; /* bits not stored yet or not read yet, the lowest bit_count of them */
+  int bit_count;     /* below 32 between calls */
+  int reading;
+
+  WaitFunc wait;
+  void *wait_context;
 
 } BitStream;
 
@@ -48,7 +62,13 @@ void InitWriteBits(BitStream *bit_stream);
 void InitReadBits(BitStream *bit_stream);
 int WriteBit(BitStream *bit_stream, int bit);
 int ReadBit(BitStream *bit_stream, int *bit);
+int WriteBits(BitStream *bit_stream, unsigned int value, int count);
+int ReadBits(BitStream *bit_stream, unsigned int *value, int count);
+int WriteByte(BitStream *bit_stream, int byte);
+int ReadByte(BitStream *bit_stream, int *byte);
+int WaitBits(BitStream *bit_stream);
 int FlushBits(BitStream *bit_stream);
+ptrdiff_t BitPosition(BitStream *bit_stream);
 
 #ifdef __cplusplus
 }
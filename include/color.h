@@ -25,12 +25,14 @@
 #ifndef COLOR_H
 #define COLOR_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-void ConvertRGBToYCbCr(unsigned char *buf, int n);
-void ConvertYCbCrToRGB(unsigned char *buf, int n);
+void ConvertRGBToYCbCr(unsigned char *buf, size_t n);
+void ConvertYCbCrToRGB(unsigned char *buf, size_t n);
 
 #ifdef __cplusplus
 }
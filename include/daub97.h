@@ -45,6 +45,8 @@ extern "C" {
 
 int Daub97Analysis2D(double *image, int rows, int cols, int levels);
 int Daub97Synthesis2D(double *image, int rows, int cols, int levels);
+int Daub97SynthesisRegion(double *image, int rows, int cols, int levels, int top, int left, int bottom, int right);
+void Daub97RegionSupport(int length, int levels, int first, int last, int *coarse_first, int *coarse_last);
 
 #ifdef __cplusplus
 }
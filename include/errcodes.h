@@ -38,6 +38,7 @@ extern "C" {
 #define FALSE          (6)
 #define BAD_PARAMS     (7)
 #define DAMAGED_HEADER (8)
+#define STREAM_ERROR   (9)
 
 #ifdef __cplusplus
 }
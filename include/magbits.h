@@ -0,0 +1,46 @@
+/*
+ * The TiLib: wavelet based lossy image compression library
+ * Copyright (C) 1998-2004 Alexander Simakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * QuikInfo:
+ *
+ * Bit lengths of coefficient magnitudes, with SIMD kernels.
+ *
+ */
+
+#ifndef MAGBITS_H
+#define MAGBITS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+int MagnitudeBits16(short *data,
+                    unsigned char *bits,
+                    size_t count);
+
+int MagnitudeBits32(int *data,
+                    unsigned char *bits,
+                    size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* MAGBITS_H */
@@ -18,7 +18,9 @@
  *
  * QuikInfo:
  *
- * An implementation of double linked list data structure for SPIHT.
+ * Growable array lists of tree nodes for SPIHT. Coordinates and node
+ * types are kept in separate arrays; entries are removed by compacting
+ * the arrays while walking them.
  *
  */
 
@@ -29,27 +31,28 @@
 extern "C" {
 #endif
 
-typedef struct _Node
+typedef struct
 {
-  short row;
-  short col;
-  struct _Node *prev;
-  struct _Node *next;
+  int row;
+  int col;
+  int type;
 } Node;
 
 typedef struct
 {
-  Node *start;
-  Node *end;
+  int *row;
+  int *col;
+  unsigned char *type;
+
+  int count;
+  int capacity;
+
 } NodeList;
 
 NodeList *AllocNodeList();
 void FreeNodeList(NodeList *list);
-Node *AllocNode();
-void FreeNode(Node *node);
-int AppendNode(NodeList *list, short row, short col);
-int RemoveNode(NodeList *list, Node *node);
-int MoveNode(NodeList *list1, NodeList *list2, Node *node);
+int AppendNode(NodeList *list, int row, int col, int type);
+void CompactNodeList(NodeList *list, int dst, int src);
 
 #ifdef __cplusplus
 }
@@ -28,7 +28,7 @@ typedef struct
 } pbm_hdr;
 
 int read_hdr(FILE *f, pbm_hdr *h);
-int file_size(FILE *f);
+long file_size(FILE *f);
 int get_char(FILE *f);
 int get_integer(FILE *f);
 
@@ -0,0 +1,74 @@
+/*
+ * The TiLib: wavelet based lossy image compression library
+ * Copyright (C) 1998-2004 Alexander Simakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * QuikInfo:
+ *
+ * Byte oriented range coder for SPIHT, an alternative to the bit at a
+ * time arithmetic coder with the same adaptive binary models or with
+ * division free probability states.
+ *
+ */
+
+#ifndef RANGE_H
+#define RANGE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "bitio.h"
+
+#define RANGE_TOP   (1U << 24) /* range is renormalized below this */
+#define RANGE_BYTES (4)        /* bytes the decoder reads ahead of the encoder */
+
+typedef struct
+{
+  unsigned int low;   /* encoder: bottom of the range, carry apart */
+  unsigned int range;
+  unsigned int code;  /* decoder: offset of the value from the bottom */
+
+  int carry;   /* encoder: low overflowed, add one to the held bytes */
+  int cache;   /* encoder: first byte not written yet */
+  int pending; /* encoder: bytes held, cache and then 0xff ones */
+
+  int interleaved;   /* encoder: bytes go to slots, see RangeInterleave() */
+  int *slots;        /* ring of stream positions kept for the bytes to come */
+  int slot_first;
+  int slot_count;
+  int slot_capacity;
+
+} RangeCoder;
+
+RangeCoder *AllocRangeCoder();
+void FreeRangeCoder(RangeCoder *range_coder);
+void InitRangeEncoder(RangeCoder *range_coder);
+int RangeInterleave(RangeCoder *range_coder, BitStream *bit_stream);
+int RangeEncodeSymbol(RangeCoder *r, BitStream *b, int *cum_freq, int symbol);
+int RangeEncodeState(RangeCoder *r, BitStream *b, unsigned char *state, int symbol);
+int RangeEncodeBypass(RangeCoder *r, BitStream *b, int bit);
+int DoneRangeEncoder(RangeCoder *range_coder, BitStream *bit_stream);
+int InitRangeDecoder(RangeCoder *range_coder, BitStream *bit_stream);
+int RangeDecodeSymbol(RangeCoder *r, BitStream *b, int *cum_freq, int *symbol);
+int RangeDecodeState(RangeCoder *r, BitStream *b, unsigned char *state, int *symbol);
+int RangeDecodeBypass(RangeCoder *r, BitStream *b, int *bit);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* RANGE_H */
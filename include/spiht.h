@@ -41,21 +41,144 @@
 extern "C" {
 #endif
 
-int SPIHTEncodeDWT(double *dwt_data,
+#include <stddef.h>
+
+#include "bitio.h"
+
+/* Stream options */
+
+#define SPIHT_LISTFREE (0x0001) /* state map engine instead of LIP/LSP/LIS */
+#define SPIHT_BLOCKS   (0x0002) /* independent tree groups with a sub-stream table */
+#define SPIHT_CONTEXTS (0x0004) /* separate adaptive models per decision context */
+#define SPIHT_BYPASS   (0x0008) /* sign and later refinement bits skip the models */
+#define SPIHT_MARKS    (0x0010) /* pass boundaries of every group, with SPIHT_BLOCKS or SPIHT_LEVELS */
+#define SPIHT_LEVELS   (0x0020) /* one sub-stream per resolution, coarse first, in the SPIHT_BLOCKS layout */
+#define SPIHT_ROI      (0x0040) /* region coefficients scaled up by 2^roi_shift, undone by the decoder */
+#define SPIHT_RANGE    (0x0080) /* byte oriented range coder instead of the bit arithmetic coder */
+#define SPIHT_STATES   (0x0100) /* range coder with division free probability states for models */
+#define SPIHT_LANES    (0x0200) /* SPIHT_RANGE or SPIHT_STATES over interleaved coders, decoded in parallel */
+
+/* Coefficient plane types */
+
+#define SPIHT_INT16 (1) /* short samples, magnitudes below 2^15 */
+#define SPIHT_INT32 (2) /* int samples */
+
+#define SPIHT_MAX_PLANES (32)
+
+/* Coefficient plane layouts, see SPIHTPlaneOffset() */
+
+#define SPIHT_RASTER (0) /* row after row */
+#define SPIHT_MORTON (1) /* square tiles in raster order, Z order inside */
+
+/* What one bit plane took, summed over the tree groups */
+
+typedef struct
+{
+  int threshold; /* significance threshold of the plane */
+
+  int lip; /* list sizes at the start of the significance pass, */
+  int lsp; /* list engine only */
+  int lis;
+
+  int coeffs;      /* coefficient significance decisions (TYPE_S) */
+  int sets_a;      /* type A set significance decisions */
+  int sets_b;      /* type B set significance decisions */
+  int signs;       /* sign bits */
+  int refinements; /* refinement bits */
+
+  int sig_bytes; /* bytes written or read by the significance pass */
+  int ref_bytes; /* and by the refinement pass */
+
+  double sig_time; /* wall time of the passes in seconds */
+  double ref_time;
+
+} SPIHTPassStats;
+
+typedef struct
+{
+  int planes; /* entries of plane[] filled, coarsest bit plane first */
+
+  SPIHTPassStats plane[SPIHT_MAX_PLANES];
+
+} SPIHTStats;
+
+typedef struct
+{
+  int options; /* SPIHT_* stream options, encoder only */
+  int blocks;  /* number of tree groups with SPIHT_BLOCKS, encoder only */
+  int threads; /* worker threads, 0 or 1 means the calling thread only */
+
+  WaitFunc wait;      /* decoder only: stream data still arriving, or NULL */
+  void *wait_context; /* passed to wait */
+
+  double target_mse; /* encoder only: stop once the MSE per coefficient is this low, 0 for none */
+  double mse;        /* set by the encoder with target_mse: the MSE per coefficient reached */
+
+  int reduce; /* decoder only: finest scales left out of SPIHT_LEVELS streams, 0 for none */
+
+  int row_start; /* decoder only: SPIHT_BLOCKS groups with no trees in these lowest band rows */
+  int row_end;   /* are left out, row_end 0 for none */
+
+  int roi_shift; /* encoder only, with SPIHT_ROI: the region coefficients of the plane were */
+                 /* scaled up by 2^roi_shift, above every other magnitude (Maxshift) */
+
+  SPIHTStats *stats; /* filled with per bit plane statistics when not NULL */
+
+  int layout; /* SPIHT_RASTER or SPIHT_MORTON order of dwt_data, the stream is the same */
+
+} SPIHTParams;
+
+int SPIHTEncodeDWT(void *dwt_data,
+                   int dwt_type,
                    int rows,
                    int cols,
                    int levels,
                    unsigned char *buffer,
                    int buffer_size,
-                   int *stream_size);
+                   int *stream_size,
+                   SPIHTParams *params);
+
+int SPIHTEncodeDWTMulti(void *dwt_data,
+                        int dwt_type,
+                        int rows,
+                        int cols,
+                        int levels,
+                        unsigned char **buffers,
+                        int *buffer_sizes,
+                        int *stream_sizes,
+                        int count,
+                        SPIHTParams *params);
 
-int SPIHTDecodeDWT(double *dwt_data,
+int SPIHTDecodeDWT(void *dwt_data,
+                   int dwt_type,
                    int rows,
                    int cols,
                    int levels,
                    unsigned char *buffer,
+                   int buffer_size,
+                   SPIHTParams *params);
+
+int SPIHTTruncate(unsigned char *buffer,
+                  int buffer_size,
+                  unsigned char *out,
+                  int out_size,
+                  int *stream_size);
+
+int SPIHTStreamOptions(unsigned char *buffer,
+                       int buffer_size);
+
+int SPIHTPlaneType(unsigned char *buffer,
                    int buffer_size);
 
+int SPIHTRegionShift(unsigned char *buffer,
+                     int buffer_size);
+
+size_t SPIHTPlaneOffset(int row,
+                        int col,
+                        int cols,
+                        int levels,
+                        int layout);
+
 #ifdef __cplusplus
 }
 #endif
@@ -29,6 +29,24 @@
 extern "C" {
 #endif
 
+/*
+ * Incremental form of SplitChannels() for a stream arriving in pieces,
+ * and of MergeChannels() for one leaving in pieces.
+ */
+typedef struct
+{
+  int size[3];  /* n_lum, n_cb, n_cr */
+  int count[3]; /* bytes delivered to every channel */
+  int div[3];
+  int rem[3];
+  int tr0[3];
+  int tr1[3];
+  int left[3];  /* bytes left in the current package */
+  int pkg;
+  int min;
+
+} ChannelSplitter;
+
 void MergeChannels(unsigned char *buf,
                    unsigned char *lum,
                    unsigned char *cb,
@@ -49,6 +67,25 @@ void SplitChannels(unsigned char *buf,
                    int *count_cb,
                    int *count_cr);
 
+void InitSplitter(ChannelSplitter *splitter,
+                  int n_lum,
+                  int n_cb,
+                  int n_cr);
+
+void SplitBytes(ChannelSplitter *splitter,
+                unsigned char *buf,
+                int n_buf,
+                unsigned char *lum,
+                unsigned char *cb,
+                unsigned char *cr);
+
+int MergeBytes(ChannelSplitter *splitter,
+               unsigned char *buf,
+               int n_buf,
+               unsigned char *lum,
+               unsigned char *cb,
+               unsigned char *cr);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,92 @@
+/*
+ * The TiLib: wavelet based lossy image compression library
+ * Copyright (C) 1998-2004 Alexander Simakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * QuikInfo:
+ *
+ * Single producer, single consumer pipe of coder symbols, drained by a
+ * thread of its own.
+ *
+ */
+
+#ifndef SYMBOLPIPE_H
+#define SYMBOLPIPE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <pthread.h>
+
+#define PIPE_CHUNKS   (8)
+#define CHUNK_SYMBOLS (4096)
+
+typedef struct
+{
+  unsigned short context;
+  unsigned char symbol;
+
+} QueuedSymbol;
+
+/* codes count symbols on the pipe thread, anything but OK stops it */
+typedef int (*ChunkFunc)(void *arg, QueuedSymbol *symbols, int count);
+
+/*
+ * The producer fills chunks of symbols in turn, the pipe thread takes
+ * them in the same order. Chunks [tail, head) are filled.
+ */
+typedef struct
+{
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+
+  ChunkFunc func;
+  void *arg;
+
+  QueuedSymbol *chunks; /* PIPE_CHUNKS * CHUNK_SYMBOLS */
+  int counts[PIPE_CHUNKS];
+  int head;
+  int tail;
+
+  QueuedSymbol *next; /* producer side: free entries of chunk head */
+  QueuedSymbol *end;
+
+  int done;   /* no more chunks will come */
+  int stop;   /* func failed, set by the pipe thread */
+  int result; /* of the pipe thread */
+
+} SymbolPipe;
+
+SymbolPipe *AllocSymbolPipe(void);
+
+void FreeSymbolPipe(SymbolPipe *pipe);
+
+int StartPipe(SymbolPipe *pipe,
+              ChunkFunc func,
+              void *arg);
+
+int PublishChunk(SymbolPipe *pipe);
+
+int FinishPipe(SymbolPipe *pipe,
+               int flush);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SYMBOLPIPE_H */
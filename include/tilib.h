@@ -35,6 +35,52 @@ extern "C" {
 #define BUTTERWORTH (0)
 #define DAUB97      (1)
 
+/* Encoding options for TiCompressEx(), same values as SPIHT_* options */
+
+#define TI_LISTFREE (0x0001)
+#define TI_BLOCKS   (0x0002)
+#define TI_CONTEXTS (0x0004)
+#define TI_BYPASS   (0x0008)
+#define TI_MARKS    (0x0010) /* keep pass boundaries for TiTruncate(), with TI_BLOCKS or TI_LEVELS */
+#define TI_LEVELS   (0x0020) /* resolution-progressive: coarse scales first */
+#define TI_ROI      (0x0040) /* the region of interest in TiParams comes first (Maxshift) */
+#define TI_RANGE    (0x0080) /* byte oriented range coder, faster to decode */
+#define TI_STATES   (0x0100) /* range coder with probability states, no divisions */
+#define TI_LANES    (0x0200) /* interleaved range coders, with TI_RANGE or TI_STATES */
+
+/* Coefficient layouts, same values as SPIHT_* layouts; a codec speed */
+/* setting only, streams are the same with either of them */
+
+#define TI_RASTER (0)
+#define TI_MORTON (1)
+
+typedef struct
+{
+  int options; /* TI_* options, encoder only */
+  int blocks;  /* number of tree groups with TI_BLOCKS, encoder only */
+  int threads; /* worker threads, 0 or 1 means the calling thread only */
+
+  unsigned char *roi; /* encoder only, with TI_ROI: img_width x img_height mask, */
+                      /* the luma coefficients of non-zero pixels are coded first */
+
+  int layout; /* TI_RASTER or TI_MORTON */
+
+} TiParams;
+
+/* Incremental decoder, see TiDecoderCreate() */
+
+typedef struct TiDecoderTag TiDecoder;
+
+/* Stream output for TiCompressSink(): takes the next size bytes, */
+/* anything but 0 stops the encoder */
+
+typedef int (*TiSink)(void *context, unsigned char *data, int size);
+
+/* Stream input for TiDecoderRead(): reads up to size bytes into data, */
+/* returns their number, 0 at the end of the data, -1 on errors */
+
+typedef int (*TiSource)(void *context, unsigned char *data, int size);
+
 int TiCompress(unsigned char *image,
                unsigned char *stream,
                int img_width,
@@ -48,6 +94,75 @@ int TiCompress(unsigned char *image,
                int cr_ratio,
                int scales);
 
+int TiCompressEx(unsigned char *image,
+                 unsigned char *stream,
+                 int img_width,
+                 int img_height,
+                 int wavelet,
+                 int img_type,
+                 int desired_size,
+                 int *actual_size,
+                 int lum_ratio,
+                 int cb_ratio,
+                 int cr_ratio,
+                 int scales,
+                 TiParams *params);
+
+int TiCompressMulti(unsigned char *image,
+                    unsigned char **streams,
+                    int img_width,
+                    int img_height,
+                    int wavelet,
+                    int img_type,
+                    int *desired_sizes,
+                    int *actual_sizes,
+                    int count,
+                    int lum_ratio,
+                    int cb_ratio,
+                    int cr_ratio,
+                    int scales,
+                    TiParams *params);
+
+int TiCompressQuality(unsigned char *image,
+                      unsigned char *stream,
+                      int img_width,
+                      int img_height,
+                      int wavelet,
+                      int img_type,
+                      double target_mse,
+                      int max_size,
+                      int *actual_size,
+                      double *actual_mse,
+                      int lum_ratio,
+                      int cb_ratio,
+                      int cr_ratio,
+                      int scales,
+                      TiParams *params);
+
+int TiCompressSink(unsigned char *image,
+                   TiSink sink,
+                   void *sink_context,
+                   int img_width,
+                   int img_height,
+                   int wavelet,
+                   int img_type,
+                   int desired_size,
+                   int *actual_size,
+                   int lum_ratio,
+                   int cb_ratio,
+                   int cr_ratio,
+                   int scales,
+                   TiParams *params);
+
+int TiTruncate(unsigned char *stream,
+               int stream_size,
+               unsigned char *out,
+               int desired_size,
+               int *actual_size,
+               int lum_ratio,
+               int cb_ratio,
+               int cr_ratio);
+
 int TiCheckHeader(unsigned char *stream,
                   int *img_width,
                   int *img_height,
@@ -61,6 +176,55 @@ int TiDecompress(unsigned char *stream,
                  int img_type,
                  int stream_size);
 
+int TiDecompressEx(unsigned char *stream,
+                   unsigned char *image,
+                   int img_width,
+                   int img_height,
+                   int img_type,
+                   int stream_size,
+                   TiParams *params);
+
+int TiDecompressScaled(unsigned char *stream,
+                       unsigned char *image,
+                       int img_width,
+                       int img_height,
+                       int img_type,
+                       int stream_size,
+                       int reduce,
+                       TiParams *params);
+
+int TiDecompressRegion(unsigned char *stream,
+                       unsigned char *image,
+                       int img_width,
+                       int img_height,
+                       int img_type,
+                       int stream_size,
+                       int left,
+                       int top,
+                       int width,
+                       int height,
+                       TiParams *params);
+
+TiDecoder *TiDecoderCreate(void);
+
+void TiDecoderFree(TiDecoder *decoder);
+
+int TiDecoderFeed(TiDecoder *decoder,
+                  unsigned char *data,
+                  int size);
+
+int TiDecoderRead(TiDecoder *decoder,
+                  TiSource source,
+                  void *source_context);
+
+int TiDecoderInfo(TiDecoder *decoder,
+                  int *img_width,
+                  int *img_height,
+                  int *img_type);
+
+int TiDecoderRender(TiDecoder *decoder,
+                    unsigned char *image);
+
 #ifdef __cplusplus
 }
 #endif
@@ -42,13 +42,27 @@ void FreeArithCoder(ArithCoder *arith_coder)
   free(arith_coder);
 }
 
+/*
+ * The bit and the run of opposite underflow bits go out in bulk, up to
+ * 32 of them at a time.
+ */
 int BitPlusFolow(ArithCoder *arith_coder, BitStream *bit_stream, int bit)
 {
-  if ((WriteBit(bit_stream, bit)) == BUFFER_FULL) return BUFFER_FULL;
+  int count;
+
+  count = (arith_coder->underflow_bits < 31 ? arith_coder->underflow_bits : 31);
+
+  if ((WriteBits(bit_stream, (bit ? 1U << count : (1U << count) - 1), count + 1)) == BUFFER_FULL) return BUFFER_FULL;
+
+  arith_coder->underflow_bits -= count;
 
   while (arith_coder->underflow_bits > 0) {
-    if ((WriteBit(bit_stream, 1 - bit)) == BUFFER_FULL) return BUFFER_FULL;
-    arith_coder->underflow_bits--;
+
+    count = (arith_coder->underflow_bits < 32 ? arith_coder->underflow_bits : 32);
+
+    if ((WriteBits(bit_stream, (bit ? 0 : 0xffffffffU), count)) == BUFFER_FULL) return BUFFER_FULL;
+
+    arith_coder->underflow_bits -= count;
   }
 
   return OK;
@@ -125,6 +139,45 @@ int EncodeSymbol(ArithCoder *a, BitStream *b, int symbol)
   return OK;
 }
 
+/*
+ * Codes an equiprobable bit by halving the range: no model, no divides.
+ */
+int EncodeBypass(ArithCoder *a, BitStream *b, int bit)
+{
+  int half;
+
+  half = (a->high - a->low + 1) >> 1;
+
+  if (bit) a->low = a->low + half;
+  else a->high = a->low + half - 1;
+
+  for (;;) {
+
+    if (a->high < HALF) {
+
+      if ((BitPlusFolow(a, b, 0)) == BUFFER_FULL) return BUFFER_FULL;
+    }
+    else if (a->low >= HALF) {
+
+      if ((BitPlusFolow(a, b, 1)) == BUFFER_FULL) return BUFFER_FULL;
+      a->low -= HALF;
+      a->high -= HALF;
+    }
+    else if (a->low >= FIRST_QTR && a->high < THIRD_QTR) {
+
+      a->underflow_bits++;
+      a->low -= FIRST_QTR;
+      a->high -= FIRST_QTR;
+    }
+    else break;
+
+    a->low = a->low << 1;
+    a->high = (a->high << 1) + 1;
+  }
+
+  return OK;
+}
+
 int DoneEncoder(ArithCoder *arith_coder, BitStream *bit_stream)
 {
   int i;
@@ -146,16 +199,14 @@ int DoneEncoder(ArithCoder *arith_coder, BitStream *bit_stream)
 
 int InitDecoder(ArithCoder *arith_coder, BitStream *bit_stream)
 {
-  int i, bit;
+  unsigned int value;
 
   arith_coder->low = 0;
   arith_coder->high = TOP_VALUE;
-  arith_coder->value = 0;
 
-  for (i = 0; i < CODE_BITS; i++) {
-    if ((ReadBit(bit_stream, &bit)) == BUFFER_EMPTY) return BUFFER_EMPTY;
-    arith_coder->value = (arith_coder->value << 1) | bit;
-  }
+  if ((ReadBits(bit_stream, &value, CODE_BITS)) == BUFFER_EMPTY) return BUFFER_EMPTY;
+
+  arith_coder->value = (int) value;
 
   return OK;
 }
@@ -204,3 +255,47 @@ int DecodeSymbol(ArithCoder *a, BitStream *b, int *symbol)
 
   return OK;
 }
+
+int DecodeBypass(ArithCoder *a, BitStream *b, int *bit)
+{
+  int half, next;
+
+  half = (a->high - a->low + 1) >> 1;
+
+  if (a->value - a->low >= half) {
+    *bit = 1;
+    a->low = a->low + half;
+  } else {
+    *bit = 0;
+    a->high = a->low + half - 1;
+  }
+
+  for (;;) {
+
+    if (a->high < HALF) {
+      /* Nothing */
+    }
+    else if (a->low >= HALF) {
+
+      a->value -= HALF;
+      a->low -= HALF;
+      a->high -= HALF;
+    }
+    else if (a->low >= FIRST_QTR && a->high < THIRD_QTR) {
+
+      a->value -= FIRST_QTR;
+      a->low -= FIRST_QTR;
+      a->high -= FIRST_QTR;
+    }
+    else break;
+
+    a->low = a->low << 1;
+    a->high = (a->high << 1) + 1;
+
+    if ((ReadBit(b, &next)) == BUFFER_EMPTY) return BUFFER_EMPTY;
+
+    a->value = (a->value << 1) | next;
+  }
+
+  return OK;
+}
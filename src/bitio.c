@@ -18,17 +18,36 @@
  *
  * QuikInfo:
  *
- * Simple Bit I/O routines for SPIHT.
+ * Simple Bit I/O routines for SPIHT. Bits go through a 64-bit word and
+ * are stored or loaded 32 at a time, most significant bit first as they
+ * always were, so the byte format does not depend on the word size.
  *
  */
 
 #include <stdlib.h>
+#include <string.h>
 #include "../include/bitio.h"
 #include "../include/errcodes.h"
 
+static void StoreWord(unsigned char *bytes,
+                      uint32_t word);
+
+static uint32_t LoadWord(unsigned char *bytes);
+
+static int Refill(BitStream *bit_stream);
+
 BitStream *AllocBitStream()
 {
-  return ((BitStream *) malloc(sizeof(BitStream)));
+  BitStream *bit_stream;
+
+  bit_stream = (BitStream *) malloc(sizeof(BitStream));
+
+  if (bit_stream == NULL) return NULL;
+
+  bit_stream->wait = NULL;
+  bit_stream->wait_context = NULL;
+
+  return bit_stream;
 }
 
 void FreeBitStream(BitStream *bit_stream)
@@ -36,66 +55,240 @@ void FreeBitStream(BitStream *bit_stream)
   free(bit_stream);
 }
 
+/*
+ * Big endian words, with a single store or load where the byte order
+ * is known.
+ */
+static void StoreWord(unsigned char *bytes,
+                      uint32_t word)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  word = __builtin_bswap32(word);
+  memcpy(bytes, &word, 4);
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  memcpy(bytes, &word, 4);
+#else
+  bytes[0] = (unsigned char) (word >> 24);
+  bytes[1] = (unsigned char) (word >> 16);
+  bytes[2] = (unsigned char) (word >> 8);
+  bytes[3] = (unsigned char) word;
+#endif
+}
+
+static uint32_t LoadWord(unsigned char *bytes)
+{
+  uint32_t word;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  memcpy(&word, bytes, 4);
+  word = __builtin_bswap32(word);
+#elif defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+  memcpy(&word, bytes, 4);
+#else
+  word = (uint32_t) bytes[0] << 24 | (uint32_t) bytes[1] << 16 | (uint32_t) bytes[2] << 8 | bytes[3];
+#endif
+
+  return word;
+}
+
 void InitWriteBits(BitStream *bit_stream)
 {
   bit_stream->buffer_end = bit_stream->buffer + bit_stream->buffer_size;
   bit_stream->next_byte = bit_stream->buffer;
-  bit_stream->bit_buffer = 0;
-  bit_stream->mask = 0x80;
+  bit_stream->bit_word = 0;
+  bit_stream->bit_count = 0;
+  bit_stream->reading = 0;
 }
 
 void InitReadBits(BitStream *bit_stream)
 {
-  bit_stream->buffer_end = bit_stream->buffer + bit_stream->buffer_size;
+  /* with a wait function the data shows up while reading */
+  if (bit_stream->wait != NULL) bit_stream->buffer_end = bit_stream->buffer;
+  else bit_stream->buffer_end = bit_stream->buffer + bit_stream->buffer_size;
+
   bit_stream->next_byte = bit_stream->buffer;
-  bit_stream->bit_buffer = 0;
-  bit_stream->mask = 0;
+  bit_stream->bit_word = 0;
+  bit_stream->bit_count = 0;
+  bit_stream->reading = 1;
 }
 
 int WriteBit(BitStream *bit_stream, int bit)
 {
-  if (bit_stream->next_byte >= bit_stream->buffer_end) return BUFFER_FULL;
+  return WriteBits(bit_stream, bit != 0, 1);
+}
 
-  if (bit != 0) bit_stream->bit_buffer |= bit_stream->mask;
+int ReadBit(BitStream *bit_stream, int *bit)
+{
+  if (bit_stream->bit_count == 0 && Refill(bit_stream) != OK) {
+    *bit = 0;
+    return BUFFER_EMPTY;
+  }
 
-  bit_stream->mask >>= 1;
+  bit_stream->bit_count--;
 
-  if (bit_stream->mask == 0) {
+  *bit = (int) (bit_stream->bit_word >> bit_stream->bit_count) & 1;
 
-    *bit_stream->next_byte++ = (unsigned char) bit_stream->bit_buffer;
-    bit_stream->bit_buffer = 0;
-    bit_stream->mask = 0x80;
+  return OK;
+}
+
+/*
+ * Writes the count (1 to 32) lowest bits of value, the highest first.
+ * As with single bits, the ones that would start a byte past the end
+ * of the buffer are left out and BUFFER_FULL is returned. Whole words
+ * always fit once that is checked.
+ */
+int WriteBits(BitStream *bit_stream, unsigned int value, int count)
+{
+  BitStream *b = bit_stream;
+  int room;
+
+  room = (int) (b->buffer_end - b->next_byte) * 8 - b->bit_count;
+
+  if (count > room) {
+
+    if (room <= 0) return BUFFER_FULL;
+
+    WriteBits(b, value >> (count - room), room);
+
+    return BUFFER_FULL;
+  }
+
+  if (count < 32) value &= (1U << count) - 1;
+
+  b->bit_word = b->bit_word << count | value;
+  b->bit_count += count;
+
+  if (b->bit_count >= 32) {
+
+    b->bit_count -= 32;
+
+    StoreWord(b->next_byte, (uint32_t) (b->bit_word >> b->bit_count));
+
+    b->next_byte += 4;
   }
 
   return OK;
 }
 
-int ReadBit(BitStream *bit_stream, int *bit)
+/*
+ * Reads count (1 to 32) bits into the lowest bits of value, the first
+ * one highest.
+ */
+int ReadBits(BitStream *bit_stream, unsigned int *value, int count)
+{
+  BitStream *b = bit_stream;
+
+  while (b->bit_count < count)
+  if (Refill(b) != OK) {
+    *value = 0;
+    return BUFFER_EMPTY;
+  }
+
+  b->bit_count -= count;
+
+  *value = (unsigned int) (b->bit_word >> b->bit_count);
+
+  if (count < 32) *value &= (1U << count) - 1;
+
+  return OK;
+}
+
+/*
+ * Tops up the bits to read, a word when one is there, else the next
+ * byte, waiting for it if need be. Never called with 32 bits or more.
+ */
+static int Refill(BitStream *bit_stream)
 {
-  *bit = 0;
+  BitStream *b = bit_stream;
 
-  if (bit_stream->mask == 0) {
+  if (b->buffer_end - b->next_byte >= 4) {
 
-    if (bit_stream->next_byte >= bit_stream->buffer_end) return BUFFER_EMPTY;
+    b->bit_word = b->bit_word << 32 | LoadWord(b->next_byte);
+    b->bit_count += 32;
+    b->next_byte += 4;
 
-    bit_stream->bit_buffer = *bit_stream->next_byte++;
-    bit_stream->mask = 0x80;
+    return OK;
   }
 
-  if ((bit_stream->bit_buffer & bit_stream->mask) != 0) *bit = 1;
+  if (b->next_byte >= b->buffer_end)
+  if (WaitBits(b) != OK) return BUFFER_EMPTY;
+
+  b->bit_word = b->bit_word << 8 | *b->next_byte++;
+  b->bit_count += 8;
+
+  return OK;
+}
+
+/*
+ * Whole bytes, for coders that never write or read single bits.
+ */
+int WriteByte(BitStream *bit_stream, int byte)
+{
+  if (bit_stream->next_byte >= bit_stream->buffer_end) return BUFFER_FULL;
 
-  bit_stream->mask >>= 1;
+  *bit_stream->next_byte++ = (unsigned char) byte;
 
   return OK;
 }
 
+int ReadByte(BitStream *bit_stream, int *byte)
+{
+  if (bit_stream->next_byte >= bit_stream->buffer_end)
+  if (WaitBits(bit_stream) != OK) return BUFFER_EMPTY;
+
+  *byte = *bit_stream->next_byte++;
+
+  return OK;
+}
+
+/*
+ * Extends the readable part of the buffer with the data that arrived
+ * since the last call, waiting for at least one byte.
+ */
+int WaitBits(BitStream *bit_stream)
+{
+  unsigned char *end, *limit;
+
+  if (bit_stream->wait == NULL) return BUFFER_EMPTY;
+
+  limit = bit_stream->buffer + bit_stream->buffer_size;
+
+  if (bit_stream->next_byte >= limit) return BUFFER_EMPTY;
+
+  end = bit_stream->wait(bit_stream->wait_context, bit_stream->next_byte + 1);
+
+  bit_stream->buffer_end = (end < limit ? end : limit);
+
+  return (bit_stream->next_byte < bit_stream->buffer_end ? OK : BUFFER_EMPTY);
+}
+
 int FlushBits(BitStream *bit_stream)
 {
-  if (bit_stream == NULL) return INTERNAL_ERROR;
+  BitStream *b = bit_stream;
 
-  if (bit_stream->next_byte >= bit_stream->buffer_end) return BUFFER_FULL;
+  if (b == NULL) return INTERNAL_ERROR;
+
+  for (; b->bit_count >= 8; b->bit_count -= 8)
+  *b->next_byte++ = (unsigned char) (b->bit_word >> (b->bit_count - 8));
+
+  if (b->next_byte >= b->buffer_end) return BUFFER_FULL;
 
-  if (bit_stream->mask != 128) *bit_stream->next_byte++ = (unsigned char) bit_stream->bit_buffer;
+  if (b->bit_count > 0) *b->next_byte++ = (unsigned char) (b->bit_word << (8 - b->bit_count));
+
+  b->bit_count = 0;
 
   return OK;
 }
+
+/*
+ * Number of bits written or read so far, wider than an int for
+ * sub-streams past 256 MiB.
+ */
+ptrdiff_t BitPosition(BitStream *bit_stream)
+{
+  ptrdiff_t bits;
+
+  bits = (bit_stream->next_byte - bit_stream->buffer) * 8;
+
+  return (bit_stream->reading ? bits - bit_stream->bit_count : bits + bit_stream->bit_count);
+}
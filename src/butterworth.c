@@ -356,7 +356,8 @@ int ButterworthAnalysis2D(double *image, int width, int height, int levels)
 {
   double *signal_in, *signal_out, *base;
   int cur_level, cur_width, cur_height;
-  int i, j, max, offs, n_samples, n_unrol;
+  int i, j, max, offs;
+  size_t index, n_samples, n_unrol;
   int result;
 
   max = MAX(width, height);
@@ -371,22 +372,22 @@ int ButterworthAnalysis2D(double *image, int width, int height, int levels)
     goto error;
   }
 
-  n_samples = width * height;
-  n_unrol = n_samples & 0xfffffff8;
+  n_samples = (size_t) width * height;
+  n_unrol = n_samples & ~(size_t) 7;
 
-  for (i = 0; i < n_unrol; i += 8) {
+  for (index = 0; index < n_unrol; index += 8) {
 
-    image[i + 0] -= 128.0;
-    image[i + 1] -= 128.0;
-    image[i + 2] -= 128.0;
-    image[i + 3] -= 128.0;
-    image[i + 4] -= 128.0;
-    image[i + 5] -= 128.0;
-    image[i + 6] -= 128.0;
-    image[i + 7] -= 128.0;
+    image[index + 0] -= 128.0;
+    image[index + 1] -= 128.0;
+    image[index + 2] -= 128.0;
+    image[index + 3] -= 128.0;
+    image[index + 4] -= 128.0;
+    image[index + 5] -= 128.0;
+    image[index + 6] -= 128.0;
+    image[index + 7] -= 128.0;
   }
 
-  for (; i < n_samples; i++) image[i] -= 128.0;
+  for (; index < n_samples; index++) image[index] -= 128.0;
 
   cur_width = width;
   cur_height = height;
@@ -398,7 +399,7 @@ int ButterworthAnalysis2D(double *image, int width, int height, int levels)
 
     for (i = 0; i < cur_height; i++) {
 
-      base = image + i * width;
+      base = image + (size_t) i * width;
 
       for (j = 0; j < n_unrol; j += 8) {
 
@@ -434,7 +435,7 @@ int ButterworthAnalysis2D(double *image, int width, int height, int levels)
 
       decompose(signal_in, signal_out, cur_width);
 
-      base = image + i * width;
+      base = image + (size_t) i * width;
 
       for (j = 0; j < n_unrol; j += 8) {
 
@@ -549,21 +550,21 @@ int ButterworthAnalysis2D(double *image, int width, int height, int levels)
     cur_height >>= 1;
   }
 
-  n_unrol = n_samples & 0xfffffff8;
+  n_unrol = n_samples & ~(size_t) 7;
 
-  for (i = 0; i < n_unrol; i += 8) {
+  for (index = 0; index < n_unrol; index += 8) {
 
-    image[i + 0] = ROUND(image[i + 0]);
-    image[i + 1] = ROUND(image[i + 1]);
-    image[i + 2] = ROUND(image[i + 2]);
-    image[i + 3] = ROUND(image[i + 3]);
-    image[i + 4] = ROUND(image[i + 4]);
-    image[i + 5] = ROUND(image[i + 5]);
-    image[i + 6] = ROUND(image[i + 6]);
-    image[i + 7] = ROUND(image[i + 7]);
+    image[index + 0] = ROUND(image[index + 0]);
+    image[index + 1] = ROUND(image[index + 1]);
+    image[index + 2] = ROUND(image[index + 2]);
+    image[index + 3] = ROUND(image[index + 3]);
+    image[index + 4] = ROUND(image[index + 4]);
+    image[index + 5] = ROUND(image[index + 5]);
+    image[index + 6] = ROUND(image[index + 6]);
+    image[index + 7] = ROUND(image[index + 7]);
   }
 
-  for (; i < n_samples; i++) image[i] = ROUND(image[i]);
+  for (; index < n_samples; index++) image[index] = ROUND(image[index]);
 
   result = OK;
 
@@ -579,7 +580,8 @@ int ButterworthSynthesis2D(double *image, int width, int height, int levels)
 {
   double *signal_in, *signal_out, *base;
   int cur_level, cur_width, cur_height;
-  int i, j, max, offs, n_samples, n_unrol;
+  int i, j, max, offs;
+  size_t index, n_samples, n_unrol;
   int result;
 
   max = MAX(width, height);
@@ -604,7 +606,7 @@ int ButterworthSynthesis2D(double *image, int width, int height, int levels)
 
     for (i = 0; i < cur_height; i++) {
 
-      base = image + i * width;
+      base = image + (size_t) i * width;
 
       for (j = 0; j < n_unrol; j += 8) {
 
@@ -640,7 +642,7 @@ int ButterworthSynthesis2D(double *image, int width, int height, int levels)
 
       reconstruct(signal_in, signal_out, cur_width);
 
-      base = image + i * width;
+      base = image + (size_t) i * width;
 
       for (j = 0; j < n_unrol; j += 8) {
 
@@ -755,22 +757,22 @@ int ButterworthSynthesis2D(double *image, int width, int height, int levels)
     cur_height <<= 1;
   }
 
-  n_samples = width * height;
-  n_unrol = n_samples & 0xfffffff8;
+  n_samples = (size_t) width * height;
+  n_unrol = n_samples & ~(size_t) 7;
 
-  for (i = 0; i < n_unrol; i += 8) {
+  for (index = 0; index < n_unrol; index += 8) {
 
-    image[i + 0] = UFIX(ROUND(image[i + 0] + 128.0));
-    image[i + 1] = UFIX(ROUND(image[i + 1] + 128.0));
-    image[i + 2] = UFIX(ROUND(image[i + 2] + 128.0));
-    image[i + 3] = UFIX(ROUND(image[i + 3] + 128.0));
-    image[i + 4] = UFIX(ROUND(image[i + 4] + 128.0));
-    image[i + 5] = UFIX(ROUND(image[i + 5] + 128.0));
-    image[i + 6] = UFIX(ROUND(image[i + 6] + 128.0));
-    image[i + 7] = UFIX(ROUND(image[i + 7] + 128.0));
+    image[index + 0] = UFIX(ROUND(image[index + 0] + 128.0));
+    image[index + 1] = UFIX(ROUND(image[index + 1] + 128.0));
+    image[index + 2] = UFIX(ROUND(image[index + 2] + 128.0));
+    image[index + 3] = UFIX(ROUND(image[index + 3] + 128.0));
+    image[index + 4] = UFIX(ROUND(image[index + 4] + 128.0));
+    image[index + 5] = UFIX(ROUND(image[index + 5] + 128.0));
+    image[index + 6] = UFIX(ROUND(image[index + 6] + 128.0));
+    image[index + 7] = UFIX(ROUND(image[index + 7] + 128.0));
   }
 
-  for (; i < n_samples; i++) image[i] = UFIX(ROUND(image[i] + 128.0));
+  for (; index < n_samples; index++) image[index] = UFIX(ROUND(image[index] + 128.0));
 
   result = OK;
 
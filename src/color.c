@@ -22,10 +22,12 @@
  *
  */
 
+#include <stddef.h>
+
 #define ROUND(x) (((x) < 0) ? (int) ((x) - 0.5) : (int) ((x) + 0.5))
 #define FIX(x) ((x) < 0 ? 0 : ((x) > 255 ? 255 : (x)))
 
-void ConvertRGBToYCbCr(unsigned char *buf, int n)
+void ConvertRGBToYCbCr(unsigned char *buf, size_t n)
 {
   double lum, cb, cr;
   double r, g, b;
@@ -52,7 +54,7 @@ void ConvertRGBToYCbCr(unsigned char *buf, int n)
   }
 }
 
-void ConvertYCbCrToRGB(unsigned char *buf, int n)
+void ConvertYCbCrToRGB(unsigned char *buf, size_t n)
 {
   double lum, cb, cr;
   double r, g, b;
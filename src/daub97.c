@@ -41,6 +41,7 @@
 #include "../include/errcodes.h"
 
 #define MAX(_x, _y) (_x > _y ? _x : _y)
+#define MIN(_x, _y) (_x < _y ? _x : _y)
 #define ROUND(_x) (((_x) < 0) ? (int) ((_x) - 0.5) : (int) ((_x) + 0.5))
 #define FIX(_x) ((_x) < 0 ? 0 : ((_x) > 255 ? 255 : (_x)))
 
@@ -50,6 +51,14 @@
 #define DELTA      0.44350482244527
 #define EPSILON    1.14960430535816
 
+#define MAX_LEVELS (32)
+
+/* the four lifting steps spoil this many samples at each end of a window */
+#define SUPPORT (4)
+
+static void Daub97Window(int first, int last, int length, int *start, int *end);
+static void Daub97SynthesisWindow1D(double *signal_in, double *signal_out, int start, int end, int length);
+
 static void Daub97Analysis1D(double *signal_in, double *signal_out, int signal_length)
 {
   double *even, *odd;
@@ -118,11 +127,65 @@ static void Daub97Synthesis1D(double *signal_in, double *signal_out, int signal_
   signal_out[signal_length - 1] -= 2 * ALPHA * signal_out[signal_length - 2];
 }
 
+/*
+ * Samples [start, end) of the interleaved signal that a synthesis
+ * needs to get samples [first, last) exactly, even aligned so that the
+ * low and high bands split it evenly.
+ */
+static void Daub97Window(int first, int last, int length, int *start, int *end)
+{
+  *start = MAX(0, ((first - SUPPORT) & ~1));
+  *end = MIN(length, ((last + SUPPORT + 1) & ~1));
+}
+
+/*
+ * Daub97Synthesis1D() of the window [start, end) of a signal_length
+ * signal: signal_in holds the low band samples start / 2 ... end / 2 - 1
+ * followed by the high band ones. The signal edges get the symmetric
+ * extension as usual, the window edges are left wrong by SUPPORT
+ * samples and every other sample comes out exactly as in a full run.
+ */
+static void Daub97SynthesisWindow1D(double *signal_in, double *signal_out, int start, int end, int signal_length)
+{
+  double *even, *odd;
+  int i, half, length;
+
+  length = end - start;
+  half = length >> 1;
+
+  even = signal_in;
+  odd = signal_in + half;
+
+  for (i = 0; i < half; i++) {
+    signal_out[i << 1] = even[i];
+    signal_out[(i << 1) + 1] = odd[i];
+  }
+
+  for (i = 1; i < length; i += 2) signal_out[i] *= (-EPSILON);
+
+  if (start == 0) signal_out[0] = signal_out[0] / EPSILON - 2 * DELTA * signal_out[1];
+  for (i = 2; i < length; i += 2)
+  signal_out[i] = signal_out[i] / EPSILON - DELTA * (signal_out[i + 1] + signal_out[i - 1]);
+
+  for (i = 1; i < length - 2; i += 2)
+  signal_out[i] -= GAMMA * (signal_out[i - 1] + signal_out[i + 1]);
+  if (end == signal_length) signal_out[length - 1] -= 2 * GAMMA * signal_out[length - 2];
+
+  if (start == 0) signal_out[0] -= 2 * BETA * signal_out[1];
+  for (i = 2; i < length; i += 2)
+  signal_out[i] -= BETA * (signal_out[i + 1] + signal_out[i - 1]);
+
+  for (i = 1; i < length - 2; i += 2)
+  signal_out[i] -= ALPHA * (signal_out[i - 1] + signal_out[i + 1]);
+  if (end == signal_length) signal_out[length - 1] -= 2 * ALPHA * signal_out[length - 2];
+}
+
 int Daub97Analysis2D(double *image, int rows, int cols, int levels)
 {
   double *signal_in, *signal_out, *base;
   int cur_level, cur_cols, cur_rows;
-  int i, j, max, offs, n_samples;
+  int i, j, max, offs;
+  size_t index, n_samples;
   int err_code;
 
   max = MAX(cols, rows);
@@ -137,10 +200,10 @@ int Daub97Analysis2D(double *image, int rows, int cols, int levels)
     goto memory_error;
   }
 
-  n_samples = cols * rows;
+  n_samples = (size_t) cols * rows;
 
   /* DC level shift */
-  for (i = 0; i < n_samples; i++) image[i] -= 128.0;
+  for (index = 0; index < n_samples; index++) image[index] -= 128.0;
 
   cur_cols = cols;
   cur_rows = rows;
@@ -176,7 +239,7 @@ int Daub97Analysis2D(double *image, int rows, int cols, int levels)
     /* transform all rows */
     for (i = 0; i < cur_rows; i++) {
 
-      base = image + i * cols;
+      base = image + (size_t) i * cols;
 
       /* load data */
       for (j = 0; j < cur_cols; j++) {
@@ -186,7 +249,7 @@ int Daub97Analysis2D(double *image, int rows, int cols, int levels)
 
       Daub97Analysis1D(signal_in, signal_out, cur_cols);
 
-      base = image + i * cols;
+      base = image + (size_t) i * cols;
 
       /* save data */
       for (j = 0; j < cur_cols; j++) {
@@ -201,7 +264,7 @@ int Daub97Analysis2D(double *image, int rows, int cols, int levels)
   }
 
   /* uniform scalar quantinization */
-  for (i = 0; i < n_samples; i++) image[i] = ROUND(image[i]);
+  for (index = 0; index < n_samples; index++) image[index] = ROUND(image[index]);
 
   err_code = OK;
 
@@ -217,7 +280,8 @@ int Daub97Synthesis2D(double *image, int rows, int cols, int levels)
 {
   double *signal_in, *signal_out, *base;
   int cur_level, cur_cols, cur_rows;
-  int i, j, max, offs, n_samples;
+  int i, j, max, offs;
+  size_t index, n_samples;
   int err_code;
 
   max = MAX(cols, rows);
@@ -242,7 +306,7 @@ int Daub97Synthesis2D(double *image, int rows, int cols, int levels)
     /* transform all rows */
     for (i = 0; i < cur_rows; i++) {
 
-      base = image + i * cols;
+      base = image + (size_t) i * cols;
 
       /* load data */
       for (j = 0; j < cur_cols; j++) {
@@ -252,7 +316,7 @@ int Daub97Synthesis2D(double *image, int rows, int cols, int levels)
 
       Daub97Synthesis1D(signal_in, signal_out, cur_cols);
 
-      base = image + i * cols;
+      base = image + (size_t) i * cols;
 
       /* save data */
       for (j = 0; j < cur_cols; j++) {
@@ -290,10 +354,147 @@ int Daub97Synthesis2D(double *image, int rows, int cols, int levels)
     cur_rows <<= 1;
   }
 
-  n_samples = cols * rows;
+  n_samples = (size_t) cols * rows;
+
+  /* undo DC level shift */
+  for (index = 0; index < n_samples; index++) image[index] = FIX(ROUND(image[index] + 128.0));
+
+  err_code = OK;
+
+  memory_error:
+
+  free(signal_in);
+  free(signal_out);
+
+  return err_code;
+}
+
+/*
+ * Rows (or columns) [*coarse_first, *coarse_last) of the lowest band
+ * whose trees hold every coefficient that Daub97SynthesisRegion() reads
+ * for rows [first, last) of a length long, levels deep transform.
+ */
+void Daub97RegionSupport(int length, int levels, int first, int last, int *coarse_first, int *coarse_last)
+{
+  int cur_level, cur_length, start, end;
+
+  *coarse_first = length;
+  *coarse_last = 0;
+
+  cur_length = length;
+
+  for (cur_level = levels; cur_level >= 1; cur_level--) {
+
+    Daub97Window(first, last, cur_length, &start, &end);
+
+    /* both bands, [start / 2, end / 2) at this scale */
+    first = start >> 1;
+    last = end >> 1;
+
+    *coarse_first = MIN(*coarse_first, first >> (cur_level - 1));
+    *coarse_last = MAX(*coarse_last, ((last - 1) >> (cur_level - 1)) + 1);
+
+    cur_length >>= 1;
+  }
+}
+
+/*
+ * Daub97Synthesis2D() of the pixels [top, bottom) x [left, right) only:
+ * every level synthesizes just the window of rows and columns the next
+ * one reads. The rest of the image is left undefined.
+ */
+int Daub97SynthesisRegion(double *image, int rows, int cols, int levels, int top, int left, int bottom, int right)
+{
+  double *signal_in, *signal_out, *base;
+  int row_first[MAX_LEVELS + 1], row_last[MAX_LEVELS + 1];
+  int col_first[MAX_LEVELS + 1], col_last[MAX_LEVELS + 1];
+  int row_start, row_end, col_start, col_end;
+  int cur_level, cur_cols, cur_rows, half_rows, half_cols;
+  int i, j, max;
+  int err_code;
+
+  if (levels < 1 || levels > MAX_LEVELS) return BAD_PARAMS;
+
+  if (top < 0 || left < 0 || bottom > rows || right > cols || top >= bottom || left >= right) return BAD_PARAMS;
+
+  max = MAX(cols, rows);
+
+  signal_in = signal_out = NULL;
+
+  signal_in = (double *) malloc(max * sizeof(double));
+  signal_out = (double *) malloc(max * sizeof(double));
+
+  if (signal_in == NULL || signal_out == NULL) {
+    err_code = MEMORY_ERROR;
+    goto memory_error;
+  }
+
+  /* the samples every level must get right, from the finest one down */
+  row_first[levels] = top;
+  row_last[levels] = bottom;
+  col_first[levels] = left;
+  col_last[levels] = right;
+
+  for (cur_level = levels; cur_level >= 1; cur_level--) {
+
+    Daub97Window(row_first[cur_level], row_last[cur_level], rows >> (levels - cur_level), &row_start, &row_end);
+    Daub97Window(col_first[cur_level], col_last[cur_level], cols >> (levels - cur_level), &col_start, &col_end);
+
+    row_first[cur_level - 1] = row_start >> 1;
+    row_last[cur_level - 1] = row_end >> 1;
+    col_first[cur_level - 1] = col_start >> 1;
+    col_last[cur_level - 1] = col_end >> 1;
+  }
+
+  for (cur_level = 1; cur_level <= levels; cur_level++) {
+
+    cur_rows = rows >> (levels - cur_level);
+    cur_cols = cols >> (levels - cur_level);
+
+    half_rows = cur_rows >> 1;
+    half_cols = cur_cols >> 1;
+
+    Daub97Window(row_first[cur_level], row_last[cur_level], cur_rows, &row_start, &row_end);
+    Daub97Window(col_first[cur_level], col_last[cur_level], cur_cols, &col_start, &col_end);
+
+    /* transform the rows of the window, both bands */
+    for (i = 0; i < row_end - row_start; i++) {
+
+      base = image + (size_t) ((i & 1 ? half_rows : 0) + (row_start >> 1) + (i >> 1)) * cols;
+
+      /* load data */
+      for (j = 0; j < (col_end - col_start) >> 1; j++) {
+        signal_in[j] = base[(col_start >> 1) + j];
+        signal_in[((col_end - col_start) >> 1) + j] = base[half_cols + (col_start >> 1) + j];
+      }
+
+      Daub97SynthesisWindow1D(signal_in, signal_out, col_start, col_end, cur_cols);
+
+      /* save data */
+      for (j = col_first[cur_level]; j < col_last[cur_level]; j++) base[j] = signal_out[j - col_start];
+    }
+
+    /* transform the columns of the window */
+    for (i = col_first[cur_level]; i < col_last[cur_level]; i++) {
+
+      base = image + i;
+
+      /* load data */
+      for (j = 0; j < (row_end - row_start) >> 1; j++) {
+        signal_in[j] = base[(size_t) ((row_start >> 1) + j) * cols];
+        signal_in[((row_end - row_start) >> 1) + j] = base[(size_t) (half_rows + (row_start >> 1) + j) * cols];
+      }
+
+      Daub97SynthesisWindow1D(signal_in, signal_out, row_start, row_end, cur_rows);
+
+      /* save data */
+      for (j = row_first[cur_level]; j < row_last[cur_level]; j++) base[(size_t) j * cols] = signal_out[j - row_start];
+    }
+  }
 
   /* undo DC level shift */
-  for (i = 0; i < n_samples; i++) image[i] = FIX(ROUND(image[i] + 128.0));
+  for (i = top; i < bottom; i++)
+  for (j = left; j < right; j++) image[(size_t) i * cols + j] = FIX(ROUND(image[(size_t) i * cols + j] + 128.0));
 
   err_code = OK;
 
@@ -22,6 +22,8 @@
  *
  */
 
+#include <stddef.h>
+
 void ExtendImage(unsigned char *src,
                  double *dst,
                  int rows,
@@ -42,7 +44,7 @@ void ExtendImage(unsigned char *src,
 
   /* transfer image */
   ps = src;
-  pd = dst + pad_top * align_cols + pad_left;
+  pd = dst + (ptrdiff_t) pad_top * align_cols + pad_left;
 
   for (i = 0; i < rows; i++) {
 
@@ -51,8 +53,8 @@ void ExtendImage(unsigned char *src,
   }
 
   /* pad left */
-  p1 = dst + pad_top * align_cols + pad_left - 1;
-  p2 = dst + pad_top * align_cols + pad_left;
+  p1 = dst + (ptrdiff_t) pad_top * align_cols + pad_left - 1;
+  p2 = dst + (ptrdiff_t) pad_top * align_cols + pad_left;
 
   for (i = 0; i < rows; i++) {
 
@@ -66,8 +68,8 @@ void ExtendImage(unsigned char *src,
   }
 
   /* pad right */
-  p1 = dst + pad_top * align_cols + pad_left + cols;
-  p2 = dst + pad_top * align_cols + pad_left + cols - 1;
+  p1 = dst + (ptrdiff_t) pad_top * align_cols + pad_left + cols;
+  p2 = dst + (ptrdiff_t) pad_top * align_cols + pad_left + cols - 1;
 
   for (i = 0; i < rows; i++) {
 
@@ -81,8 +83,8 @@ void ExtendImage(unsigned char *src,
   }
 
   /* pad top */
-  p1 = dst + (pad_top - 1) * align_cols;
-  p2 = dst + pad_top * align_cols;
+  p1 = dst + (ptrdiff_t) (pad_top - 1) * align_cols;
+  p2 = dst + (ptrdiff_t) pad_top * align_cols;
 
   for (i = 0; i < align_cols; i++) {
 
@@ -92,12 +94,12 @@ void ExtendImage(unsigned char *src,
       if (j < rows - 1) p2 += align_cols; else p2 -= align_cols;
     }
 
-    p1 += pad_top * align_cols + 1;
+    p1 += (ptrdiff_t) pad_top * align_cols + 1;
     p2 = p1 + align_cols;
   }
 
   /* pad bottom */
-  p1 = dst + (pad_top + rows) * align_cols;
+  p1 = dst + (ptrdiff_t) (pad_top + rows) * align_cols;
   p2 = p1 - align_cols;
 
   for (i = 0; i < align_cols; i++) {
@@ -108,7 +110,7 @@ void ExtendImage(unsigned char *src,
       if (j < rows - 1) p2 -= align_cols; else p2 += align_cols;
     }
 
-    p1 -= pad_bottom * align_cols - 1;
+    p1 -= (ptrdiff_t) pad_bottom * align_cols - 1;
     p2 = p1 - align_cols;
   }
 
@@ -132,7 +134,7 @@ void ExtractImage(double *src,
   pad_right = align_cols - cols - pad_left;
 
   /* transfer image */
-  ps = src + pad_top * align_cols + pad_left;
+  ps = src + (ptrdiff_t) pad_top * align_cols + pad_left;
   pd = dst;
 
   for (i = 0; i < rows; i++) {
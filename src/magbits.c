@@ -0,0 +1,368 @@
+/*
+ * The TiLib: wavelet based lossy image compression library
+ * Copyright (C) 1998-2004 Alexander Simakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * QuikInfo:
+ *
+ * Bit lengths of coefficient magnitudes, the input of every SPIHT
+ * significance test. On x86 the plane goes through SSE2 or AVX2 kernels
+ * picked at run time: a magnitude below 2^24 converts exactly to float,
+ * whose exponent field is its bit length plus 126. Other targets and
+ * the last few samples use the scalar loop.
+ *
+ */
+
+#include "../include/magbits.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#define ABS(x_) ((x_) < 0 ? -(x_) : (x_))
+#define MAX(x_, y_) ((x_) > (y_) ? (x_) : (y_))
+
+static int ScalarBits16(short *data,
+                        unsigned char *bits,
+                        size_t count);
+
+static int ScalarBits32(int *data,
+                        unsigned char *bits,
+                        size_t count);
+
+#ifdef X86_KERNELS
+
+static int Sse2Bits16(short *data,
+                      unsigned char *bits,
+                      size_t count);
+
+static int Sse2Bits32(int *data,
+                      unsigned char *bits,
+                      size_t count);
+
+static int Avx2Bits16(short *data,
+                      unsigned char *bits,
+                      size_t count);
+
+static int Avx2Bits32(int *data,
+                      unsigned char *bits,
+                      size_t count);
+
+#endif
+
+/*
+ * Stores the bit lengths of the count magnitudes at data in bits and
+ * returns the largest of them. Magnitudes are below 2^15.
+ */
+int MagnitudeBits16(short *data,
+                    unsigned char *bits,
+                    size_t count)
+{
+  size_t done;
+  int max;
+
+  done = 0;
+  max = 0;
+
+#ifdef X86_KERNELS
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+
+    done = count & ~(size_t) 31;
+    max = Avx2Bits16(data, bits, done);
+
+  } else if (__builtin_cpu_supports("sse2")) {
+
+    done = count & ~(size_t) 15;
+    max = Sse2Bits16(data, bits, done);
+  }
+#endif
+
+  return MAX(max, ScalarBits16(data + done, bits + done, count - done));
+}
+
+int MagnitudeBits32(int *data,
+                    unsigned char *bits,
+                    size_t count)
+{
+  size_t done;
+  int max;
+
+  done = 0;
+  max = 0;
+
+#ifdef X86_KERNELS
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx2")) {
+
+    done = count & ~(size_t) 31;
+    max = Avx2Bits32(data, bits, done);
+
+  } else if (__builtin_cpu_supports("sse2")) {
+
+    done = count & ~(size_t) 15;
+    max = Sse2Bits32(data, bits, done);
+  }
+#endif
+
+  return MAX(max, ScalarBits32(data + done, bits + done, count - done));
+}
+
+static int ScalarBits16(short *data,
+                        unsigned char *bits,
+                        size_t count)
+{
+  size_t i;
+  int value, length, max;
+
+  max = 0;
+
+  for (i = 0; i < count; i++) {
+
+    value = ABS(data[i]);
+
+    for (length = 0; value != 0; length++) value >>= 1;
+
+    bits[i] = (unsigned char) length;
+
+    if (length > max) max = length;
+  }
+
+  return max;
+}
+
+static int ScalarBits32(int *data,
+                        unsigned char *bits,
+                        size_t count)
+{
+  size_t i;
+  int value, length, max;
+
+  max = 0;
+
+  for (i = 0; i < count; i++) {
+
+    value = ABS(data[i]);
+
+    for (length = 0; value != 0; length++) value >>= 1;
+
+    bits[i] = (unsigned char) length;
+
+    if (length > max) max = length;
+  }
+
+  return max;
+}
+
+#ifdef X86_KERNELS
+
+/* bit lengths of four magnitudes below 2^24, 0 for 0 */
+__attribute__((target("sse2")))
+static inline __m128i Sse2Length(__m128i value)
+{
+  __m128i exponent;
+
+  exponent = _mm_srli_epi32(_mm_castps_si128(_mm_cvtepi32_ps(value)), 23);
+
+  return _mm_and_si128(_mm_sub_epi32(exponent, _mm_set1_epi32(126)), _mm_cmpgt_epi32(value, _mm_setzero_si128()));
+}
+
+/* any non-negative magnitudes: the top ones are shifted into range first */
+__attribute__((target("sse2")))
+static inline __m128i Sse2LengthWide(__m128i value)
+{
+  __m128i wide;
+
+  wide = _mm_cmpgt_epi32(value, _mm_set1_epi32(0xffffff));
+
+  return _mm_or_si128(_mm_and_si128(wide, _mm_add_epi32(Sse2Length(_mm_srli_epi32(value, 8)), _mm_set1_epi32(8))),
+                      _mm_andnot_si128(wide, Sse2Length(value)));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i Sse2Pack(__m128i a,
+                               __m128i b,
+                               __m128i c,
+                               __m128i d)
+{
+  return _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+}
+
+__attribute__((target("sse2")))
+static int Sse2Max(__m128i max)
+{
+  unsigned char lanes[16];
+  int i, result;
+
+  _mm_storeu_si128((__m128i *) lanes, max);
+
+  for (i = 0, result = 0; i < 16; i++) result = MAX(result, lanes[i]);
+
+  return result;
+}
+
+__attribute__((target("sse2")))
+static int Sse2Bits16(short *data,
+                      unsigned char *bits,
+                      size_t count)
+{
+  __m128i zero, lo, hi, length, max;
+  size_t i;
+
+  zero = _mm_setzero_si128();
+  max = zero;
+
+  for (i = 0; i < count; i += 16) {
+
+    lo = _mm_loadu_si128((__m128i *) (data + i));
+    hi = _mm_loadu_si128((__m128i *) (data + i + 8));
+
+    lo = _mm_max_epi16(lo, _mm_sub_epi16(zero, lo));
+    hi = _mm_max_epi16(hi, _mm_sub_epi16(zero, hi));
+
+    length = Sse2Pack(Sse2Length(_mm_unpacklo_epi16(lo, zero)), Sse2Length(_mm_unpackhi_epi16(lo, zero)),
+                      Sse2Length(_mm_unpacklo_epi16(hi, zero)), Sse2Length(_mm_unpackhi_epi16(hi, zero)));
+
+    _mm_storeu_si128((__m128i *) (bits + i), length);
+
+    max = _mm_max_epu8(max, length);
+  }
+
+  return Sse2Max(max);
+}
+
+__attribute__((target("sse2")))
+static int Sse2Bits32(int *data,
+                      unsigned char *bits,
+                      size_t count)
+{
+  __m128i value[4], sign, length, max;
+  size_t i;
+  int j;
+
+  max = _mm_setzero_si128();
+
+  for (i = 0; i < count; i += 16) {
+
+    for (j = 0; j < 4; j++) {
+
+      value[j] = _mm_loadu_si128((__m128i *) (data + i + 4 * j));
+
+      sign = _mm_srai_epi32(value[j], 31);
+      value[j] = Sse2LengthWide(_mm_sub_epi32(_mm_xor_si128(value[j], sign), sign));
+    }
+
+    length = Sse2Pack(value[0], value[1], value[2], value[3]);
+
+    _mm_storeu_si128((__m128i *) (bits + i), length);
+
+    max = _mm_max_epu8(max, length);
+  }
+
+  return Sse2Max(max);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i Avx2Length(__m256i value)
+{
+  __m256i exponent;
+
+  exponent = _mm256_srli_epi32(_mm256_castps_si256(_mm256_cvtepi32_ps(value)), 23);
+
+  return _mm256_and_si256(_mm256_sub_epi32(exponent, _mm256_set1_epi32(126)), _mm256_cmpgt_epi32(value, _mm256_setzero_si256()));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i Avx2LengthWide(__m256i value)
+{
+  return _mm256_blendv_epi8(Avx2Length(value),
+                            _mm256_add_epi32(Avx2Length(_mm256_srli_epi32(value, 8)), _mm256_set1_epi32(8)),
+                            _mm256_cmpgt_epi32(value, _mm256_set1_epi32(0xffffff)));
+}
+
+/* the packs work within 128-bit lanes, the final permute restores the order */
+__attribute__((target("avx2")))
+static inline __m256i Avx2Pack(__m256i a,
+                               __m256i b,
+                               __m256i c,
+                               __m256i d)
+{
+  return _mm256_permutevar8x32_epi32(_mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d)),
+                                     _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+}
+
+__attribute__((target("avx2")))
+static int Avx2Max(__m256i max)
+{
+  return Sse2Max(_mm_max_epu8(_mm256_castsi256_si128(max), _mm256_extracti128_si256(max, 1)));
+}
+
+__attribute__((target("avx2")))
+static int Avx2Bits16(short *data,
+                      unsigned char *bits,
+                      size_t count)
+{
+  __m256i value[4], length, max;
+  size_t i;
+  int j;
+
+  max = _mm256_setzero_si256();
+
+  for (i = 0; i < count; i += 32) {
+
+    for (j = 0; j < 4; j++)
+    value[j] = Avx2Length(_mm256_cvtepu16_epi32(_mm_abs_epi16(_mm_loadu_si128((__m128i *) (data + i + 8 * j)))));
+
+    length = Avx2Pack(value[0], value[1], value[2], value[3]);
+
+    _mm256_storeu_si256((__m256i *) (bits + i), length);
+
+    max = _mm256_max_epu8(max, length);
+  }
+
+  return Avx2Max(max);
+}
+
+__attribute__((target("avx2")))
+static int Avx2Bits32(int *data,
+                      unsigned char *bits,
+                      size_t count)
+{
+  __m256i value[4], length, max;
+  size_t i;
+  int j;
+
+  max = _mm256_setzero_si256();
+
+  for (i = 0; i < count; i += 32) {
+
+    for (j = 0; j < 4; j++)
+    value[j] = Avx2LengthWide(_mm256_abs_epi32(_mm256_loadu_si256((__m256i *) (data + i + 8 * j))));
+
+    length = Avx2Pack(value[0], value[1], value[2], value[3]);
+
+    _mm256_storeu_si256((__m256i *) (bits + i), length);
+
+    max = _mm256_max_epu8(max, length);
+  }
+
+  return Avx2Max(max);
+}
+
+#endif
@@ -18,14 +18,19 @@
  *
  * QuikInfo:
  *
- * An implementation of double linked list data structure for SPIHT.
+ * Growable array lists of tree nodes for SPIHT. Coordinates and node
+ * types are kept in separate arrays; entries are removed by compacting
+ * the arrays while walking them.
  *
  */
 
 #include <stdlib.h>
+#include <limits.h>
 #include "../include/nodelist.h"
 #include "../include/errcodes.h"
 
+#define MIN_CAPACITY (1024)
+
 NodeList *AllocNodeList()
 {
   NodeList *list;
@@ -34,107 +39,82 @@ NodeList *AllocNodeList()
 
   if (list == NULL) return NULL;
 
-  list->start = NULL;
-  list->end = NULL;
+  list->row = (int *) malloc(MIN_CAPACITY * sizeof(int));
+  list->col = (int *) malloc(MIN_CAPACITY * sizeof(int));
+  list->type = (unsigned char *) malloc(MIN_CAPACITY);
+
+  list->count = 0;
+  list->capacity = MIN_CAPACITY;
+
+  if (list->row == NULL || list->col == NULL || list->type == NULL) {
+    FreeNodeList(list);
+    return NULL;
+  }
 
   return list;
 }
 
 void FreeNodeList(NodeList *list)
 {
-  Node *next;
-  Node *current;
-
   if (list == NULL) return;
 
-  current = list->start;
-
-  while (current != NULL) {
-    next = current->next; 
-    free(current);
-    current = next;
-  }
-
+  free(list->row);
+  free(list->col);
+  free(list->type);
   free(list);
 }
 
-Node *AllocNode()
+int AppendNode(NodeList *list, int row, int col, int type)
 {
-  Node *node;
-
-  node = (Node *) malloc(sizeof(Node));
+  int *new_row, *new_col;
+  unsigned char *new_type;
+  int capacity;
 
-  if (node == NULL) return NULL;
+  if (list == NULL) return INTERNAL_ERROR;
 
-  node->row = 0;
-  node->col = 0;
-  node->prev = NULL;
-  node->next = NULL;
+  if (list->count == list->capacity) {
 
-  return node;
-}
-
-void FreeNode(Node *node)
-{
-  free(node);
-}
+    /* counts are ints, a list holds fewer than 2^31 nodes */
+    if (list->capacity > INT_MAX >> 1) return MEMORY_ERROR;
 
-int AppendNode(NodeList *list, short row, short col)
-{
-  Node *node;
+    capacity = list->capacity << 1;
 
-  node = AllocNode();
+    new_row = (int *) realloc(list->row, (size_t) capacity * sizeof(int));
 
-  if (node == NULL) return MEMORY_ERROR;
+    if (new_row == NULL) return MEMORY_ERROR;
 
-  if (list == NULL) return INTERNAL_ERROR;
+    list->row = new_row;
 
-  node->row = row;
-  node->col = col;
-  node->next = NULL;
-  node->prev = list->end;
-
-  if (list->end != NULL) {
-    list->end->next = node;
-    list->end = node;
-  } else {
-    list->start = node;
-    list->end = node;
-  }
+    new_col = (int *) realloc(list->col, (size_t) capacity * sizeof(int));
 
-  return OK;
-}
+    if (new_col == NULL) return MEMORY_ERROR;
 
-int RemoveNode(NodeList *list, Node *node)
-{
-  if (list == NULL || node == NULL) return INTERNAL_ERROR;
+    list->col = new_col;
 
-  if (list->start == NULL || list->end == NULL) return INTERNAL_ERROR;
+    new_type = (unsigned char *) realloc(list->type, (size_t) capacity);
 
-  if (node->prev != NULL) node->prev->next = node->next;
-  else list->start = node->next;
+    if (new_type == NULL) return MEMORY_ERROR;
 
-  if (node->next != NULL) node->next->prev = node->prev;
-  else list->end = node->prev;
+    list->type = new_type;
+    list->capacity = capacity;
+  }
 
-  free(node);
+  list->row[list->count] = row;
+  list->col[list->count] = col;
+  list->type[list->count] = (unsigned char) type;
+  list->count++;
 
   return OK;
 }
 
-int MoveNode(NodeList *list1, NodeList *list2, Node *node)
+void CompactNodeList(NodeList *list, int dst, int src)
 {
-  int result;
-
-  if (list1 == NULL || list2 == NULL || node == NULL) return INTERNAL_ERROR;
-
-  result = AppendNode(list2, node->row, node->col);
-
-  if (result != OK) return result;
-
-  result = RemoveNode(list1, node);
-
-  if (result != OK) return result;
+  while (src < list->count) {
+    list->row[dst] = list->row[src];
+    list->col[dst] = list->col[src];
+    list->type[dst] = list->type[src];
+    dst++; src++;
+  }
 
-  return OK;
+  list->count = dst;
 }
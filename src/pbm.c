@@ -11,9 +11,9 @@
 #include <stdlib.h>
 #include "../include/pbm.h"
 
-int file_size(FILE *f)
+long file_size(FILE *f)
 {
-  int save_pos, size_of_file;
+  long save_pos, size_of_file;
 
   save_pos = ftell(f);
   fseek(f, 0L, SEEK_END);
@@ -86,7 +86,7 @@ int read_hdr(FILE *f, pbm_hdr *h)
   h->max_val = get_integer(f);
 
   /* (width * height * pixel_size) must be equal to the image size */
-  if (file_size(f) - ftell(f) != h->width * h->height * (h->type == PGM ? 1 : 3)) return -1;
+  if (file_size(f) - ftell(f) != (long) h->width * h->height * (h->type == PGM ? 1 : 3)) return -1;
 
   if ((h->width < 0) || (h->height < 0) || (h->max_val < 0) || (h->max_val > 255)) return -1;
 
@@ -0,0 +1,415 @@
+/*
+ * The TiLib: wavelet based lossy image compression library
+ * Copyright (C) 1998-2004 Alexander Simakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * QuikInfo:
+ *
+ * Byte oriented range coder for SPIHT. The range is 32 bits wide and is
+ * renormalized a byte at a time, so every output byte costs a single
+ * store and every input byte a single load. A carry out of low goes
+ * into the bytes held back since the last one that could not take it
+ * (one cache byte and a run of 0xff ones). Binary models are the
+ * cumulative frequencies of ari.c, updated by UpdateModel(), or with
+ * SPIHT_STATES the probability states below, which need no division.
+ *
+ * Several coders can share one stream with their bytes interleaved in
+ * the order the decoders read them: every decoder reads its first
+ * RANGE_BYTES bytes at the start and one more at every renormalization
+ * shift, which its encoder goes through at the same symbol. So each
+ * encoder keeps a stream position at these points and fills it once
+ * the byte is final, a few shifts later.
+ *
+ * References:
+ *
+ * G.N.N. Martin, "Range encoding: an algorithm for removing redundancy
+ * from a digitised message", Video & Data Recording Conference, 1979.
+ *
+ * D. Marpe, H. Schwarz, T. Wiegand, "Context-based adaptive binary
+ * arithmetic coding in the H.264/AVC video compression standard", IEEE
+ * Trans. on Circuits and Systems for Video Technology, Vol. 13, July 2003.
+ *
+ */
+
+#include <stdlib.h>
+#include "../include/ari.h"
+#include "../include/range.h"
+#include "../include/bitio.h"
+#include "../include/errcodes.h"
+
+#define MAX_STATE (62)
+
+/*
+ * Probability of the less probable symbol in state n, 2^16 * 0.5 * a^n
+ * with a = (0.01875 / 0.5)^(1/63), and the state after coding it. The
+ * state after the more probable symbol is simply the next one.
+ */
+static const unsigned short lps_prob[MAX_STATE + 1] =
+{
+  32768, 31104, 29524, 28025, 26602, 25251, 23969, 22751, 21596, 20499, 19458,
+  18470, 17532, 16642, 15797, 14995, 14233, 13510, 12824, 12173, 11555, 10968,
+  10411,  9882,  9380,  8904,  8452,  8023,  7615,  7229,  6861,  6513,  6182,
+   5868,  5570,  5287,  5019,  4764,  4522,  4292,  4074,  3868,  3671,  3485,
+   3308,  3140,  2980,  2829,  2685,  2549,  2420,  2297,  2180,  2069,  1964,
+   1864,  1770,  1680,  1595,  1514,  1437,  1364,  1295
+};
+
+static const unsigned char next_lps[MAX_STATE + 1] =
+{
+   0,  0,  1,  2,  2,  4,  4,  5,  6,  7,  8,  9,  9, 11, 11, 12,
+  13, 13, 15, 15, 16, 16, 18, 18, 19, 19, 21, 21, 22, 22, 23, 24,
+  24, 25, 26, 26, 27, 27, 28, 29, 29, 30, 30, 30, 31, 32, 32, 33,
+  33, 33, 34, 34, 35, 35, 35, 36, 36, 36, 37, 37, 37, 38, 38
+};
+
+static int ReserveSlot(RangeCoder *range_coder,
+                       BitStream *bit_stream);
+
+static int EmitByte(RangeCoder *range_coder,
+                    BitStream *bit_stream,
+                    int byte);
+
+static int ShiftLow(RangeCoder *range_coder,
+                    BitStream *bit_stream);
+
+static int Renormalize(RangeCoder *range_coder,
+                       BitStream *bit_stream);
+
+static int Refill(RangeCoder *range_coder,
+                  BitStream *bit_stream);
+
+RangeCoder *AllocRangeCoder()
+{
+  RangeCoder *range_coder;
+
+  range_coder = (RangeCoder *) malloc(sizeof(RangeCoder));
+
+  if (range_coder == NULL) return NULL;
+
+  range_coder->interleaved = 0;
+  range_coder->slots = NULL;
+  range_coder->slot_capacity = 0;
+
+  return range_coder;
+}
+
+void FreeRangeCoder(RangeCoder *range_coder)
+{
+  if (range_coder == NULL) return;
+
+  free(range_coder->slots);
+  free(range_coder);
+}
+
+static int ReserveSlot(RangeCoder *range_coder,
+                       BitStream *bit_stream)
+{
+  RangeCoder *r = range_coder;
+  int *slots, i;
+
+  if (bit_stream->next_byte >= bit_stream->buffer_end) return BUFFER_FULL;
+
+  if (r->slot_count == r->slot_capacity) {
+
+    slots = (int *) malloc((r->slot_capacity + 16) * 2 * sizeof(int));
+
+    if (slots == NULL) return MEMORY_ERROR;
+
+    for (i = 0; i < r->slot_count; i++) slots[i] = r->slots[(r->slot_first + i) % r->slot_capacity];
+
+    free(r->slots);
+
+    r->slots = slots;
+    r->slot_first = 0;
+    r->slot_capacity = (r->slot_capacity + 16) * 2;
+  }
+
+  r->slots[(r->slot_first + r->slot_count) % r->slot_capacity] = bit_stream->next_byte - bit_stream->buffer;
+  r->slot_count++;
+
+  bit_stream->next_byte++;
+
+  return OK;
+}
+
+/*
+ * An interleaved coder has no slot left only for bytes past the end of
+ * a full buffer, they are dropped.
+ */
+static int EmitByte(RangeCoder *range_coder,
+                    BitStream *bit_stream,
+                    int byte)
+{
+  RangeCoder *r = range_coder;
+
+  if (r->interleaved == 0) return WriteByte(bit_stream, byte);
+
+  if (r->slot_count == 0) return OK;
+
+  bit_stream->buffer[r->slots[r->slot_first]] = (unsigned char) byte;
+
+  r->slot_first = (r->slot_first + 1) % r->slot_capacity;
+  r->slot_count--;
+
+  return OK;
+}
+
+/*
+ * Moves the top byte of low out. It is held back while it could still
+ * be changed by a carry, that is while it is 0xff.
+ */
+static int ShiftLow(RangeCoder *range_coder,
+                    BitStream *bit_stream)
+{
+  RangeCoder *r = range_coder;
+
+  if (r->low < 0xff000000U || r->carry) {
+
+    if (r->pending > 0) {
+
+      if (EmitByte(r, bit_stream, (r->cache + r->carry) & 0xff) == BUFFER_FULL) return BUFFER_FULL;
+
+      for (; r->pending > 1; r->pending--)
+      if (EmitByte(r, bit_stream, (0xff + r->carry) & 0xff) == BUFFER_FULL) return BUFFER_FULL;
+    }
+
+    r->cache = r->low >> 24;
+    r->pending = 1;
+    r->carry = 0;
+
+  } else {
+
+    if (r->pending == 0) r->cache = 0xff;
+
+    r->pending++;
+  }
+
+  r->low <<= 8;
+
+  return OK;
+}
+
+static int Renormalize(RangeCoder *range_coder,
+                       BitStream *bit_stream)
+{
+  int result;
+
+  while (range_coder->range < RANGE_TOP) {
+
+    if (range_coder->interleaved && (result = ReserveSlot(range_coder, bit_stream)) != OK) return result;
+
+    if (ShiftLow(range_coder, bit_stream) == BUFFER_FULL) return BUFFER_FULL;
+
+    range_coder->range <<= 8;
+  }
+
+  return OK;
+}
+
+static int Refill(RangeCoder *range_coder,
+                  BitStream *bit_stream)
+{
+  int byte;
+
+  while (range_coder->range < RANGE_TOP) {
+
+    if (ReadByte(bit_stream, &byte) == BUFFER_EMPTY) return BUFFER_EMPTY;
+
+    range_coder->code = (range_coder->code << 8) | byte;
+    range_coder->range <<= 8;
+  }
+
+  return OK;
+}
+
+void InitRangeEncoder(RangeCoder *range_coder)
+{
+  range_coder->low = 0;
+  range_coder->range = 0xffffffffU;
+  range_coder->code = 0;
+  range_coder->carry = 0;
+  range_coder->cache = 0;
+  range_coder->pending = 0;
+  range_coder->interleaved = 0;
+  range_coder->slot_first = 0;
+  range_coder->slot_count = 0;
+}
+
+/*
+ * Makes a freshly initialized encoder share the stream with others: it
+ * keeps the positions of the bytes its decoder reads first. Encoders
+ * are to be set up in the order their decoders are.
+ */
+int RangeInterleave(RangeCoder *range_coder, BitStream *bit_stream)
+{
+  int i, result;
+
+  range_coder->interleaved = 1;
+
+  for (i = 0; i < RANGE_BYTES; i++)
+  if ((result = ReserveSlot(range_coder, bit_stream)) != OK) return result;
+
+  return OK;
+}
+
+int RangeEncodeSymbol(RangeCoder *r, BitStream *b, int *cum_freq, int symbol)
+{
+  unsigned int bound;
+
+  bound = (r->range / cum_freq[ALPHA_SIZE]) * cum_freq[1];
+
+  if (symbol == 0) r->range = bound;
+  else {
+
+    r->low += bound;
+    r->range -= bound;
+
+    if (r->low < bound) r->carry = 1;
+  }
+
+  return Renormalize(r, b);
+}
+
+int RangeEncodeBypass(RangeCoder *r, BitStream *b, int bit)
+{
+  r->range >>= 1;
+
+  if (bit) {
+
+    r->low += r->range;
+
+    if (r->low < r->range) r->carry = 1;
+  }
+
+  return Renormalize(r, b);
+}
+
+/*
+ * Codes a symbol with the probability of state, (index << 1) | more
+ * probable symbol, and moves state on. Starts from 0, p = 0.5.
+ */
+int RangeEncodeState(RangeCoder *r, BitStream *b, unsigned char *state, int symbol)
+{
+  unsigned int lps;
+  int index;
+
+  index = *state >> 1;
+  lps = (r->range >> 16) * lps_prob[index];
+
+  if (symbol == (*state & 1)) {
+
+    r->range -= lps;
+
+    if (index < MAX_STATE) *state += 2;
+
+  } else {
+
+    r->low += r->range - lps;
+
+    if (r->low < r->range - lps) r->carry = 1;
+
+    r->range = lps;
+
+    *state = (unsigned char) ((next_lps[index] << 1) | ((*state & 1) ^ (index == 0)));
+  }
+
+  return Renormalize(r, b);
+}
+
+/*
+ * Writes the held bytes and all of low, RANGE_BYTES bytes.
+ */
+int DoneRangeEncoder(RangeCoder *range_coder, BitStream *bit_stream)
+{
+  int i;
+
+  for (i = 0; i <= RANGE_BYTES; i++)
+  if (ShiftLow(range_coder, bit_stream) == BUFFER_FULL) return BUFFER_FULL;
+
+  return OK;
+}
+
+int InitRangeDecoder(RangeCoder *range_coder, BitStream *bit_stream)
+{
+  int i, byte;
+
+  range_coder->range = 0xffffffffU;
+  range_coder->code = 0;
+
+  for (i = 0; i < RANGE_BYTES; i++) {
+    if (ReadByte(bit_stream, &byte) == BUFFER_EMPTY) return BUFFER_EMPTY;
+    range_coder->code = (range_coder->code << 8) | byte;
+  }
+
+  return OK;
+}
+
+int RangeDecodeSymbol(RangeCoder *r, BitStream *b, int *cum_freq, int *symbol)
+{
+  unsigned int bound;
+
+  bound = (r->range / cum_freq[ALPHA_SIZE]) * cum_freq[1];
+
+  if (r->code < bound) {
+    *symbol = 0;
+    r->range = bound;
+  } else {
+    *symbol = 1;
+    r->code -= bound;
+    r->range -= bound;
+  }
+
+  return Refill(r, b);
+}
+
+int RangeDecodeState(RangeCoder *r, BitStream *b, unsigned char *state, int *symbol)
+{
+  unsigned int lps;
+  int index;
+
+  index = *state >> 1;
+  lps = (r->range >> 16) * lps_prob[index];
+
+  if (r->code < r->range - lps) {
+
+    *symbol = *state & 1;
+    r->range -= lps;
+
+    if (index < MAX_STATE) *state += 2;
+
+  } else {
+
+    *symbol = (*state & 1) ^ 1;
+    r->code -= r->range - lps;
+    r->range = lps;
+
+    *state = (unsigned char) ((next_lps[index] << 1) | ((*state & 1) ^ (index == 0)));
+  }
+
+  return Refill(r, b);
+}
+
+int RangeDecodeBypass(RangeCoder *r, BitStream *b, int *bit)
+{
+  r->range >>= 1;
+
+  if (r->code >= r->range) {
+    *bit = 1;
+    r->code -= r->range;
+  } else *bit = 0;
+
+  return Refill(r, b);
+}
@@ -35,34 +35,363 @@
  */
 
 #include <stdlib.h>
+#include <memory.h>
+#include <sys/time.h>
 #include "../include/spiht.h"
 #include "../include/ari.h"
+#include "../include/range.h"
 #include "../include/nodelist.h"
+#include "../include/magbits.h"
 #include "../include/bitio.h"
+#include "../include/taskpool.h"
+#include "../include/symbolpipe.h"
 #include "../include/errcodes.h"
 
 #define ABS(value) (value >= 0 ? value : - value)
+#define MIN(x_, y_) ((x_) < (y_) ? (x_) : (y_))
+#define MAX(x_, y_) ((x_) > (y_) ? (x_) : (y_))
 
 #define TYPE_S (0)
 #define TYPE_A (1)
 #define TYPE_B (2)
 
-static int InitialThreshold(double **dwt,
-                            int rows,
-                            int cols);
+#define EXT_HEADER (0x80)
+
+#define IN_LIP   (0x01)
+#define IN_LSP   (0x02)
+#define IN_LIS_A (0x04)
+#define IN_LIS_B (0x08)
+#define SPLIT    (0x10)
+#define REFINED  (0x20)
+
+#define KNOWN_OPTIONS (SPIHT_LISTFREE | SPIHT_BLOCKS | SPIHT_CONTEXTS | SPIHT_BYPASS | SPIHT_MARKS | SPIHT_LEVELS | SPIHT_ROI | SPIHT_RANGE | SPIHT_STATES | SPIHT_LANES)
+
+/* Adaptive models used with SPIHT_CONTEXTS, otherwise everything goes to 0 */
+
+#define CTX_SIGN     (0)  /* sign bits */
+#define CTX_REFINE   (1)  /* first and later refinement bits */
+#define CTX_SET_B    (3)  /* type B sets, by level */
+#define CTX_SET_A    (7)  /* type A sets, by level and root significance */
+#define CTX_SIG      (15) /* coefficients, by level, siblings and parent */
+#define MAX_CONTEXTS (39)
+
+#define LEVEL_CLASSES (4)
+
+/* internal to the encoder: the quality target is met, stop coding */
+#define TARGET_REACHED (-1)
+
+#define MAX_PASSES (64)
+#define MAX_RECTS  (64)
+
+#define BLOCK_COUNT (2)
+#define BLOCK_ENTRY (4)
+
+/* pass marks may take up to 1/MARKS_SHARE of a SPIHT_BLOCKS payload */
+#define MARKS_SHARE (8)
+
+/* so may the group table and the start-up bytes of the group coders */
+#define TABLE_SHARE (8)
+
+/* pass being timed for SPIHTStats */
+#define PHASE_NONE         (0)
+#define PHASE_SIGNIFICANCE (1)
+#define PHASE_REFINEMENT   (2)
+
+/* SPIHT_MORTON tiles are at most 2^MAX_TILE_BITS coefficients a side */
+#define MAX_TILE_BITS (8)
+
+/* range coders of a SPIHT_LANES group, they take the symbols in turn */
+#define LANES (4)
+
+/* contexts of the SymbolPipe marks between the passes and the arithmetic coder */
+#define PIPE_BYPASS   (MAX_CONTEXTS)     /* context of an EncodeBypass() bit */
+#define PIPE_PASS_END (MAX_CONTEXTS + 1) /* context of an EndPass() mark */
+
+typedef struct
+{
+  int rows;
+  int cols;
+
+  unsigned char *msb;
+  unsigned char *desc;
+  unsigned char *grand;
+
+  int msb_bits; /* tile bits of the three maps, see PlaneOffset() */
+  int desc_bits;
+  int grand_bits;
+
+} BitplaneMap;
+
+typedef struct
+{
+  int type;
+  int cols;
+  int tile_bits; /* 0 for raster order, see PlaneOffset() */
+
+  short *data16;
+  int *data32;
+
+} CoeffPlane;
+
+typedef struct
+{
+  int first_row;
+  int last_row;
+  int first_col;
+  int last_col;
+
+} Rect;
+
+/*
+ * Everything needed to code one group of spatial orientation trees:
+ * the trees rooted in LL band rows [first_row, last_row) together with
+ * their lists, arithmetic coder and output. Without SPIHT_BLOCKS there
+ * is a single group holding all the trees. With SPIHT_LEVELS a group is
+ * one resolution instead, see SetupLevelCoder().
+ */
+typedef struct SPIHTCoderTag
+{
+  CoeffPlane *plane;
+  BitplaneMap *map;
+
+  int rows;
+  int cols;
+  int levels;
+  int options;
+  int bits;
 
-static void ResetDWT(double **dwt,
-                     int rows,
-                     int cols);
+  int first_row;
+  int last_row;
 
+  Rect rects[MAX_RECTS];
+  int rect_count;
 
-static int IsZerotree(double **dwt,
+  NodeList *LIP;
+  NodeList *LSP;
+  NodeList *LIS;
+  int lsp_refined; /* LSP entries refined in an earlier pass, the rest are new */
+
+  unsigned char *state;
+
+  BitStream *bit_stream;
+  ArithCoder *arith_coder; /* the models always go through it */
+  RangeCoder *lanes[LANES]; /* SPIHT_RANGE, SPIHT_STATES, SPIHT_LANES: code the symbols instead */
+  int lane_count;           /* 1, LANES with SPIHT_LANES, 0 for the arithmetic coder */
+  int lane;                 /* the next symbol goes to lanes[lane] */
+
+  int models[MAX_CONTEXTS][ALPHA_SIZE + 1];
+  unsigned char states[MAX_CONTEXTS]; /* SPIHT_STATES: take the place of the models */
+
+  unsigned char *buffer;
+  int buffer_size;
+  int stream_size;
+  int full;
+
+  int pass_end[MAX_PASSES];
+  int passes;
+
+  double target;     /* squared error to stop coding at, 0 for none */
+  double energy;     /* squared error before coding, with a target */
+  double distortion; /* squared error left, tracked only with a target */
+  double pass_distortion[MAX_PASSES];
+
+  int resolution;                 /* SPIHT_LEVELS: 0 for the LL band, up to levels */
+  struct SPIHTCoderTag *coarser;  /* SPIHT_LEVELS: coder of the previous resolution */
+  NodeList *moved;                /* SPIHT_LEVELS: B-type nodes left to the next resolution */
+  int moved_end[MAX_PASSES];      /* moved->count after every significance pass */
+  int sig_passes;                 /* significance passes done */
+
+  SymbolPipe *pipe; /* single group with threads: the coder runs on its own thread */
+
+  SPIHTPassStats *stats; /* SPIHT_MAX_PLANES entries, NULL if not collected */
+  SPIHTPassStats *stat;  /* entry of the bit plane being coded */
+  int phase;             /* PHASE_* of the pass being timed */
+  double phase_start;
+  int phase_bytes;
+
+} SPIHTCoder;
+
+static int BitLength(int value);
+
+static size_t PlaneOffset(int row,
+                          int col,
+                          int cols,
+                          int tile_bits);
+
+static int TileBits(int levels,
+                    int layout);
+
+static size_t StateOffset(SPIHTCoder *coder,
+                          int row,
+                          int col);
+
+static int GetCoefficient(CoeffPlane *plane,
+                          int row,
+                          int col);
+
+static void SetCoefficient(CoeffPlane *plane,
+                           int row,
+                           int col,
+                           int value);
+
+static int InitPlane(CoeffPlane *plane,
+                     void *dwt_data,
+                     int dwt_type,
+                     int cols,
+                     int tile_bits);
+
+static int MaxPlaneBits(int dwt_type);
+
+static int HeaderSize(int options);
+
+static int WriteStreamHeader(unsigned char *buffer,
+                             int buffer_size,
+                             int bits,
+                             int options,
+                             int shift);
+
+static int ReadStreamHeader(unsigned char *buffer,
+                            int buffer_size,
+                            int *bits,
+                            int *options,
+                            int *shift);
+
+static void UndoShift(CoeffPlane *plane,
                       int rows,
                       int cols,
-                      int levels,
-                      int threshold,
+                      int shift);
+
+static BitplaneMap *AllocBitplaneMap(int rows,
+                                     int cols,
+                                     int tile_bits);
+
+static void FreeBitplaneMap(BitplaneMap *map);
+
+static int BuildBitplaneMap(CoeffPlane *plane,
+                            BitplaneMap *map);
+
+static void ResetPlane(CoeffPlane *plane,
+                       int rows,
+                       int cols);
+
+static SPIHTCoder *AllocSPIHTCoder(int options,
+                                   int stats);
+
+static void FreeSPIHTCoder(SPIHTCoder *coder);
+
+static void SetupSPIHTCoder(SPIHTCoder *coder,
+                            CoeffPlane *plane,
+                            BitplaneMap *map,
+                            unsigned char *state,
+                            int rows,
+                            int cols,
+                            int levels,
+                            int bits,
+                            int first_row,
+                            int last_row);
+
+static void SetupLevelCoder(SPIHTCoder *coder,
+                            int resolution,
+                            SPIHTCoder *coarser);
+
+static void InitModels(SPIHTCoder *coder);
+
+static double WallTime(void);
+
+static void ResetStats(SPIHTCoder *coder);
+
+static void PassStats(SPIHTCoder *coder,
+                      int phase,
+                      int threshold);
+
+static void CollectStats(SPIHTCoder **coders,
+                         int groups,
+                         SPIHTStats *stats);
+
+static int CodeSymbol(SPIHTCoder *coder,
+                      int context,
+                      int symbol);
+
+static int PutSymbol(SPIHTCoder *coder,
+                     int context,
+                     int symbol);
+
+static int CodeBypass(SPIHTCoder *coder,
+                      int bit);
+
+static int PutBypass(SPIHTCoder *coder,
+                     int bit);
+
+static int GetSymbol(SPIHTCoder *coder,
+                     int context,
+                     int *symbol);
+
+static int GetBypass(SPIHTCoder *coder,
+                     int *bit);
+
+static RangeCoder *NextLane(SPIHTCoder *coder);
+
+static int StartEncoder(SPIHTCoder *coder);
+
+static int FinishEncoder(SPIHTCoder *coder);
+
+static int StartDecoder(SPIHTCoder *coder);
+
+static int NodeLevel(SPIHTCoder *coder,
+                     int row,
+                     int col);
+
+static int SignificanceContext(SPIHTCoder *coder,
+                               int row,
+                               int col);
+
+static int SetContext(SPIHTCoder *coder,
+                      int node_type,
                       Node *node);
 
+static int RefinementContext(SPIHTCoder *coder,
+                             int row,
+                             int col);
+
+static void MarkSignificant(SPIHTCoder *coder,
+                            int row,
+                            int col);
+
+static double SquaredError(int magnitude,
+                           int step);
+
+static double GroupEnergy(SPIHTCoder *coder);
+
+static double GroupArea(SPIHTCoder *coder);
+
+static int ReduceDistortion(SPIHTCoder *coder,
+                            int magnitude,
+                            int known,
+                            int step);
+
+static int PutSign(SPIHTCoder *coder,
+                   int row,
+                   int col,
+                   int threshold,
+                   int sign);
+
+static int GetSign(SPIHTCoder *coder,
+                   int *sign);
+
+static int PutRefinement(SPIHTCoder *coder,
+                         int row,
+                         int col,
+                         int magnitude,
+                         int threshold,
+                         int refined,
+                         int bit);
+
+static int GetRefinement(SPIHTCoder *coder,
+                         int row,
+                         int col,
+                         int refined,
+                         int *bit);
+
 static int IsValidNodeA(int rows,
                         int cols,
                         int levels,
@@ -81,829 +410,3791 @@ static int GetNodeOffspring(int rows,
                             Node *node,
                             Node *offspring);
 
-static int IsNodeSignificant(double **dwt,
-                             int rows,
-                             int cols,
-                             int levels,
-                             int threshold,
+static int IsNodeSignificant(BitplaneMap *map,
+                             int bits,
                              int node_type,
                              Node *node);
 
-static void InitCoefficient(double **dwt,
+static void InitCoefficient(CoeffPlane *plane,
                             int threshold,
                             int sign,
                             Node *node);
 
-static int SPIHTInit(int rows,
-                     int cols,
-                     int levels,
-                     NodeList *LIP,
-                     NodeList *LIS);
-
-static int SPIHTEncodeSignificancePass(double **dwt,
-                                       int rows,
-                                       int cols,
-                                       int levels,
-                                       int threshold,
-                                       NodeList *LIP,
-                                       NodeList *LSP,
-                                       NodeList *LIS,
-                                       BitStream *bit_stream,
-                                       ArithCoder *arith_coder);
-
-static int SPIHTEncodeRefinementPass(double **dwt,
-                                     int threshold,
-                                     NodeList *LSP,
-                                     BitStream *bit_stream,
-                                     ArithCoder *arith_coder);
-
-static int SPIHTDecodeSignificancePass(double **dwt,
-                                       int rows,
-                                       int cols,
-                                       int levels,
-                                       int threshold,
-                                       NodeList *LIP,
-                                       NodeList *LSP,
-                                       NodeList *LIS,
-                                       BitStream *bit_stream,
-                                       ArithCoder *arith_coder);
-
-static int SPIHTDecodeRefinementPass(double **dwt,
-                                     int threshold,
-                                     NodeList *LSP,
-                                     BitStream *bit_stream,
-                                     ArithCoder *arith_coder);
-
-static int InitialThreshold(double **dwt,
-                            int rows,
-                            int cols)
+static void ClearState(SPIHTCoder *coder);
+
+static int SPIHTInit(SPIHTCoder *coder);
+
+static int TakeMoved(SPIHTCoder *coder);
+
+static int SPIHTEncodeSignificancePass(SPIHTCoder *coder,
+                                       int threshold);
+
+static int SPIHTEncodeRefinementPass(SPIHTCoder *coder,
+                                     int threshold);
+
+static int SPIHTDecodeSignificancePass(SPIHTCoder *coder,
+                                       int threshold);
+
+static int SPIHTDecodeRefinementPass(SPIHTCoder *coder,
+                                     int threshold);
+
+static void StateMapInit(SPIHTCoder *coder);
+
+static int StateMapEncodeSet(SPIHTCoder *coder,
+                             int bits,
+                             Node *node);
+
+static int StateMapEncodeSignificancePass(SPIHTCoder *coder,
+                                          int threshold);
+
+static int StateMapEncodeRefinementPass(SPIHTCoder *coder,
+                                        int threshold);
+
+static int StateMapDecodeSet(SPIHTCoder *coder,
+                             int threshold,
+                             Node *node);
+
+static int StateMapDecodeSignificancePass(SPIHTCoder *coder,
+                                          int threshold);
+
+static int StateMapDecodeRefinementPass(SPIHTCoder *coder,
+                                        int threshold);
+
+static unsigned char *WaitData(SPIHTParams *params,
+                               unsigned char *need,
+                               unsigned char *end);
+
+static void EndPass(SPIHTCoder *coder);
+
+static int MarkPass(SPIHTCoder *coder);
+
+static int PipeSymbol(SPIHTCoder *coder,
+                      int context,
+                      int symbol);
+
+static int CodeChunk(void *arg,
+                     QueuedSymbol *symbols,
+                     int count);
+
+static int DecodablePasses(SPIHTCoder *coder);
+
+static double CutDistortion(SPIHTCoder *coder,
+                            int size);
+
+static int EncodeGroup(void *task);
+
+static int EncodePipelined(SPIHTCoder *coder);
+
+static int DecodeGroup(void *task);
+
+static double GroupWeight(SPIHTCoder *coder);
+
+static int PassEnd(SPIHTCoder *coder,
+                   int pass);
+
+static void AllocateBudget(SPIHTCoder **coders,
+                           int groups,
+                           int budget,
+                           int *alloc);
+
+static int MarkCount(SPIHTCoder *coder,
+                     int size);
+
+static int MarksSize(SPIHTCoder **coders,
+                     int groups,
+                     int *alloc);
+
+static unsigned char *WriteMarks(SPIHTCoder **coders,
+                                 int groups,
+                                 int *alloc,
+                                 unsigned char *ptr);
+
+static int ReadMarks(SPIHTCoder **coders,
+                     int groups,
+                     unsigned char *ptr,
+                     unsigned char *end);
+
+static int PlanBlocks(SPIHTCoder **coders,
+                      int groups,
+                      int marks,
+                      int buffer_size,
+                      int *alloc);
+
+static int TargetSize(SPIHTCoder **coders,
+                      int groups,
+                      int marks,
+                      int buffer_size);
+
+static void WriteBlocks(SPIHTCoder **coders,
+                        int groups,
+                        int *alloc,
+                        int marks,
+                        unsigned char *buffer,
+                        int *stream_size);
+
+static int EncodeBlocks(SPIHTCoder **coders,
+                        int groups,
+                        int threads,
+                        int marks,
+                        unsigned char **buffers,
+                        int *buffer_sizes,
+                        int *stream_sizes,
+                        int *marked,
+                        int count);
+
+static int GroupCount(int options,
+                      int blocks,
+                      int rows,
+                      int levels,
+                      int payload_size);
+
+static SPIHTCoder **AllocGroups(int groups,
+                                int options,
+                                int stats,
+                                CoeffPlane *plane,
+                                BitplaneMap *map,
+                                unsigned char *state,
+                                int rows,
+                                int cols,
+                                int levels,
+                                int bits,
+                                double target_mse);
+
+static void FreeGroups(SPIHTCoder **coders,
+                       int groups);
+
+static int BitLength(int value)
 {
-  int temp, bits;
-  int row, col;
+  int bits;
 
-  temp = bits = 0;
+  for (bits = 0; value != 0; bits++) value >>= 1;
 
-  for (row = 0; row < rows; row++)
-    for (col = 0; col < cols; col++)
-      if (ABS(dwt[row][col]) > temp) temp = (int) ABS(dwt[row][col]);
+  return bits;
+}
+
+/*
+ * Offset of (row, col) in a plane cols wide. With tile_bits > 0 the
+ * plane is cut into 2^tile_bits square tiles stored in raster order,
+ * each of them in Morton (Z) order inside: the offspring of a node are
+ * four adjacent entries, and all its descendants at any level down to
+ * the tile size are a contiguous run.
+ */
+static size_t PlaneOffset(int row,
+                          int col,
+                          int cols,
+                          int tile_bits)
+{
+  unsigned int mask, r, c;
 
-  if (temp == 0) return 0;
+  if (tile_bits == 0) return (size_t) row * cols + col;
 
-  while (temp != 0) {
-    temp >>= 1;
-    bits++;
-  }
+  mask = (1 << tile_bits) - 1;
 
-  return (1 << (bits - 1));
+  r = row & mask;
+  c = col & mask;
+
+  /* spread the low bits apart, 8 of them at most */
+  r = (r | (r << 4)) & 0x0f0f;
+  r = (r | (r << 2)) & 0x3333;
+  r = (r | (r << 1)) & 0x5555;
+
+  c = (c | (c << 4)) & 0x0f0f;
+  c = (c | (c << 2)) & 0x3333;
+  c = (c | (c << 1)) & 0x5555;
+
+  return (((size_t) (row >> tile_bits) * cols + (col & ~mask)) << tile_bits) + ((r << 1) | c);
 }
 
-static void ResetDWT(double **dwt,
-                     int rows,
-                     int cols)
+/*
+ * Planes are aligned to 2^levels, so tiles of that size always fit.
+ */
+static int TileBits(int levels,
+                    int layout)
 {
-  int row, col;
+  if (layout != SPIHT_MORTON) return 0;
 
-  for (row = 0; row < rows; row++)
-    for (col = 0; col < cols; col++)
-      dwt[row][col] = 0;
+  return MIN(levels, MAX_TILE_BITS);
 }
 
-static int IsZerotree(double **dwt,
-                      int rows,
-                      int cols,
-                      int levels,
-                      int threshold,
-                      Node *node)
+static size_t StateOffset(SPIHTCoder *coder,
+                          int row,
+                          int col)
 {
-  int min_row, max_row, min_col, max_col;
-  int row, col;
+  return PlaneOffset(row, col, coder->cols, coder->plane->tile_bits);
+}
 
-  row = ABS(node->row);
-  col = ABS(node->col);
+static int GetCoefficient(CoeffPlane *plane,
+                          int row,
+                          int col)
+{
+  size_t offs;
 
-  if (row < rows >> levels && col < cols >> levels) return INTERNAL_ERROR;
+  offs = PlaneOffset(row, col, plane->cols, plane->tile_bits);
 
-  if (row >= rows >> 1 || col >= cols >> 1) return INTERNAL_ERROR;
+  if (plane->type == SPIHT_INT16) return plane->data16[offs];
 
-  min_row = row << 1;
-  max_row = (row + 1) << 1;
-  min_col = col << 1;
-  max_col = (col + 1) << 1;
+  return plane->data32[offs];
+}
 
-  while (max_row <= rows && max_col <= cols) {
-    for (row = min_row; row < max_row; row++)
-      for (col = min_col; col < max_col; col++)
-        if (ABS(dwt[row][col]) >= threshold) return FALSE;
+static void SetCoefficient(CoeffPlane *plane,
+                           int row,
+                           int col,
+                           int value)
+{
+  size_t offs;
 
-    min_row <<= 1;
-    max_row <<= 1;
-    min_col <<= 1;
-    max_col <<= 1;
-  }
+  offs = PlaneOffset(row, col, plane->cols, plane->tile_bits);
 
-  return TRUE;
+  if (plane->type == SPIHT_INT16) plane->data16[offs] = (short) value;
+  else plane->data32[offs] = value;
 }
 
-static int IsValidNodeA(int rows,
-                        int cols,
-                        int levels,
-                        Node *node)
+static int InitPlane(CoeffPlane *plane,
+                     void *dwt_data,
+                     int dwt_type,
+                     int cols,
+                     int tile_bits)
 {
-  int row, col;
+  plane->type = dwt_type;
+  plane->cols = cols;
+  plane->tile_bits = tile_bits;
+  plane->data16 = NULL;
+  plane->data32 = NULL;
 
-  row = ABS(node->row);
-  col = ABS(node->col);
+  if (dwt_type == SPIHT_INT16) plane->data16 = (short *) dwt_data;
+  else if (dwt_type == SPIHT_INT32) plane->data32 = (int *) dwt_data;
+  else return BAD_PARAMS;
 
-  if (row < rows >> levels && col < cols >> levels) return FALSE;
+  return OK;
+}
 
-  if (row >= rows >> 1 || col >= cols >> 1) return FALSE;
+/*
+ * Decoded magnitudes stay below 2^bits, so a plane can hold any stream
+ * whose bit length does not exceed the width of its magnitude part.
+ */
+static int MaxPlaneBits(int dwt_type)
+{
+  return (dwt_type == SPIHT_INT16 ? 15 : 31);
+}
 
-  return TRUE;
+static int HeaderSize(int options)
+{
+  if (options == 0) return 1;
+
+  return (options & SPIHT_ROI ? 4 : 3);
 }
 
-static int IsValidNodeB(int rows,
-                        int cols,
-                        int levels,
-                        Node *node)
+/*
+ * The first byte of a stream holds the bit length of the largest
+ * coefficient magnitude. If EXT_HEADER is set in it, a 16-bit word
+ * of SPIHT_* options follows, and with SPIHT_ROI a byte with the
+ * shift of the region coefficients.
+ */
+static int WriteStreamHeader(unsigned char *buffer,
+                             int buffer_size,
+                             int bits,
+                             int options,
+                             int shift)
 {
-  int row, col;
+  if (buffer_size < HeaderSize(options)) return 0;
 
-  row = ABS(node->row);
-  col = ABS(node->col);
+  if (options == 0) {
 
-  if (row < rows >> levels && col < cols >> levels) return FALSE;
+    buffer[0] = (unsigned char) bits;
 
-  if (row >= rows >> 2 || col >= cols >> 2) return FALSE;
+    return 1;
+  }
 
-  return TRUE;
+  buffer[0] = (unsigned char) (bits | EXT_HEADER);
+  buffer[1] = (unsigned char) ((options >> 8) & 0xff);
+  buffer[2] = (unsigned char) ((options >> 0) & 0xff);
+
+  if (options & SPIHT_ROI) buffer[3] = (unsigned char) shift;
+
+  return HeaderSize(options);
 }
 
-static void ChangeNodeType(Node *node)
+static int ReadStreamHeader(unsigned char *buffer,
+                            int buffer_size,
+                            int *bits,
+                            int *options,
+                            int *shift)
 {
-  node->row = - node->row;
-  node->col = - node->col;
+  if (buffer_size < 1) return 0;
+
+  *bits = buffer[0] & ~EXT_HEADER;
+  *options = 0;
+  *shift = 0;
+
+  if ((buffer[0] & EXT_HEADER) == 0) return 1;
+
+  if (buffer_size < 3) return 0;
+
+  *options = (buffer[1] << 8) | buffer[2];
+
+  if (buffer_size < HeaderSize(*options)) return 0;
+
+  if (*options & SPIHT_ROI) *shift = buffer[3];
+
+  return HeaderSize(*options);
 }
 
-static int GetNodeOffspring(int rows,
-                            int cols,
-                            int levels,
-                            Node *node,
-                            Node *offspring)
+/*
+ * Maxshift: the encoder scaled the region coefficients up by 2^shift,
+ * above every other magnitude, so whatever is at least 2^shift after
+ * decoding belongs to the region and is scaled back, to the nearest.
+ */
+static void UndoShift(CoeffPlane *plane,
+                      int rows,
+                      int cols,
+                      int shift)
 {
-  int row, col;
+  int row, col, value;
 
-  row = ABS(node->row);
-  col = ABS(node->col);
+  for (row = 0; row < rows; row++)
+  for (col = 0; col < cols; col++) {
 
-  if (IsValidNodeA(rows, cols, levels, node) == FALSE) return INTERNAL_ERROR;
+    value = GetCoefficient(plane, row, col);
 
-  offspring[0].row = row << 1;
-  offspring[0].col = col << 1;
-  offspring[0].next = NULL;
-  offspring[0].prev = NULL;
+    if (ABS(value) >> shift == 0) continue;
 
-  offspring[1].row = row << 1;
-  offspring[1].col = (col << 1) + 1;
-  offspring[1].next = NULL;
-  offspring[1].prev = NULL;
+    value = (ABS(value) + (1 << (shift - 1))) >> shift;
 
-  offspring[2].row = (row << 1) + 1;
-  offspring[2].col = col << 1;
-  offspring[2].next = NULL;
-  offspring[2].prev = NULL;
+    SetCoefficient(plane, row, col, GetCoefficient(plane, row, col) < 0 ? -value : value);
+  }
+}
 
-  offspring[3].row = (row << 1) + 1;
-  offspring[3].col = (col << 1) + 1;
-  offspring[3].next = NULL;
-  offspring[3].prev = NULL;
+static BitplaneMap *AllocBitplaneMap(int rows,
+                                     int cols,
+                                     int tile_bits)
+{
+  BitplaneMap *map;
 
-  return OK;
+  map = (BitplaneMap *) malloc(sizeof(BitplaneMap));
+
+  if (map == NULL) return NULL;
+
+  map->rows = rows;
+  map->cols = cols;
+
+  /* the desc and grand maps are aligned to 2^(levels - 1) and 2^(levels - 2) */
+  map->msb_bits = tile_bits;
+  map->desc_bits = MAX(tile_bits - 1, 0);
+  map->grand_bits = MAX(tile_bits - 2, 0);
+
+  map->msb = (unsigned char *) malloc((size_t) rows * cols);
+  map->desc = (unsigned char *) malloc((size_t) (rows >> 1) * (cols >> 1));
+  map->grand = (unsigned char *) malloc((size_t) (rows >> 2) * (cols >> 2) + 1);
+
+  if (map->msb == NULL || map->desc == NULL || map->grand == NULL) {
+    FreeBitplaneMap(map);
+    return NULL;
+  }
+
+  return map;
 }
 
-static int IsNodeSignificant(double **dwt,
-                             int rows,
-                             int cols,
-                             int levels,
-                             int threshold,
-                             int node_type,
-                             Node *node)
+static void FreeBitplaneMap(BitplaneMap *map)
 {
-  Node offspring[4];
-  int row, col;
-  int result;
-  int index;
+  if (map == NULL) return;
+
+  free(map->msb);
+  free(map->desc);
+  free(map->grand);
+  free(map);
+}
+
+/*
+ * Fills the map with bit lengths of coefficient magnitudes (msb), their
+ * maximum over all descendants of a node (desc) and over all descendants
+ * of the node offspring (grand). Any significance test at threshold
+ * 2^(n-1) then becomes a single "bit length >= n" compare. Returns the
+ * bit length of the largest magnitude in the plane.
+ */
+static int BuildBitplaneMap(CoeffPlane *plane,
+                            BitplaneMap *map)
+{
+  int rows, cols, half_rows, half_cols;
+  int row, col, max_bits, bits, index;
+  int off_row, off_col;
+
+  rows = map->rows;
+  cols = map->cols;
+  half_rows = rows >> 1;
+  half_cols = cols >> 1;
+
+  /* msb is laid out like the plane, so it is filled sample by sample */
+  if (plane->type == SPIHT_INT16) max_bits = MagnitudeBits16(plane->data16, map->msb, (size_t) rows * cols);
+  else max_bits = MagnitudeBits32(plane->data32, map->msb, (size_t) rows * cols);
+
+  /* node (0, 0) lies in the LL band and is its own offspring */
+  map->desc[0] = 0;
+
+  for (row = half_rows - 1; row >= 0; row--) {
+    for (col = half_cols - 1; col >= 0; col--) {
+
+      bits = 0;
+
+      for (index = 0; index < 4; index++) {
+
+        off_row = (row << 1) + (index >> 1);
+        off_col = (col << 1) + (index & 1);
+
+        if (map->msb[PlaneOffset(off_row, off_col, cols, map->msb_bits)] > bits)
+        bits = map->msb[PlaneOffset(off_row, off_col, cols, map->msb_bits)];
+
+        if (off_row < half_rows && off_col < half_cols &&
+            map->desc[PlaneOffset(off_row, off_col, half_cols, map->desc_bits)] > bits)
+        bits = map->desc[PlaneOffset(off_row, off_col, half_cols, map->desc_bits)];
+      }
+
+      map->desc[PlaneOffset(row, col, half_cols, map->desc_bits)] = (unsigned char) bits;
+    }
+  }
+
+  for (row = 0; row < rows >> 2; row++) {
+    for (col = 0; col < cols >> 2; col++) {
+
+      bits = 0;
+
+      for (index = 0; index < 4; index++) {
+
+        off_row = (row << 1) + (index >> 1);
+        off_col = (col << 1) + (index & 1);
+
+        if (map->desc[PlaneOffset(off_row, off_col, half_cols, map->desc_bits)] > bits)
+        bits = map->desc[PlaneOffset(off_row, off_col, half_cols, map->desc_bits)];
+      }
+
+      map->grand[PlaneOffset(row, col, cols >> 2, map->grand_bits)] = (unsigned char) bits;
+    }
+  }
+
+  return max_bits;
+}
+
+static void ResetPlane(CoeffPlane *plane,
+                       int rows,
+                       int cols)
+{
+  if (plane->type == SPIHT_INT16) memset(plane->data16, 0, (size_t) rows * cols * sizeof(short));
+  else memset(plane->data32, 0, (size_t) rows * cols * sizeof(int));
+}
+
+static SPIHTCoder *AllocSPIHTCoder(int options,
+                                   int stats)
+{
+  SPIHTCoder *coder;
+  int index;
+
+  coder = (SPIHTCoder *) malloc(sizeof(SPIHTCoder));
+
+  if (coder == NULL) return NULL;
+
+  coder->options = options;
+  coder->target = 0;
+  coder->distortion = 0;
+
+  coder->LIP = coder->LSP = coder->LIS = NULL;
+  coder->moved = NULL;
+  coder->coarser = NULL;
+  coder->resolution = 0;
+  coder->sig_passes = 0;
+  coder->buffer = NULL;
+  coder->pipe = NULL;
+  coder->stats = NULL;
+  coder->stat = NULL;
+  coder->phase = PHASE_NONE;
+
+  coder->bit_stream = AllocBitStream();
+  coder->arith_coder = AllocArithCoder();
+
+  if (options & SPIHT_LANES) coder->lane_count = LANES;
+  else coder->lane_count = (options & (SPIHT_RANGE | SPIHT_STATES) ? 1 : 0);
+
+  for (index = 0; index < LANES; index++) coder->lanes[index] = NULL;
+
+  if (coder->bit_stream == NULL || coder->arith_coder == NULL) {
+    FreeSPIHTCoder(coder);
+    return NULL;
+  }
+
+  for (index = 0; index < coder->lane_count; index++) {
+
+    coder->lanes[index] = AllocRangeCoder();
+
+    if (coder->lanes[index] == NULL) {
+      FreeSPIHTCoder(coder);
+      return NULL;
+    }
+  }
+
+  if (stats) {
+
+    coder->stats = (SPIHTPassStats *) malloc(SPIHT_MAX_PLANES * sizeof(SPIHTPassStats));
+
+    if (coder->stats == NULL) {
+      FreeSPIHTCoder(coder);
+      return NULL;
+    }
+
+    ResetStats(coder);
+  }
+
+  if ((options & SPIHT_LISTFREE) == 0) {
+
+    coder->LIP = AllocNodeList();
+    coder->LSP = AllocNodeList();
+    coder->LIS = AllocNodeList();
+
+    if (coder->LIP == NULL || coder->LSP == NULL || coder->LIS == NULL) {
+      FreeSPIHTCoder(coder);
+      return NULL;
+    }
+  }
+
+  if (options & SPIHT_LEVELS) {
+
+    coder->moved = AllocNodeList();
+
+    if (coder->moved == NULL) {
+      FreeSPIHTCoder(coder);
+      return NULL;
+    }
+  }
+
+  return coder;
+}
+
+static void FreeSPIHTCoder(SPIHTCoder *coder)
+{
+  int index;
+
+  if (coder == NULL) return;
+
+  FreeArithCoder(coder->arith_coder);
+
+  for (index = 0; index < LANES; index++) FreeRangeCoder(coder->lanes[index]);
+
+  FreeBitStream(coder->bit_stream);
+
+  FreeNodeList(coder->LIP);
+  FreeNodeList(coder->LSP);
+  FreeNodeList(coder->LIS);
+  FreeNodeList(coder->moved);
+
+  free(coder->stats);
+  free(coder);
+}
+
+/*
+ * Binds the coder to its trees. With SPIHT_BLOCKS the coefficients of
+ * a group are those of its LL band rows in every subband, so they are
+ * collected as two rectangles per scale; a single group simply owns the
+ * whole plane.
+ */
+static void SetupSPIHTCoder(SPIHTCoder *coder,
+                            CoeffPlane *plane,
+                            BitplaneMap *map,
+                            unsigned char *state,
+                            int rows,
+                            int cols,
+                            int levels,
+                            int bits,
+                            int first_row,
+                            int last_row)
+{
+  int ll_rows, ll_cols, scale;
+  Rect *rect;
+
+  coder->plane = plane;
+  coder->map = map;
+  coder->state = state;
+
+  coder->rows = rows;
+  coder->cols = cols;
+  coder->levels = levels;
+  coder->bits = bits;
+
+  coder->first_row = first_row;
+  coder->last_row = last_row;
+
+  if ((coder->options & SPIHT_BLOCKS) == 0) {
+
+    coder->rects[0].first_row = 0;
+    coder->rects[0].last_row = rows;
+    coder->rects[0].first_col = 0;
+    coder->rects[0].last_col = cols;
+
+    coder->rect_count = 1;
+
+    return;
+  }
+
+  ll_rows = rows >> levels;
+  ll_cols = cols >> levels;
+
+  rect = coder->rects;
+
+  for (scale = 0; scale < levels; scale++) {
+
+    rect->first_row = first_row << scale;
+    rect->last_row = last_row << scale;
+    rect->first_col = (scale == 0 ? 0 : ll_cols << scale);
+    rect->last_col = (ll_cols << 1) << scale;
+    rect++;
+
+    rect->first_row = (ll_rows + first_row) << scale;
+    rect->last_row = (ll_rows + last_row) << scale;
+    rect->first_col = 0;
+    rect->last_col = (ll_cols << 1) << scale;
+    rect++;
+  }
+
+  coder->rect_count = rect - coder->rects;
+}
+
+/*
+ * With SPIHT_LEVELS the plane is coded one resolution at a time: the LL
+ * band first, then the detail subbands of every scale from the coarsest
+ * one on, each into its own sub-stream. A set test belongs to the
+ * resolution of the coefficients it decides about, so an A-type node is
+ * coded with its offspring and a B-type node with its grandchildren.
+ * The only thing a resolution hands over to the next one is the B-type
+ * nodes it makes in every pass, which the next resolution takes into
+ * its LIS in the same pass; coding a resolution never depends on the
+ * finer ones.
+ */
+static void SetupLevelCoder(SPIHTCoder *coder,
+                            int resolution,
+                            SPIHTCoder *coarser)
+{
+  int ll_rows, ll_cols, scale;
+
+  coder->resolution = resolution;
+  coder->coarser = coarser;
+
+  ll_rows = coder->rows >> coder->levels;
+  ll_cols = coder->cols >> coder->levels;
+
+  if (resolution == 0) {
+
+    coder->rects[0].first_row = 0;
+    coder->rects[0].last_row = ll_rows;
+    coder->rects[0].first_col = 0;
+    coder->rects[0].last_col = ll_cols;
+
+    coder->rect_count = 1;
+
+    return;
+  }
+
+  scale = resolution - 1;
+
+  coder->rects[0].first_row = 0;
+  coder->rects[0].last_row = ll_rows << scale;
+  coder->rects[0].first_col = ll_cols << scale;
+  coder->rects[0].last_col = (ll_cols << 1) << scale;
+
+  coder->rects[1].first_row = ll_rows << scale;
+  coder->rects[1].last_row = (ll_rows << 1) << scale;
+  coder->rects[1].first_col = 0;
+  coder->rects[1].last_col = (ll_cols << 1) << scale;
+
+  coder->rect_count = 2;
+}
+
+static void InitModels(SPIHTCoder *coder)
+{
+  int context;
+
+  for (context = 0; context < MAX_CONTEXTS; context++) {
+    coder->arith_coder->cum_freq = coder->models[context];
+    InitModel(coder->arith_coder);
+  }
+
+  memset(coder->states, 0, sizeof(coder->states));
+}
+
+static double WallTime(void)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+
+  return now.tv_sec + now.tv_usec * 1e-6;
+}
+
+static void ResetStats(SPIHTCoder *coder)
+{
+  if (coder->stats == NULL) return;
+
+  memset(coder->stats, 0, SPIHT_MAX_PLANES * sizeof(SPIHTPassStats));
+
+  coder->stat = NULL;
+  coder->phase = PHASE_NONE;
+}
+
+/*
+ * Closes the pass being timed, if any, and starts timing the given
+ * phase of the bit plane with this threshold. The decision counts go
+ * to the entry of that plane until the next one starts.
+ */
+static void PassStats(SPIHTCoder *coder,
+                      int phase,
+                      int threshold)
+{
+  double now;
+  int bytes;
+
+  if (coder->stats == NULL) return;
+
+  now = WallTime();
+  bytes = (int) (BitPosition(coder->bit_stream) >> 3);
+
+  if (coder->phase == PHASE_SIGNIFICANCE) {
+    coder->stat->sig_time += now - coder->phase_start;
+    coder->stat->sig_bytes += bytes - coder->phase_bytes;
+  } else if (coder->phase == PHASE_REFINEMENT) {
+    coder->stat->ref_time += now - coder->phase_start;
+    coder->stat->ref_bytes += bytes - coder->phase_bytes;
+  }
+
+  coder->phase = phase;
+  coder->phase_start = now;
+  coder->phase_bytes = bytes;
+
+  if (phase != PHASE_SIGNIFICANCE) return;
+
+  coder->stat = &coder->stats[coder->bits - BitLength(threshold)];
+  coder->stat->threshold = threshold;
+
+  if (coder->LIP != NULL) {
+    coder->stat->lip = coder->LIP->count;
+    coder->stat->lsp = coder->LSP->count;
+    coder->stat->lis = coder->LIS->count;
+  }
+}
+
+/*
+ * Sums the statistics of the groups up, plane by plane.
+ */
+static void CollectStats(SPIHTCoder **coders,
+                         int groups,
+                         SPIHTStats *stats)
+{
+  SPIHTPassStats *sum, *entry;
+  int index, plane;
+
+  memset(stats, 0, sizeof(SPIHTStats));
+
+  for (index = 0; index < groups; index++)
+  for (plane = 0; plane < SPIHT_MAX_PLANES; plane++) {
+
+    entry = &coders[index]->stats[plane];
+    sum = &stats->plane[plane];
+
+    if (entry->threshold == 0) continue;
+
+    if (plane >= stats->planes) stats->planes = plane + 1;
+
+    sum->threshold = entry->threshold;
+    sum->lip += entry->lip;
+    sum->lsp += entry->lsp;
+    sum->lis += entry->lis;
+    sum->coeffs += entry->coeffs;
+    sum->sets_a += entry->sets_a;
+    sum->sets_b += entry->sets_b;
+    sum->signs += entry->signs;
+    sum->refinements += entry->refinements;
+    sum->sig_bytes += entry->sig_bytes;
+    sum->ref_bytes += entry->ref_bytes;
+    sum->sig_time += entry->sig_time;
+    sum->ref_time += entry->ref_time;
+  }
+}
+
+static int CodeSymbol(SPIHTCoder *coder,
+                      int context,
+                      int symbol)
+{
+  int result;
+
+  if (coder->options & SPIHT_STATES) return RangeEncodeState(NextLane(coder), coder->bit_stream, &coder->states[context], symbol);
+
+  coder->arith_coder->cum_freq = coder->models[context];
+
+  if (coder->lane_count > 0) result = RangeEncodeSymbol(NextLane(coder), coder->bit_stream, coder->models[context], symbol);
+  else result = EncodeSymbol(coder->arith_coder, coder->bit_stream, symbol);
+
+  if (result != OK) return result;
+
+  UpdateModel(coder->arith_coder, symbol);
+
+  return OK;
+}
+
+static int CodeBypass(SPIHTCoder *coder,
+                      int bit)
+{
+  if (coder->lane_count > 0) return RangeEncodeBypass(NextLane(coder), coder->bit_stream, bit);
+
+  return EncodeBypass(coder->arith_coder, coder->bit_stream, bit);
+}
+
+static int PutSymbol(SPIHTCoder *coder,
+                     int context,
+                     int symbol)
+{
+  if (coder->pipe != NULL) return PipeSymbol(coder, context, symbol);
+
+  return CodeSymbol(coder, context, symbol);
+}
+
+static int PutBypass(SPIHTCoder *coder,
+                     int bit)
+{
+  if (coder->pipe != NULL) return PipeSymbol(coder, PIPE_BYPASS, bit);
+
+  return CodeBypass(coder, bit);
+}
+
+static int GetSymbol(SPIHTCoder *coder,
+                     int context,
+                     int *symbol)
+{
+  int result;
+
+  if (coder->options & SPIHT_STATES) return RangeDecodeState(NextLane(coder), coder->bit_stream, &coder->states[context], symbol);
+
+  coder->arith_coder->cum_freq = coder->models[context];
+
+  if (coder->lane_count > 0) result = RangeDecodeSymbol(NextLane(coder), coder->bit_stream, coder->models[context], symbol);
+  else result = DecodeSymbol(coder->arith_coder, coder->bit_stream, symbol);
+
+  if (result != OK) return result;
+
+  UpdateModel(coder->arith_coder, *symbol);
+
+  return OK;
+}
+
+static int GetBypass(SPIHTCoder *coder,
+                     int *bit)
+{
+  if (coder->lane_count > 0) return RangeDecodeBypass(NextLane(coder), coder->bit_stream, bit);
+
+  return DecodeBypass(coder->arith_coder, coder->bit_stream, bit);
+}
+
+/*
+ * SPIHT_LANES: symbols go to the range coders in turn, so decoding one
+ * does not have to wait for the renormalization of the one before.
+ */
+static RangeCoder *NextLane(SPIHTCoder *coder)
+{
+  RangeCoder *range_coder;
+
+  range_coder = coder->lanes[coder->lane];
+
+  if (++coder->lane == coder->lane_count) coder->lane = 0;
+
+  return range_coder;
+}
+
+static int StartEncoder(SPIHTCoder *coder)
+{
+  int index, result;
+
+  coder->lane = 0;
+
+  if (coder->lane_count == 0) {
+    InitEncoder(coder->arith_coder);
+    return OK;
+  }
+
+  for (index = 0; index < coder->lane_count; index++) InitRangeEncoder(coder->lanes[index]);
+
+  if ((coder->options & SPIHT_LANES) == 0) return OK;
+
+  for (index = 0; index < coder->lane_count; index++)
+  if ((result = RangeInterleave(coder->lanes[index], coder->bit_stream)) != OK) return result;
+
+  return OK;
+}
+
+static int FinishEncoder(SPIHTCoder *coder)
+{
+  int index;
+
+  if (coder->lane_count == 0) return DoneEncoder(coder->arith_coder, coder->bit_stream);
+
+  for (index = 0; index < coder->lane_count; index++)
+  if (DoneRangeEncoder(coder->lanes[index], coder->bit_stream) == BUFFER_FULL) return BUFFER_FULL;
+
+  return OK;
+}
+
+static int StartDecoder(SPIHTCoder *coder)
+{
+  int index, result;
+
+  coder->lane = 0;
+
+  if (coder->lane_count == 0) return InitDecoder(coder->arith_coder, coder->bit_stream);
+
+  for (index = 0; index < coder->lane_count; index++)
+  if ((result = InitRangeDecoder(coder->lanes[index], coder->bit_stream)) != OK) return result;
+
+  return OK;
+}
+
+/*
+ * Returns 0 for the finest detail subbands up to levels for the LL band.
+ */
+static int NodeLevel(SPIHTCoder *coder,
+                     int row,
+                     int col)
+{
+  int level;
+
+  for (level = 0; level < coder->levels; level++)
+  if (row >= coder->rows >> (level + 1) || col >= coder->cols >> (level + 1)) break;
+
+  return level;
+}
+
+/*
+ * Context of a coefficient significance decision: its level, how many
+ * coefficients of its 2x2 sibling block are already significant and
+ * whether its parent is. Siblings and parent belong to the same tree,
+ * so the context never depends on another group. Significance is taken
+ * from the state map, which both engines keep up to date with contexts.
+ */
+static int SignificanceContext(SPIHTCoder *coder,
+                               int row,
+                               int col)
+{
+  int level, count, parent, down;
+  size_t offs;
+  unsigned char *state;
+
+  /* asked once per decision, so it is counted here */
+  if (coder->stat != NULL) coder->stat->coeffs++;
+
+  if ((coder->options & SPIHT_CONTEXTS) == 0) return 0;
+
+  state = coder->state;
+
+  level = NodeLevel(coder, row, col);
+
+  count = parent = 0;
+
+  /* the top region has no parent in this layout */
+  if (level < coder->levels - 1) {
+
+    offs = StateOffset(coder, row & ~1, col & ~1);
+
+    /* the lower half of the 2x2 block is one row down, or right after the upper one in a tile */
+    down = (coder->plane->tile_bits == 0 ? coder->cols : 2);
+
+    count = ((state[offs] & IN_LSP) != 0) + ((state[offs + 1] & IN_LSP) != 0) +
+            ((state[offs + down] & IN_LSP) != 0) + ((state[offs + down + 1] & IN_LSP) != 0);
+
+    parent = ((state[StateOffset(coder, row >> 1, col >> 1)] & IN_LSP) != 0);
+  }
+
+  if (count > 2) count = 2;
+  if (level >= LEVEL_CLASSES) level = LEVEL_CLASSES - 1;
+
+  return CTX_SIG + (level * 3 + count) * 2 + parent;
+}
+
+static int SetContext(SPIHTCoder *coder,
+                      int node_type,
+                      Node *node)
+{
+  int level, row, col;
+
+  if (coder->stat != NULL) {
+    if (node_type == TYPE_B) coder->stat->sets_b++;
+    else coder->stat->sets_a++;
+  }
+
+  if ((coder->options & SPIHT_CONTEXTS) == 0) return 0;
+
+  row = node->row;
+  col = node->col;
+
+  level = NodeLevel(coder, row, col);
+
+  if (level >= LEVEL_CLASSES) level = LEVEL_CLASSES - 1;
+
+  if (node_type == TYPE_B) return CTX_SET_B + level;
+
+  return CTX_SET_A + level * 2 + ((coder->state[StateOffset(coder, row, col)] & IN_LSP) != 0);
+}
+
+/*
+ * The first refinement bit of a coefficient is skewed towards zero,
+ * later ones are close to equiprobable. Marks the coefficient refined.
+ */
+static int RefinementContext(SPIHTCoder *coder,
+                             int row,
+                             int col)
+{
+  int context;
+  size_t offs;
+
+  if ((coder->options & SPIHT_CONTEXTS) == 0) return 0;
+
+  offs = StateOffset(coder, row, col);
+
+  context = CTX_REFINE + ((coder->state[offs] & REFINED) != 0);
+
+  coder->state[offs] |= REFINED;
+
+  return context;
+}
+
+static void MarkSignificant(SPIHTCoder *coder,
+                            int row,
+                            int col)
+{
+  if (coder->state != NULL) coder->state[StateOffset(coder, row, col)] |= IN_LSP;
+}
+
+/*
+ * Squared error of a magnitude once the decoder knows its bits down to
+ * step and puts the rest at half a step; step 0 means nothing is known.
+ */
+static double SquaredError(int magnitude,
+                           int step)
+{
+  double error;
+
+  if (step == 0) error = magnitude;
+  else error = magnitude - ((magnitude & ~(step - 1)) + (step >> 1));
+
+  return error * error;
+}
+
+static double GroupEnergy(SPIHTCoder *coder)
+{
+  Rect *rect;
+  double energy, value;
+  int index, row, col;
+
+  energy = 0;
+
+  for (index = 0; index < coder->rect_count; index++) {
+
+    rect = &coder->rects[index];
+
+    for (row = rect->first_row; row < rect->last_row; row++)
+    for (col = rect->first_col; col < rect->last_col; col++) {
+      value = GetCoefficient(coder->plane, row, col);
+      energy += value * value;
+    }
+  }
+
+  return energy;
+}
+
+static double GroupArea(SPIHTCoder *coder)
+{
+  Rect *rect;
+  double area;
+  int index;
+
+  for (area = 0, index = 0; index < coder->rect_count; index++) {
+    rect = &coder->rects[index];
+    area += (double) (rect->last_row - rect->first_row) * (rect->last_col - rect->first_col);
+  }
+
+  return area;
+}
+
+/*
+ * Quality-targeted coding: the encoder knows every coefficient, so each
+ * sign and refinement bit tells exactly how much the decoder's squared
+ * error drops. Coding stops with TARGET_REACHED once the group is down
+ * to its target. A SPIHT_LEVELS resolution is coded in full anyway, the
+ * finer ones need its passes; see TargetSize().
+ */
+static int ReduceDistortion(SPIHTCoder *coder,
+                            int magnitude,
+                            int known,
+                            int step)
+{
+  coder->distortion += SquaredError(magnitude, step) - SquaredError(magnitude, known);
+
+  if (coder->options & SPIHT_LEVELS) return OK;
+
+  return (coder->distortion <= coder->target ? TARGET_REACHED : OK);
+}
+
+/*
+ * With SPIHT_BYPASS sign bits and all refinement bits but the first one
+ * of a coefficient skip the adaptive models: they are close to
+ * equiprobable, so EncodeBypass() just halves the coder range. Both
+ * sides know a refinement is not the first one when the magnitude has
+ * reached four times the threshold.
+ */
+static int PutSign(SPIHTCoder *coder,
+                   int row,
+                   int col,
+                   int threshold,
+                   int sign)
+{
+  int result;
+
+  if (coder->stat != NULL) coder->stat->signs++;
+
+  if (coder->options & SPIHT_BYPASS) result = PutBypass(coder, sign);
+  else result = PutSymbol(coder, CTX_SIGN, sign);
+
+  if (result != OK || coder->target <= 0) return result;
+
+  return ReduceDistortion(coder, ABS(GetCoefficient(coder->plane, row, col)), 0, threshold);
+}
+
+static int GetSign(SPIHTCoder *coder,
+                   int *sign)
+{
+  if (coder->stat != NULL) coder->stat->signs++;
+
+  if (coder->options & SPIHT_BYPASS) return GetBypass(coder, sign);
+
+  return GetSymbol(coder, CTX_SIGN, sign);
+}
+
+/*
+ * refined is nonzero if the coefficient got a refinement bit in an
+ * earlier pass. It comes from the lists or the state map, so both sides
+ * agree on it even where the list engine makes a coefficient significant
+ * below its top bit (a B-type set moved to the end of the LIS is not
+ * visited again in the same pass).
+ */
+static int PutRefinement(SPIHTCoder *coder,
+                         int row,
+                         int col,
+                         int magnitude,
+                         int threshold,
+                         int refined,
+                         int bit)
+{
+  int result;
+
+  if (coder->stat != NULL) coder->stat->refinements++;
+
+  if ((coder->options & SPIHT_BYPASS) && refined)
+  result = PutBypass(coder, bit);
+  else result = PutSymbol(coder, RefinementContext(coder, row, col), bit);
+
+  if (result != OK || coder->target <= 0) return result;
+
+  return ReduceDistortion(coder, magnitude, threshold << 1, threshold);
+}
+
+static int GetRefinement(SPIHTCoder *coder,
+                         int row,
+                         int col,
+                         int refined,
+                         int *bit)
+{
+  if (coder->stat != NULL) coder->stat->refinements++;
+
+  if ((coder->options & SPIHT_BYPASS) && refined)
+  return GetBypass(coder, bit);
+
+  return GetSymbol(coder, RefinementContext(coder, row, col), bit);
+}
+
+static int IsValidNodeA(int rows,
+                        int cols,
+                        int levels,
+                        Node *node)
+{
+  int row, col;
+
+  row = node->row;
+  col = node->col;
+
+  if (row < rows >> levels && col < cols >> levels) return FALSE;
+
+  if (row >= rows >> 1 || col >= cols >> 1) return FALSE;
+
+  return TRUE;
+}
+
+static int IsValidNodeB(int rows,
+                        int cols,
+                        int levels,
+                        Node *node)
+{
+  int row, col;
+
+  row = node->row;
+  col = node->col;
+
+  if (row < rows >> levels && col < cols >> levels) return FALSE;
+
+  if (row >= rows >> 2 || col >= cols >> 2) return FALSE;
+
+  return TRUE;
+}
+
+static void ChangeNodeType(Node *node)
+{
+  node->type = TYPE_B;
+}
+
+static int GetNodeOffspring(int rows,
+                            int cols,
+                            int levels,
+                            Node *node,
+                            Node *offspring)
+{
+  int row, col;
+
+  row = node->row;
+  col = node->col;
+
+  if (IsValidNodeA(rows, cols, levels, node) == FALSE) return INTERNAL_ERROR;
+
+  offspring[0].row = row << 1;
+  offspring[0].col = col << 1;
+
+  offspring[1].row = row << 1;
+  offspring[1].col = (col << 1) + 1;
+
+  offspring[2].row = (row << 1) + 1;
+  offspring[2].col = col << 1;
+
+  offspring[3].row = (row << 1) + 1;
+  offspring[3].col = (col << 1) + 1;
+
+  return OK;
+}
+
+static int IsNodeSignificant(BitplaneMap *map,
+                             int bits,
+                             int node_type,
+                             Node *node)
+{
+  int row, col;
+
+  row = node->row;
+  col = node->col;
+
+  if (node_type == TYPE_S)
+    return (map->msb[PlaneOffset(row, col, map->cols, map->msb_bits)] >= bits ? TRUE : FALSE);
+
+  if (node_type == TYPE_A)
+    return (map->desc[PlaneOffset(row, col, map->cols >> 1, map->desc_bits)] >= bits ? TRUE : FALSE);
+
+  if (node_type == TYPE_B)
+    return (map->grand[PlaneOffset(row, col, map->cols >> 2, map->grand_bits)] >= bits ? TRUE : FALSE);
+
+  return INTERNAL_ERROR;
+}
+
+static void InitCoefficient(CoeffPlane *plane,
+                            int threshold,
+                            int sign,
+                            Node *node)
+{
+  SetCoefficient(plane, node->row, node->col, (sign ?  - threshold - (threshold >> 1) : threshold + (threshold >> 1)));
+}
+
+/*
+ * The top region of the plane holds the LL band and the coarsest detail
+ * subbands; its rows r and (rows >> levels) + r carry the roots of the
+ * trees growing from LL band row r. Groups list their roots in raster
+ * order, so a single group lists the whole top region as before.
+ */
+static void ClearState(SPIHTCoder *coder)
+{
+  int index, row, col;
+  Rect *rect;
+
+  for (index = 0; index < coder->rect_count; index++) {
+
+    rect = &coder->rects[index];
+
+    for (row = rect->first_row; row < rect->last_row; row++) {
+
+      if (coder->plane->tile_bits == 0) {
+
+        memset(coder->state + (size_t) row * coder->cols + rect->first_col, 0, rect->last_col - rect->first_col);
+        continue;
+      }
+
+      for (col = rect->first_col; col < rect->last_col; col++) coder->state[StateOffset(coder, row, col)] = 0;
+    }
+  }
+}
+
+static int SPIHTInit(SPIHTCoder *coder)
+{
+  int ll_rows, ll_cols, max_col, band, resolution;
+  int result;
+  Node node;
+
+  coder->LIP->count = 0;
+  coder->LSP->count = 0;
+  coder->lsp_refined = 0;
+  coder->LIS->count = 0;
+
+  coder->sig_passes = 0;
+
+  if (coder->state != NULL) ClearState(coder);
+
+  ll_rows = coder->rows >> coder->levels;
+  ll_cols = coder->cols >> coder->levels;
+  max_col = coder->cols >> (coder->levels - 1);
+
+  if (coder->options & SPIHT_LEVELS) {
+
+    coder->moved->count = 0;
+
+    /* the top region is split between resolutions 0 and 1, its trees start in resolution 2 */
+    for (band = 0; band < 2; band++) {
+      for (node.row = band * ll_rows; node.row < (band + 1) * ll_rows; node.row++) {
+        for (node.col = 0; node.col < max_col; node.col++) {
+
+          resolution = (node.row < ll_rows && node.col < ll_cols ? 0 : 1);
+
+          if (coder->resolution == resolution)
+          if ((result = AppendNode(coder->LIP, node.row, node.col, TYPE_S)) != OK) return result;
+
+          if (coder->resolution == 2 && IsValidNodeA(coder->rows, coder->cols, coder->levels, &node) == TRUE)
+          if ((result = AppendNode(coder->LIS, node.row, node.col, TYPE_A)) != OK) return result;
+        }
+      }
+    }
+
+    return OK;
+  }
+
+  for (band = 0; band < 2; band++) {
+    for (node.row = band * ll_rows + coder->first_row; node.row < band * ll_rows + coder->last_row; node.row++) {
+      for (node.col = 0; node.col < max_col; node.col++) {
+
+        if ((result = AppendNode(coder->LIP, node.row, node.col, TYPE_S)) != OK) return result;
+
+        if (IsValidNodeA(coder->rows, coder->cols, coder->levels, &node) == TRUE)
+        if ((result = AppendNode(coder->LIS, node.row, node.col, TYPE_A)) != OK) return result;
+      }
+    }
+  }
+
+  return OK;
+}
+
+/*
+ * SPIHT_LEVELS: appends the B-type nodes the coarser resolution made in
+ * the current pass to the LIS, before it is walked.
+ */
+static int TakeMoved(SPIHTCoder *coder)
+{
+  SPIHTCoder *coarser;
+  int index, first, result;
+
+  coarser = coder->coarser;
+
+  if (coarser == NULL) return OK;
+
+  first = (coder->sig_passes > 0 ? coarser->moved_end[coder->sig_passes - 1] : 0);
+
+  for (index = first; index < coarser->moved_end[coder->sig_passes]; index++)
+  if ((result = AppendNode(coder->LIS, coarser->moved->row[index], coarser->moved->col[index], TYPE_B)) != OK) return result;
+
+  return OK;
+}
+
+/*
+ * Both significance passes walk the lists in place: entries that stay
+ * are copied down to dst, entries appended to the list being walked are
+ * visited later in the same pass. An A-type node turning into a B-type
+ * one at the very end of the LIS is not revisited until the next pass;
+ * this mirrors the original linked list walk and keeps streams compatible.
+ */
+static int SPIHTEncodeSignificancePass(SPIHTCoder *coder,
+                                       int threshold)
+{
+  int result1, result2, result3, result4, index, bits;
+  int src, dst, last, sign;
+  NodeList *LIP, *LSP, *LIS;
+  Node offspring[4];
+  Node node;
+
+  LIP = coder->LIP;
+  LSP = coder->LSP;
+  LIS = coder->LIS;
+
+  coder->lsp_refined = LSP->count;
+
+  bits = BitLength(threshold);
+
+  for (src = dst = 0; src < LIP->count; src++) {
+
+    node.row = LIP->row[src];
+    node.col = LIP->col[src];
+
+    result1 = IsNodeSignificant(coder->map, bits, TYPE_S, &node);
+
+    if (result1 == TRUE) {
+
+      sign = (GetCoefficient(coder->plane, node.row, node.col) > 0 ? 0 : 1);
+
+      if ((result2 = PutSymbol(coder, SignificanceContext(coder, node.row, node.col), 1)) != OK) return result2;
+      if ((result2 = PutSign(coder, node.row, node.col, threshold, sign)) != OK) return result2;
+
+      if ((result2 = AppendNode(LSP, node.row, node.col, TYPE_S)) != OK) return result2;
+
+      MarkSignificant(coder, node.row, node.col);
+
+    } else if (result1 == FALSE) {
+
+      if ((result2 = PutSymbol(coder, SignificanceContext(coder, node.row, node.col), 0)) != OK) return result2;
+
+      LIP->row[dst] = node.row;
+      LIP->col[dst] = node.col;
+      dst++;
+
+    } else return result1;
+  }
+
+  CompactNodeList(LIP, dst, src);
+
+  if ((result1 = TakeMoved(coder)) != OK) return result1;
+
+  for (src = dst = 0; src < LIS->count; src++) {
+
+    node.row = LIS->row[src];
+    node.col = LIS->col[src];
+    node.type = LIS->type[src];
+
+    last = (src == LIS->count - 1);
+
+    if (node.type == TYPE_A) {
+
+      result1 = IsNodeSignificant(coder->map, bits, TYPE_A, &node);
+
+      if (result1 == TRUE) {
+
+        if ((result2 = PutSymbol(coder, SetContext(coder, TYPE_A, &node), 1)) != OK) return result2;
+
+        if ((result2 = GetNodeOffspring(coder->rows, coder->cols, coder->levels, &node, offspring)) != OK) return result2;
+
+        for (index = 0; index < 4; index++) {
+
+          result3 = IsNodeSignificant(coder->map, bits, TYPE_S, &offspring[index]);
+
+          if (result3 == TRUE) {
+
+            sign = (GetCoefficient(coder->plane, offspring[index].row, offspring[index].col) > 0 ? 0 : 1);
+
+            if ((result4 = PutSymbol(coder, SignificanceContext(coder, offspring[index].row, offspring[index].col), 1)) != OK) return result4;
+            if ((result4 = PutSign(coder, offspring[index].row, offspring[index].col, threshold, sign)) != OK) return result4;
+
+            if ((result4 = AppendNode(LSP, offspring[index].row, offspring[index].col, TYPE_S)) != OK) return result4;
+
+            MarkSignificant(coder, offspring[index].row, offspring[index].col);
+
+          } else if (result3 == FALSE) {
+
+            if ((result4 = PutSymbol(coder, SignificanceContext(coder, offspring[index].row, offspring[index].col), 0)) != OK) return result4;
+
+            if ((result4 = AppendNode(LIP, offspring[index].row, offspring[index].col, TYPE_S)) != OK) return result4;
+
+          } else return result3;
+
+        }
+
+        if (IsValidNodeB(coder->rows, coder->cols, coder->levels, &node) == TRUE) {
+
+          ChangeNodeType(&node);
+
+          if (coder->moved != NULL) {
+
+            if ((result3 = AppendNode(coder->moved, node.row, node.col, node.type)) != OK) return result3;
+
+          } else {
+
+            if ((result3 = AppendNode(LIS, node.row, node.col, node.type)) != OK) return result3;
+
+            if (last) {
+              src++;
+              break;
+            }
+          }
+        }
+
+      } else if (result1 == FALSE) {
+
+        if ((result2 = PutSymbol(coder, SetContext(coder, TYPE_A, &node), 0)) != OK) return result2;
+
+        LIS->row[dst] = node.row;
+        LIS->col[dst] = node.col;
+        LIS->type[dst] = (unsigned char) node.type;
+        dst++;
+
+      } else return result1;
+
+    } else {
+
+      result1 = IsNodeSignificant(coder->map, bits, TYPE_B, &node);
+
+      if (result1 == TRUE) {
+
+        if ((result2 = PutSymbol(coder, SetContext(coder, TYPE_B, &node), 1)) != OK) return result2;
+
+        if ((result2 = GetNodeOffspring(coder->rows, coder->cols, coder->levels, &node, offspring)) != OK) return result2;
+
+        for (index = 0; index < 4; index++) {
+
+          if ((result3 = AppendNode(LIS, offspring[index].row, offspring[index].col, TYPE_A)) != OK) return result3;
+
+        }
+
+      } else if (result1 == FALSE) {
+
+        if ((result2 = PutSymbol(coder, SetContext(coder, TYPE_B, &node), 0)) != OK) return result2;
+
+        LIS->row[dst] = node.row;
+        LIS->col[dst] = node.col;
+        LIS->type[dst] = (unsigned char) node.type;
+        dst++;
+
+      } else return result1;
+
+    }
+  }
+
+  CompactNodeList(LIS, dst, src);
+
+  if (coder->moved != NULL) coder->moved_end[coder->sig_passes] = coder->moved->count;
+
+  coder->sig_passes++;
+
+  return OK;
+}
+
+static int SPIHTEncodeRefinementPass(SPIHTCoder *coder,
+                                     int threshold)
+{
+  int result, index, magnitude, bit;
+  NodeList *LSP;
+
+  LSP = coder->LSP;
+
+  if (threshold > 0) {
+
+    for (index = 0; index < LSP->count; index++) {
+
+      magnitude = ABS(GetCoefficient(coder->plane, LSP->row[index], LSP->col[index]));
+
+      bit = (magnitude & threshold ? 1 : 0);
+
+      result = PutRefinement(coder, LSP->row[index], LSP->col[index], magnitude, threshold, index < coder->lsp_refined, bit);
+
+      if (result != OK) return result;
+    }
+  }
+
+  return OK;
+}
+
+static int SPIHTDecodeSignificancePass(SPIHTCoder *coder,
+                                       int threshold)
+{
+  int result1, result2, result3, result4, index;
+  int src, dst, last, bit;
+  NodeList *LIP, *LSP, *LIS;
+  Node offspring[4];
+  Node node;
+
+  LIP = coder->LIP;
+  LSP = coder->LSP;
+  LIS = coder->LIS;
+
+  coder->lsp_refined = LSP->count;
+
+  for (src = dst = 0; src < LIP->count; src++) {
+
+    node.row = LIP->row[src];
+    node.col = LIP->col[src];
+
+    if ((result1 = GetSymbol(coder, SignificanceContext(coder, node.row, node.col), &bit)) != OK) return result1;
+
+    if (bit == 1) {
+
+      if ((result2 = GetSign(coder, &bit)) != OK) return result2;
+
+      InitCoefficient(coder->plane, threshold, bit, &node);
+
+      if ((result2 = AppendNode(LSP, node.row, node.col, TYPE_S)) != OK) return result2;
+
+      MarkSignificant(coder, node.row, node.col);
+
+    } else {
+
+      LIP->row[dst] = node.row;
+      LIP->col[dst] = node.col;
+      dst++;
+    }
+  }
+
+  CompactNodeList(LIP, dst, src);
+
+  if ((result1 = TakeMoved(coder)) != OK) return result1;
+
+  for (src = dst = 0; src < LIS->count; src++) {
+
+    node.row = LIS->row[src];
+    node.col = LIS->col[src];
+    node.type = LIS->type[src];
+
+    last = (src == LIS->count - 1);
+
+    if ((result1 = GetSymbol(coder, SetContext(coder, node.type, &node), &bit)) != OK) return result1;
+
+    if (bit == 0) {
+
+      LIS->row[dst] = node.row;
+      LIS->col[dst] = node.col;
+      LIS->type[dst] = (unsigned char) node.type;
+      dst++;
+
+      continue;
+    }
+
+    if ((result2 = GetNodeOffspring(coder->rows, coder->cols, coder->levels, &node, offspring)) != OK) return result2;
+
+    if (node.type == TYPE_A) {
+
+      for (index = 0; index < 4; index++) {
+
+        if ((result3 = GetSymbol(coder, SignificanceContext(coder, offspring[index].row, offspring[index].col), &bit)) != OK) return result3;
+
+        if (bit == 1) {
+
+          if ((result4 = GetSign(coder, &bit)) != OK) return result4;
+
+          InitCoefficient(coder->plane, threshold, bit, &offspring[index]);
+
+          if ((result4 = AppendNode(LSP, offspring[index].row, offspring[index].col, TYPE_S)) != OK) return result4;
+
+          MarkSignificant(coder, offspring[index].row, offspring[index].col);
+
+        } else {
+
+          if ((result4 = AppendNode(LIP, offspring[index].row, offspring[index].col, TYPE_S)) != OK) return result4;
+
+        }
+
+      }
+
+      if (IsValidNodeB(coder->rows, coder->cols, coder->levels, &node) == TRUE) {
+
+        ChangeNodeType(&node);
+
+        if (coder->moved != NULL) {
+
+          if ((result3 = AppendNode(coder->moved, node.row, node.col, node.type)) != OK) return result3;
+
+        } else {
+
+          if ((result3 = AppendNode(LIS, node.row, node.col, node.type)) != OK) return result3;
+
+          if (last) {
+            src++;
+            break;
+          }
+        }
+      }
+
+    } else {
+
+      for (index = 0; index < 4; index++) {
+
+        if ((result3 = AppendNode(LIS, offspring[index].row, offspring[index].col, TYPE_A)) != OK) return result3;
+
+      }
+
+    }
+  }
+
+  CompactNodeList(LIS, dst, src);
+
+  if (coder->moved != NULL) coder->moved_end[coder->sig_passes] = coder->moved->count;
+
+  coder->sig_passes++;
+
+  return OK;
+}
+
+static int SPIHTDecodeRefinementPass(SPIHTCoder *coder,
+                                     int threshold)
+{
+  int result, coeff, bit, index;
+  NodeList *LSP;
+
+  LSP = coder->LSP;
+
+  if (threshold > 0) {
+
+    for (index = 0; index < LSP->count; index++) {
+
+      coeff = GetCoefficient(coder->plane, LSP->row[index], LSP->col[index]);
+
+      if ((result = GetRefinement(coder, LSP->row[index], LSP->col[index], index < coder->lsp_refined, &bit)) != OK) return result;
+
+      if (coeff > 0) coeff -= threshold;
+      else coeff += threshold;
+
+      if (bit == 1) {
+        if (coeff > 0) coeff += threshold;
+        else coeff -= threshold;
+      }
+
+      if (coeff > 0) coeff += (threshold >> 1);
+      else coeff -= (threshold >> 1);
+
+      SetCoefficient(coder->plane, LSP->row[index], LSP->col[index], coeff);
+    }
+  }
+
+  return OK;
+}
+
+/*
+ * List-free engine. Instead of keeping LIP, LSP and LIS, every coefficient
+ * carries a few state bits telling which list it would be in. The sorting
+ * pass scans the plane in raster order for LIP entries and then walks the
+ * spatial orientation trees depth-first for LIS entries; the refinement
+ * pass scans the plane in raster order for LSP entries. Decisions are the
+ * same as with the lists, only their order differs. Memory use is one
+ * byte per coefficient regardless of the image content. With SPIHT_BLOCKS
+ * the scans cover the rectangles of the group one after another.
+ */
+static void StateMapInit(SPIHTCoder *coder)
+{
+  int ll_rows, max_col, band;
+  unsigned char *state;
+  Node node;
+
+  state = coder->state;
+
+  ClearState(coder);
+
+  ll_rows = coder->rows >> coder->levels;
+  max_col = coder->cols >> (coder->levels - 1);
+
+  for (band = 0; band < 2; band++) {
+    for (node.row = band * ll_rows + coder->first_row; node.row < band * ll_rows + coder->last_row; node.row++) {
+      for (node.col = 0; node.col < max_col; node.col++) {
+
+        state[StateOffset(coder, node.row, node.col)] = IN_LIP;
+
+        if (IsValidNodeA(coder->rows, coder->cols, coder->levels, &node) == TRUE)
+        state[StateOffset(coder, node.row, node.col)] |= IN_LIS_A;
+      }
+    }
+  }
+}
+
+static int StateMapEncodeSet(SPIHTCoder *coder,
+                             int bits,
+                             Node *node)
+{
+  int result, index, sign, symbol;
+  size_t offs;
+  unsigned char *state;
+  Node offspring[4];
+
+  state = coder->state;
+
+  offs = StateOffset(coder, node->row, node->col);
+
+  if ((state[offs] & (IN_LIS_A | IN_LIS_B | SPLIT)) == 0) return OK;
+
+  if ((result = GetNodeOffspring(coder->rows, coder->cols, coder->levels, node, offspring)) != OK) return result;
+
+  if (state[offs] & IN_LIS_A) {
+
+    symbol = (IsNodeSignificant(coder->map, bits, TYPE_A, node) == TRUE ? 1 : 0);
+
+    if ((result = PutSymbol(coder, SetContext(coder, TYPE_A, node), symbol)) != OK) return result;
+
+    if (symbol == 0) return OK;
+
+    for (index = 0; index < 4; index++) {
+
+      symbol = (IsNodeSignificant(coder->map, bits, TYPE_S, &offspring[index]) == TRUE ? 1 : 0);
+
+      if ((result = PutSymbol(coder, SignificanceContext(coder, offspring[index].row, offspring[index].col), symbol)) != OK) return result;
+
+      if (symbol == 1) {
+
+        sign = (GetCoefficient(coder->plane, offspring[index].row, offspring[index].col) > 0 ? 0 : 1);
+
+        if ((result = PutSign(coder, offspring[index].row, offspring[index].col, 1 << (bits - 1), sign)) != OK) return result;
+
+        state[StateOffset(coder, offspring[index].row, offspring[index].col)] |= IN_LSP;
+
+      } else {
+
+        state[StateOffset(coder, offspring[index].row, offspring[index].col)] |= IN_LIP;
+      }
+    }
+
+    state[offs] &= ~IN_LIS_A;
+
+    if (IsValidNodeB(coder->rows, coder->cols, coder->levels, node) == TRUE) state[offs] |= IN_LIS_B;
+  }
+
+  if (state[offs] & IN_LIS_B) {
+
+    symbol = (IsNodeSignificant(coder->map, bits, TYPE_B, node) == TRUE ? 1 : 0);
+
+    if ((result = PutSymbol(coder, SetContext(coder, TYPE_B, node), symbol)) != OK) return result;
+
+    if (symbol == 0) return OK;
+
+    state[offs] = (state[offs] & ~IN_LIS_B) | SPLIT;
+
+    for (index = 0; index < 4; index++)
+    state[StateOffset(coder, offspring[index].row, offspring[index].col)] |= IN_LIS_A;
+  }
+
+  if (state[offs] & SPLIT) {
+
+    for (index = 0; index < 4; index++) {
+
+      result = StateMapEncodeSet(coder, bits, &offspring[index]);
+
+      if (result != OK) return result;
+    }
+  }
+
+  return OK;
+}
+
+static int StateMapEncodeSignificancePass(SPIHTCoder *coder,
+                                          int threshold)
+{
+  int result, bits, sign, symbol, index;
+  size_t offs;
+  int ll_rows, max_col, band;
+  unsigned char *state;
+  Rect *rect;
+  Node node;
+
+  state = coder->state;
+
+  bits = BitLength(threshold);
+
+  for (index = 0; index < coder->rect_count; index++) {
+
+    rect = &coder->rects[index];
+
+    for (node.row = rect->first_row; node.row < rect->last_row; node.row++) {
+      for (node.col = rect->first_col; node.col < rect->last_col; node.col++) {
+
+        offs = StateOffset(coder, node.row, node.col);
+
+        if ((state[offs] & IN_LIP) == 0) continue;
+
+        symbol = (IsNodeSignificant(coder->map, bits, TYPE_S, &node) == TRUE ? 1 : 0);
+
+        if ((result = PutSymbol(coder, SignificanceContext(coder, node.row, node.col), symbol)) != OK) return result;
+
+        if (symbol == 1) {
+
+          sign = (GetCoefficient(coder->plane, node.row, node.col) > 0 ? 0 : 1);
+
+          if ((result = PutSign(coder, node.row, node.col, threshold, sign)) != OK) return result;
+
+          state[offs] = (state[offs] & ~IN_LIP) | IN_LSP;
+        }
+      }
+    }
+  }
+
+  ll_rows = coder->rows >> coder->levels;
+  max_col = coder->cols >> (coder->levels - 1);
+
+  for (band = 0; band < 2; band++) {
+    for (node.row = band * ll_rows + coder->first_row; node.row < band * ll_rows + coder->last_row; node.row++) {
+      for (node.col = 0; node.col < max_col; node.col++) {
+
+        result = StateMapEncodeSet(coder, bits, &node);
+
+        if (result != OK) return result;
+      }
+    }
+  }
+
+  return OK;
+}
+
+static int StateMapEncodeRefinementPass(SPIHTCoder *coder,
+                                        int threshold)
+{
+  int result, row, col, magnitude, refined, bit, index;
+  unsigned char *state;
+  Rect *rect;
+
+  if (threshold == 0) return OK;
+
+  for (index = 0; index < coder->rect_count; index++) {
+
+    rect = &coder->rects[index];
+
+    for (row = rect->first_row; row < rect->last_row; row++) {
+      for (col = rect->first_col; col < rect->last_col; col++) {
+
+        state = coder->state + StateOffset(coder, row, col);
+
+        if ((*state & IN_LSP) == 0) continue;
+
+        magnitude = ABS(GetCoefficient(coder->plane, row, col));
+
+        bit = (magnitude & threshold ? 1 : 0);
+
+        refined = ((*state & REFINED) != 0);
+
+        if ((result = PutRefinement(coder, row, col, magnitude, threshold, refined, bit)) != OK) return result;
+
+        *state |= REFINED;
+      }
+    }
+  }
+
+  return OK;
+}
+
+static int StateMapDecodeSet(SPIHTCoder *coder,
+                             int threshold,
+                             Node *node)
+{
+  int result, index, bit;
+  size_t offs;
+  unsigned char *state;
+  Node offspring[4];
+
+  state = coder->state;
+
+  offs = StateOffset(coder, node->row, node->col);
+
+  if ((state[offs] & (IN_LIS_A | IN_LIS_B | SPLIT)) == 0) return OK;
+
+  if ((result = GetNodeOffspring(coder->rows, coder->cols, coder->levels, node, offspring)) != OK) return result;
+
+  if (state[offs] & IN_LIS_A) {
+
+    if ((result = GetSymbol(coder, SetContext(coder, TYPE_A, node), &bit)) != OK) return result;
+
+    if (bit == 0) return OK;
+
+    for (index = 0; index < 4; index++) {
+
+      if ((result = GetSymbol(coder, SignificanceContext(coder, offspring[index].row, offspring[index].col), &bit)) != OK) return result;
+
+      if (bit == 1) {
+
+        if ((result = GetSign(coder, &bit)) != OK) return result;
+
+        InitCoefficient(coder->plane, threshold, bit, &offspring[index]);
+
+        state[StateOffset(coder, offspring[index].row, offspring[index].col)] |= IN_LSP;
+
+      } else {
+
+        state[StateOffset(coder, offspring[index].row, offspring[index].col)] |= IN_LIP;
+      }
+    }
+
+    state[offs] &= ~IN_LIS_A;
+
+    if (IsValidNodeB(coder->rows, coder->cols, coder->levels, node) == TRUE) state[offs] |= IN_LIS_B;
+  }
+
+  if (state[offs] & IN_LIS_B) {
+
+    if ((result = GetSymbol(coder, SetContext(coder, TYPE_B, node), &bit)) != OK) return result;
+
+    if (bit == 0) return OK;
+
+    state[offs] = (state[offs] & ~IN_LIS_B) | SPLIT;
+
+    for (index = 0; index < 4; index++)
+    state[StateOffset(coder, offspring[index].row, offspring[index].col)] |= IN_LIS_A;
+  }
+
+  if (state[offs] & SPLIT) {
+
+    for (index = 0; index < 4; index++) {
+
+      result = StateMapDecodeSet(coder, threshold, &offspring[index]);
+
+      if (result != OK) return result;
+    }
+  }
+
+  return OK;
+}
+
+static int StateMapDecodeSignificancePass(SPIHTCoder *coder,
+                                          int threshold)
+{
+  int result, bit, index;
+  size_t offs;
+  int ll_rows, max_col, band;
+  unsigned char *state;
+  Rect *rect;
+  Node node;
+
+  state = coder->state;
+
+  for (index = 0; index < coder->rect_count; index++) {
+
+    rect = &coder->rects[index];
+
+    for (node.row = rect->first_row; node.row < rect->last_row; node.row++) {
+      for (node.col = rect->first_col; node.col < rect->last_col; node.col++) {
+
+        offs = StateOffset(coder, node.row, node.col);
+
+        if ((state[offs] & IN_LIP) == 0) continue;
+
+        if ((result = GetSymbol(coder, SignificanceContext(coder, node.row, node.col), &bit)) != OK) return result;
+
+        if (bit == 1) {
+
+          if ((result = GetSign(coder, &bit)) != OK) return result;
+
+          InitCoefficient(coder->plane, threshold, bit, &node);
+
+          state[offs] = (state[offs] & ~IN_LIP) | IN_LSP;
+        }
+      }
+    }
+  }
+
+  ll_rows = coder->rows >> coder->levels;
+  max_col = coder->cols >> (coder->levels - 1);
+
+  for (band = 0; band < 2; band++) {
+    for (node.row = band * ll_rows + coder->first_row; node.row < band * ll_rows + coder->last_row; node.row++) {
+      for (node.col = 0; node.col < max_col; node.col++) {
+
+        result = StateMapDecodeSet(coder, threshold, &node);
+
+        if (result != OK) return result;
+      }
+    }
+  }
+
+  return OK;
+}
+
+static int StateMapDecodeRefinementPass(SPIHTCoder *coder,
+                                        int threshold)
+{
+  int result, row, col, coeff, refined, bit, index;
+  unsigned char *state;
+  Rect *rect;
+
+  if (threshold == 0) return OK;
+
+  for (index = 0; index < coder->rect_count; index++) {
+
+    rect = &coder->rects[index];
+
+    for (row = rect->first_row; row < rect->last_row; row++) {
+      for (col = rect->first_col; col < rect->last_col; col++) {
+
+        state = coder->state + StateOffset(coder, row, col);
+
+        if ((*state & IN_LSP) == 0) continue;
+
+        coeff = GetCoefficient(coder->plane, row, col);
+
+        refined = ((*state & REFINED) != 0);
+
+        if ((result = GetRefinement(coder, row, col, refined, &bit)) != OK) return result;
+
+        *state |= REFINED;
+
+        if (coeff > 0) coeff -= threshold;
+        else coeff += threshold;
+
+        if (bit == 1) {
+          if (coeff > 0) coeff += threshold;
+          else coeff -= threshold;
+        }
+
+        if (coeff > 0) coeff += (threshold >> 1);
+        else coeff -= (threshold >> 1);
+
+        SetCoefficient(coder->plane, row, col, coeff);
+      }
+    }
+  }
+
+  return OK;
+}
+
+/*
+ * Returns the end of the stream data that can be read now. With a wait
+ * function in params the stream is still arriving, so this blocks until
+ * the bytes before need are there or the stream is over.
+ */
+static unsigned char *WaitData(SPIHTParams *params,
+                               unsigned char *need,
+                               unsigned char *end)
+{
+  unsigned char *avail;
+
+  if (params == NULL || params->wait == NULL) return end;
+
+  if (need > end) need = end;
+
+  avail = params->wait(params->wait_context, need);
+
+  return (avail < end ? avail : end);
+}
+
+/*
+ * Codes the trees of one group into coder->buffer. The output length
+ * after every pass is recorded for the budget allocation of SPIHT_BLOCKS.
+ * With SPIHT_LEVELS it is the exact number of bytes the decoder reads
+ * to get through the pass: the bits written so far, the pending
+ * underflow bits and the CODE_BITS the decoder looks ahead.
+ */
+static void EndPass(SPIHTCoder *coder)
+{
+  ptrdiff_t bits;
+
+  if (coder->options & SPIHT_LEVELS) {
+
+    if (coder->options & SPIHT_LANES) {
+
+      /* the bytes the decoders read are kept in the stream as they go */
+      bits = (coder->bit_stream->next_byte - coder->buffer) * 8;
+
+    } else if (coder->lane_count > 0) {
+
+      /* a byte written or held for every byte the decoder reads after its first RANGE_BYTES */
+      bits = (coder->bit_stream->next_byte - coder->buffer + coder->lanes[0]->pending + RANGE_BYTES) * 8;
+
+    } else {
+
+      bits = BitPosition(coder->bit_stream);
+      bits += coder->arith_coder->underflow_bits + CODE_BITS;
+    }
+
+    coder->pass_end[coder->passes] = (int) ((bits + 7) >> 3);
+
+  } else coder->pass_end[coder->passes] = (int) (BitPosition(coder->bit_stream) >> 3);
+
+  coder->pass_distortion[coder->passes] = coder->distortion;
+  coder->passes++;
+}
+
+/*
+ * Ends a pass of the encoder: the output length is only known to the
+ * thread running the arithmetic coder, so a pipe gets a mark instead.
+ */
+static int MarkPass(SPIHTCoder *coder)
+{
+  if (coder->pipe != NULL) return PipeSymbol(coder, PIPE_PASS_END, 0);
+
+  EndPass(coder);
+
+  return OK;
+}
+
+/*
+ * Queues a decision for the arithmetic coder on the pipe thread.
+ */
+static int PipeSymbol(SPIHTCoder *coder,
+                      int context,
+                      int symbol)
+{
+  SymbolPipe *pipe;
+
+  pipe = coder->pipe;
+
+  pipe->next->context = (unsigned short) context;
+  pipe->next->symbol = (unsigned char) symbol;
+
+  if (++pipe->next == pipe->end) return PublishChunk(pipe);
+
+  return OK;
+}
+
+/*
+ * Runs the arithmetic coder over a chunk of queued symbols on the pipe
+ * thread, exactly as PutSymbol() would have done in place.
+ */
+static int CodeChunk(void *arg,
+                     QueuedSymbol *symbols,
+                     int count)
+{
+  SPIHTCoder *coder;
+  QueuedSymbol *entry, *last;
+  int result;
+
+  coder = (SPIHTCoder *) arg;
+
+  result = OK;
+
+  for (entry = symbols, last = symbols + count; entry < last && result == OK; entry++) {
+
+    if (entry->context < MAX_CONTEXTS) result = CodeSymbol(coder, entry->context, entry->symbol);
+    else if (entry->context == PIPE_BYPASS) result = CodeBypass(coder, entry->symbol);
+    else EndPass(coder);
+  }
+
+  return result;
+}
+
+/*
+ * SPIHT_LEVELS: significance passes of a coded resolution that its
+ * decoder gets through. The next resolution is coded and decoded with
+ * as many passes at most, so both sides agree on the nodes it takes
+ * over even when the coarser sub-stream ran out of room.
+ */
+static int DecodablePasses(SPIHTCoder *coder)
+{
+  int pass;
+
+  for (pass = 0; pass < coder->sig_passes && pass * 2 < coder->passes; pass++)
+  if (coder->pass_end[pass * 2] > coder->stream_size) break;
+
+  return pass;
+}
+
+/*
+ * Squared error left in a group whose sub-stream is cut to size bytes,
+ * interpolated between the ends of the passes around the cut.
+ */
+static double CutDistortion(SPIHTCoder *coder,
+                            int size)
+{
+  double first_size, first_distortion, last_size, last_distortion;
+  int pass;
+
+  if (size >= coder->stream_size) return coder->distortion;
+
+  first_size = 0;
+  first_distortion = coder->energy;
+
+  for (pass = 0; pass < coder->passes && coder->pass_end[pass] <= size; pass++) {
+    first_size = coder->pass_end[pass];
+    first_distortion = coder->pass_distortion[pass];
+  }
+
+  if (pass < coder->passes) {
+    last_size = coder->pass_end[pass];
+    last_distortion = coder->pass_distortion[pass];
+  } else {
+    last_size = coder->stream_size;
+    last_distortion = coder->distortion;
+  }
+
+  if (last_size <= first_size) return last_distortion;
+
+  return first_distortion + (last_distortion - first_distortion) * (size - first_size) / (last_size - first_size);
+}
+
+static int EncodeGroup(void *task)
+{
+  SPIHTCoder *coder;
+  int result, pipe_result, threshold;
+
+  coder = (SPIHTCoder *) task;
+
+  coder->bit_stream->buffer = coder->buffer;
+  coder->bit_stream->buffer_size = coder->buffer_size;
+
+  InitWriteBits(coder->bit_stream);
+
+  InitModels(coder);
+
+  coder->stream_size = 0;
+  coder->passes = 0;
+  coder->full = 0;
+
+  if ((result = StartEncoder(coder)) != OK) {
+    coder->pipe = NULL;
+    goto error;
+  }
+
+  /* if the thread cannot be created the group is simply coded in place */
+  if (coder->pipe != NULL && StartPipe(coder->pipe, CodeChunk, coder) != OK) coder->pipe = NULL;
+
+  ResetStats(coder);
+
+  if (coder->bits > 0) threshold = 1 << (coder->bits - 1);
+  else threshold = 0;
+
+  if (coder->target > 0) {
+
+    coder->energy = GroupEnergy(coder);
+    coder->distortion = coder->energy;
+
+    if (coder->distortion <= coder->target && (coder->options & SPIHT_LEVELS) == 0) threshold = 0;
+  }
+
+  if (coder->options & SPIHT_LISTFREE) {
+
+    StateMapInit(coder);
+
+    while (threshold > 0) {
+
+      PassStats(coder, PHASE_SIGNIFICANCE, threshold);
+
+      result = StateMapEncodeSignificancePass(coder, threshold);
+
+      if (result != OK) goto error;
+
+      if ((result = MarkPass(coder)) != OK) goto error;
+
+      PassStats(coder, PHASE_REFINEMENT, threshold);
+
+      result = StateMapEncodeRefinementPass(coder, threshold >> 1);
+
+      if (result != OK) goto error;
+
+      if ((result = MarkPass(coder)) != OK) goto error;
+
+      threshold >>= 1;
+    }
+
+  } else {
+
+    result = SPIHTInit(coder);
+
+    if (result != OK) goto error;
+
+    while (threshold > 0) {
+
+      if (coder->coarser != NULL && coder->sig_passes >= coder->coarser->sig_passes) break;
+
+      PassStats(coder, PHASE_SIGNIFICANCE, threshold);
+
+      result = SPIHTEncodeSignificancePass(coder, threshold);
+
+      if (result != OK) goto error;
+
+      if ((result = MarkPass(coder)) != OK) goto error;
+
+      PassStats(coder, PHASE_REFINEMENT, threshold);
+
+      result = SPIHTEncodeRefinementPass(coder, threshold >> 1);
+
+      if (result != OK) goto error;
+
+      if ((result = MarkPass(coder)) != OK) goto error;
+
+      threshold >>= 1;
+    }
+  }
+
+  result = OK;
+
+  error:
+
+  /* an error of the passes comes first, then one of the coder thread */
+  if (coder->pipe != NULL) {
+
+    pipe_result = FinishPipe(coder->pipe, result == OK || result == TARGET_REACHED);
+
+    if (pipe_result != OK && (result == OK || result == TARGET_REACHED || result == BUFFER_FULL)) result = pipe_result;
+  }
+
+  PassStats(coder, PHASE_NONE, 0);
+
+  if (result == TARGET_REACHED) result = OK;
+
+  if (result == BUFFER_FULL || result == OK) {
+
+    if (FinishEncoder(coder) == BUFFER_FULL) result = BUFFER_FULL;
+    if (FlushBits(coder->bit_stream) == BUFFER_FULL) result = BUFFER_FULL;
+
+    coder->stream_size = coder->bit_stream->next_byte - coder->buffer;
+  }
+
+  if (result == BUFFER_FULL) {
+    coder->full = 1;
+    result = OK;
+  }
+
+  if (coder->options & SPIHT_LEVELS) coder->sig_passes = DecodablePasses(coder);
+
+  return result;
+}
+
+/*
+ * EncodeGroup() with the arithmetic coder on a second thread, fed by the
+ * passes through a SymbolPipe. The output is the same byte for byte.
+ */
+static int EncodePipelined(SPIHTCoder *coder)
+{
+  SymbolPipe *pipe;
+  int result;
+
+  pipe = AllocSymbolPipe();
+
+  if (pipe == NULL) return MEMORY_ERROR;
+
+  coder->pipe = pipe;
+
+  result = EncodeGroup(coder);
+
+  coder->pipe = NULL;
+
+  FreeSymbolPipe(pipe);
+
+  return result;
+}
+
+static int DecodeGroup(void *task)
+{
+  SPIHTCoder *coder;
+  int result, threshold;
+
+  coder = (SPIHTCoder *) task;
+
+  coder->bit_stream->buffer = coder->buffer;
+  coder->bit_stream->buffer_size = coder->buffer_size;
+
+  coder->sig_passes = 0;
+
+  ResetStats(coder);
+
+  InitReadBits(coder->bit_stream);
+
+  InitModels(coder);
+  result = StartDecoder(coder);
+
+  if (result != OK) goto error;
+
+  if (coder->bits > 0) threshold = 1 << (coder->bits - 1);
+  else threshold = 0;
+
+  if (coder->options & SPIHT_LISTFREE) {
+
+    StateMapInit(coder);
+
+    while (threshold > 0) {
+
+      PassStats(coder, PHASE_SIGNIFICANCE, threshold);
+
+      result = StateMapDecodeSignificancePass(coder, threshold);
+
+      if (result != OK) goto error;
+
+      PassStats(coder, PHASE_REFINEMENT, threshold);
+
+      result = StateMapDecodeRefinementPass(coder, threshold >> 1);
+
+      if (result != OK) goto error;
+
+      threshold >>= 1;
+    }
+
+  } else {
+
+    result = SPIHTInit(coder);
+
+    if (result != OK) goto error;
+
+    while (threshold > 0) {
+
+      if (coder->coarser != NULL && coder->sig_passes >= coder->coarser->sig_passes) break;
+
+      PassStats(coder, PHASE_SIGNIFICANCE, threshold);
+
+      result = SPIHTDecodeSignificancePass(coder, threshold);
+
+      if (result != OK) goto error;
+
+      PassStats(coder, PHASE_REFINEMENT, threshold);
+
+      result = SPIHTDecodeRefinementPass(coder, threshold >> 1);
+
+      if (result != OK) goto error;
+
+      threshold >>= 1;
+    }
+  }
+
+  error:
+
+  PassStats(coder, PHASE_NONE, 0);
+
+  if (result == BUFFER_EMPTY) result = OK;
+
+  return result;
+}
+
+/*
+ * Rough share of the group in the full rate stream: the sum of bit
+ * lengths of its coefficient magnitudes.
+ */
+static double GroupWeight(SPIHTCoder *coder)
+{
+  int index, row, col;
+  BitplaneMap *map = coder->map;
+  double weight;
+  Rect *rect;
+
+  weight = 0;
+
+  for (index = 0; index < coder->rect_count; index++) {
+
+    rect = &coder->rects[index];
+
+    for (row = rect->first_row; row < rect->last_row; row++)
+    for (col = rect->first_col; col < rect->last_col; col++)
+    weight += map->msb[PlaneOffset(row, col, coder->cols, map->msb_bits)];
+  }
+
+  return weight;
+}
+
+static int PassEnd(SPIHTCoder *coder,
+                   int pass)
+{
+  if (pass < 0) return 0;
+
+  if (pass < coder->passes) return coder->pass_end[pass];
+
+  return coder->stream_size;
+}
+
+/*
+ * Splits the budget between groups so that all of them stop in the same
+ * pass: every group gets the passes that fit in full, and the bytes left
+ * are shared in proportion to the size of the next pass. Sub-streams are
+ * then cut to their share; a SPIHT stream cut short is still decodable.
+ * A SPIHT_LEVELS resolution is of use in the next pass only once the
+ * coarser ones have got through it, so there the bytes left go to the
+ * next pass of the resolutions in order.
+ */
+static void AllocateBudget(SPIHTCoder **coders,
+                           int groups,
+                           int budget,
+                           int *alloc)
+{
+  int index, pass, cut, total, used, share;
+  double extra, weight;
+
+  total = 0;
+
+  for (index = 0; index < groups; index++) total += coders[index]->stream_size;
+
+  if (total <= budget) {
+
+    for (index = 0; index < groups; index++) alloc[index] = coders[index]->stream_size;
+
+    return;
+  }
+
+  for (cut = -1, pass = 0; pass < MAX_PASSES; pass++, cut++) {
+
+    total = 0;
+
+    for (index = 0; index < groups; index++) total += PassEnd(coders[index], pass);
+
+    if (total > budget) break;
+  }
+
+  used = 0;
+  weight = 0;
+
+  for (index = 0; index < groups; index++) {
+    alloc[index] = PassEnd(coders[index], cut);
+    used += alloc[index];
+    weight += PassEnd(coders[index], cut + 1) - alloc[index];
+  }
+
+  extra = budget - used;
+
+  if (coders[0]->options & SPIHT_LEVELS) {
+
+    for (index = 0; index < groups && extra > 0; index++) {
+
+      share = (int) MIN(extra, PassEnd(coders[index], cut + 1) - alloc[index]);
+
+      alloc[index] += share;
+      extra -= share;
+    }
+
+    return;
+  }
+
+  for (index = 0; index < groups; index++)
+  alloc[index] += (int) (extra * (PassEnd(coders[index], cut + 1) - alloc[index]) / weight);
+}
+
+/*
+ * Number of passes that end within the first size bytes of a group.
+ */
+static int MarkCount(SPIHTCoder *coder,
+                     int size)
+{
+  int pass;
+
+  for (pass = 0; pass < coder->passes && coder->pass_end[pass] <= size; pass++);
+
+  return pass;
+}
+
+/*
+ * Pass marks of a group: the number of passes (8 bits) and the length
+ * of every pass, seven bits per byte with the high bit set in all bytes
+ * but the last one. Only passes within alloc bytes (or within the whole
+ * sub-stream with alloc == NULL) are counted.
+ */
+static int MarksSize(SPIHTCoder **coders,
+                     int groups,
+                     int *alloc)
+{
+  int index, pass, passes, delta, size;
+
+  size = 0;
+
+  for (index = 0; index < groups; index++) {
+
+    passes = MarkCount(coders[index], alloc != NULL ? alloc[index] : coders[index]->stream_size);
+
+    size++;
+
+    for (pass = 0; pass < passes; pass++) {
+
+      delta = coders[index]->pass_end[pass] - (pass > 0 ? coders[index]->pass_end[pass - 1] : 0);
+
+      do {
+        size++;
+        delta >>= 7;
+      } while (delta != 0);
+    }
+  }
+
+  return size;
+}
+
+static unsigned char *WriteMarks(SPIHTCoder **coders,
+                                 int groups,
+                                 int *alloc,
+                                 unsigned char *ptr)
+{
+  int index, pass, passes, delta;
+
+  for (index = 0; index < groups; index++) {
+
+    passes = MarkCount(coders[index], alloc[index]);
+
+    *ptr++ = (unsigned char) passes;
+
+    for (pass = 0; pass < passes; pass++) {
+
+      delta = coders[index]->pass_end[pass] - (pass > 0 ? coders[index]->pass_end[pass - 1] : 0);
+
+      while (delta >= 0x80) {
+        *ptr++ = (unsigned char) ((delta & 0x7f) | 0x80);
+        delta >>= 7;
+      }
+
+      *ptr++ = (unsigned char) delta;
+    }
+  }
+
+  return ptr;
+}
+
+/*
+ * Reads pass marks into the passes and pass_end fields of the coders;
+ * returns FALSE and leaves every group without marks when they are cut
+ * short or damaged.
+ */
+static int ReadMarks(SPIHTCoder **coders,
+                     int groups,
+                     unsigned char *ptr,
+                     unsigned char *end)
+{
+  int index, pass, shift, delta, last;
+
+  for (index = 0; index < groups; index++) coders[index]->passes = 0;
+
+  for (index = 0; index < groups; index++) {
+
+    if (ptr >= end || *ptr > MAX_PASSES) goto damaged;
+
+    coders[index]->passes = *ptr++;
+
+    for (last = 0, pass = 0; pass < coders[index]->passes; pass++) {
+
+      delta = 0;
+
+      for (shift = 0; ; shift += 7) {
+
+        if (ptr >= end || shift > 28) goto damaged;
+
+        delta |= (*ptr & 0x7f) << shift;
+
+        if ((*ptr++ & 0x80) == 0) break;
+      }
+
+      last += delta;
+
+      coders[index]->pass_end[pass] = last;
+    }
+
+    /* marks of passes past a cut sub-stream are of no use */
+    coders[index]->passes = MarkCount(coders[index], coders[index]->stream_size);
+  }
+
+  return TRUE;
+
+  damaged:
+
+  for (index = 0; index < groups; index++) coders[index]->passes = 0;
+
+  return FALSE;
+}
+
+/*
+ * Splits a SPIHT_BLOCKS payload of buffer_size bytes between the groups.
+ * Pass marks are kept only while they take a small share of it; returns
+ * nonzero if they are to be written.
+ */
+static int PlanBlocks(SPIHTCoder **coders,
+                      int groups,
+                      int marks,
+                      int buffer_size,
+                      int *alloc)
+{
+  int *retry;
+  int room, size, index, total;
+
+  room = buffer_size - BLOCK_COUNT - groups * BLOCK_ENTRY;
+
+  if (marks) {
+
+    size = MarksSize(coders, groups, NULL);
+
+    if (size > room / MARKS_SHARE) marks = 0;
+  }
+
+  if (marks == 0) {
+
+    AllocateBudget(coders, groups, room, alloc);
+
+    return marks;
+  }
+
+  AllocateBudget(coders, groups, room - size, alloc);
+
+  /* marks of passes that were cut off are not written; try to fill their room */
+  retry = (int *) malloc(groups * sizeof(int));
+
+  if (retry == NULL) return marks;
+
+  AllocateBudget(coders, groups, room - MarksSize(coders, groups, alloc), retry);
+
+  for (total = 0, index = 0; index < groups; index++) total += retry[index];
+
+  if (total + MarksSize(coders, groups, retry) <= room) memcpy(alloc, retry, groups * sizeof(int));
+
+  free(retry);
+
+  return marks;
+}
+
+/*
+ * SPIHT_LEVELS with a quality target: the smallest payload within
+ * buffer_size whose split leaves no more squared error than the targets
+ * of all resolutions together.
+ */
+static int TargetSize(SPIHTCoder **coders,
+                      int groups,
+                      int marks,
+                      int buffer_size)
+{
+  int *alloc;
+  int low, high, size, index;
+  double goal, distortion;
+
+  alloc = (int *) malloc(groups * sizeof(int));
+
+  if (alloc == NULL) return buffer_size;
+
+  goal = 0;
+
+  for (index = 0; index < groups; index++) goal += coders[index]->target;
+
+  low = BLOCK_COUNT + groups * BLOCK_ENTRY;
+  high = buffer_size;
+
+  while (low < high) {
+
+    size = low + (high - low) / 2;
+
+    PlanBlocks(coders, groups, marks, size, alloc);
+
+    distortion = 0;
+
+    for (index = 0; index < groups; index++) distortion += CutDistortion(coders[index], alloc[index]);
+
+    if (distortion <= goal) high = size;
+    else low = size + 1;
+  }
+
+  free(alloc);
+
+  return high;
+}
+
+/*
+ * SPIHT_BLOCKS stream layout: the number of groups (16 bits) and the
+ * length of every sub-stream (32 bits each) followed by the sub-streams.
+ * With SPIHT_MARKS the pass marks of every group come last; decoders
+ * never read that far. SPIHT_LEVELS streams have the same layout with a
+ * sub-stream per resolution, so the table and the first k + 1 of them
+ * are enough for the plane at 1/2^(levels - k) of its size.
+ */
+static void WriteBlocks(SPIHTCoder **coders,
+                        int groups,
+                        int *alloc,
+                        int marks,
+                        unsigned char *buffer,
+                        int *stream_size)
+{
+  unsigned char *ptr;
+  int index;
+
+  buffer[0] = (unsigned char) ((groups >> 8) & 0xff);
+  buffer[1] = (unsigned char) ((groups >> 0) & 0xff);
+
+  ptr = buffer + BLOCK_COUNT + groups * BLOCK_ENTRY;
+
+  for (index = 0; index < groups; index++) {
+
+    buffer[BLOCK_COUNT + index * BLOCK_ENTRY + 0] = (unsigned char) ((alloc[index] >> 24) & 0xff);
+    buffer[BLOCK_COUNT + index * BLOCK_ENTRY + 1] = (unsigned char) ((alloc[index] >> 16) & 0xff);
+    buffer[BLOCK_COUNT + index * BLOCK_ENTRY + 2] = (unsigned char) ((alloc[index] >>  8) & 0xff);
+    buffer[BLOCK_COUNT + index * BLOCK_ENTRY + 3] = (unsigned char) ((alloc[index] >>  0) & 0xff);
+
+    memcpy(ptr, coders[index]->buffer, alloc[index]);
+
+    ptr += alloc[index];
+  }
+
+  if (marks) ptr = WriteMarks(coders, groups, alloc, ptr);
+
+  *stream_size = ptr - buffer;
+}
+
+/*
+ * Each group is first coded into a private buffer sized after its weight
+ * in the largest budget; a group that turns out to deserve more than it
+ * could hold for any of the budgets is coded again with room for the
+ * whole largest budget. Every output then gets its own split of the
+ * same group streams. SPIHT_LEVELS resolutions depend on the coarser
+ * ones, so they are coded in order, each with room for the whole budget.
+ */
+static int EncodeBlocks(SPIHTCoder **coders,
+                        int groups,
+                        int threads,
+                        int marks,
+                        unsigned char **buffers,
+                        int *buffer_sizes,
+                        int *stream_sizes,
+                        int *marked,
+                        int count)
+{
+  SPIHTCoder **retry;
+  int *alloc;
+  int index, target, retries, budget, size, result;
+  double weight, total;
+
+  retry = NULL;
+  alloc = NULL;
+
+  if (groups <= 0) {
+
+    for (target = 0; target < count; target++) {
+      WriteBlocks(coders, 0, NULL, 0, buffers[target], &stream_sizes[target]);
+      marked[target] = 0;
+    }
+
+    return OK;
+  }
+
+  budget = 0;
+
+  for (target = 0; target < count; target++)
+  if (buffer_sizes[target] - BLOCK_COUNT - groups * BLOCK_ENTRY > budget)
+  budget = buffer_sizes[target] - BLOCK_COUNT - groups * BLOCK_ENTRY;
+
+  retry = (SPIHTCoder **) malloc(groups * sizeof(SPIHTCoder *));
+  alloc = (int *) malloc(groups * sizeof(int));
+
+  if (retry == NULL || alloc == NULL) {
+    result = MEMORY_ERROR;
+    goto error;
+  }
+
+  total = 0;
+
+  for (index = 0; index < groups; index++) total += GroupWeight(coders[index]);
+
+  for (index = 0; index < groups; index++) {
+
+    weight = (total > 0 ? GroupWeight(coders[index]) / total : 1.0 / groups);
+
+    coders[index]->buffer_size = (int) (2.0 * weight * budget) + 256;
+
+    if (coders[index]->buffer_size > budget || (coders[index]->options & SPIHT_LEVELS)) coders[index]->buffer_size = budget;
+
+    coders[index]->buffer = (unsigned char *) malloc(coders[index]->buffer_size);
+
+    if (coders[index]->buffer == NULL) {
+      result = MEMORY_ERROR;
+      goto error;
+    }
+  }
+
+  if (coders[0]->options & SPIHT_LEVELS) threads = 1;
+
+  result = RunTasks(EncodeGroup, (void **) coders, groups, threads);
+
+  if (result != OK) goto error;
+
+  retries = 0;
+
+  for (target = 0; target < count; target++) {
+
+    AllocateBudget(coders, groups, buffer_sizes[target] - BLOCK_COUNT - groups * BLOCK_ENTRY, alloc);
+
+    for (index = 0; index < groups; index++) {
+
+      if (coders[index]->full == 0 || alloc[index] < coders[index]->stream_size) continue;
+      if (coders[index]->buffer_size >= budget) continue;
+
+      free(coders[index]->buffer);
+
+      coders[index]->buffer_size = budget;
+      coders[index]->buffer = (unsigned char *) malloc(budget);
+
+      if (coders[index]->buffer == NULL) {
+        result = MEMORY_ERROR;
+        goto error;
+      }
+
+      retry[retries++] = coders[index];
+    }
+  }
 
-  row = ABS(node->row);
-  col = ABS(node->col);
+  if (retries > 0) {
 
-  if (node_type == TYPE_S) {
+    result = RunTasks(EncodeGroup, (void **) retry, retries, threads);
 
-    if (ABS(dwt[row][col]) >= threshold) return TRUE;
-    else return FALSE;
+    if (result != OK) goto error;
   }
-  
-  if (node_type == TYPE_A) {
 
-    result = IsZerotree(dwt, rows, cols, levels, threshold, node);
+  for (target = 0; target < count; target++) {
 
-    switch (result) {
+    size = buffer_sizes[target];
 
-      case TRUE: return FALSE;
+    if ((coders[0]->options & SPIHT_LEVELS) && coders[0]->target > 0) size = TargetSize(coders, groups, marks, size);
 
-      case FALSE: return TRUE;
+    marked[target] = PlanBlocks(coders, groups, marks, size, alloc);
 
-      default: return result;
-    };
+    WriteBlocks(coders, groups, alloc, marked[target], buffers[target], &stream_sizes[target]);
   }
 
-  if (node_type == TYPE_B) {
+  result = OK;
+
+  error:
 
-    result = GetNodeOffspring(rows, cols, levels, node, offspring);
+  for (index = 0; index < groups; index++) {
+    free(coders[index]->buffer);
+    coders[index]->buffer = NULL;
+  }
 
-    if (result != OK) return result;
+  free(retry);
+  free(alloc);
 
-    for (index = 0; index < 4; index++) {
+  return result;
+}
 
-      result = IsZerotree(dwt, rows, cols, levels, threshold, &offspring[index]);
+/*
+ * Number of groups in a stream with payload_size bytes after the header:
+ * at least one LL band row per SPIHT_BLOCKS group, all SPIHT_LEVELS
+ * resolutions or none of them. Every group takes its table entry and
+ * the bytes its decoders read before the first decision, one code
+ * word per range coder of a SPIHT_LANES group. SPIHT_BLOCKS keeps that
+ * within 1/TABLE_SHARE of the payload, down to a single group.
+ */
+static int GroupCount(int options,
+                      int blocks,
+                      int rows,
+                      int levels,
+                      int payload_size)
+{
+  int groups, room, start;
 
-      switch (result) {
+  if (options & SPIHT_LANES) start = LANES * RANGE_BYTES;
+  else if (options & (SPIHT_RANGE | SPIHT_STATES)) start = RANGE_BYTES;
+  else start = CODE_BITS >> 3;
 
-        case TRUE: break;
+  room = (payload_size - BLOCK_COUNT) / (BLOCK_ENTRY + start);
 
-        case FALSE: return TRUE;
+  if (options & SPIHT_BLOCKS) {
 
-        default: return result;
-      };
-    }
+    groups = MIN(blocks, rows >> levels);
+    groups = MIN(groups, MAX(1, payload_size / TABLE_SHARE / (BLOCK_ENTRY + start)));
 
-    return FALSE;
+    return MIN(groups, room);
   }
 
-  return INTERNAL_ERROR;
-}
+  if (options & SPIHT_LEVELS) return (levels + 1 <= room ? levels + 1 : 0);
 
-static void InitCoefficient(double **dwt,
-                            int threshold,
-                            int sign,
-                            Node *node)
-{
-  dwt[node->row][node->col] = (sign ?  - threshold - (threshold >> 1) : threshold + (threshold >> 1));
+  return 1;
 }
 
-static int SPIHTInit(int rows,
-                     int cols,
-                     int levels,
-                     NodeList *LIP,
-                     NodeList *LIS)
+/*
+ * Coders of the tree groups, or of the resolutions with SPIHT_LEVELS,
+ * set up on the plane. NULL when out of memory.
+ */
+static SPIHTCoder **AllocGroups(int groups,
+                                int options,
+                                int stats,
+                                CoeffPlane *plane,
+                                BitplaneMap *map,
+                                unsigned char *state,
+                                int rows,
+                                int cols,
+                                int levels,
+                                int bits,
+                                double target_mse)
 {
-  int max_row, max_col;
-  int row, col;
-  int result;
+  SPIHTCoder **coders;
+  int index;
+
+  coders = (SPIHTCoder **) malloc(groups * sizeof(SPIHTCoder *));
+
+  if (coders == NULL) return NULL;
 
-  max_row = rows >> (levels - 1);
-  max_col = cols >> (levels - 1);
+  for (index = 0; index < groups; index++) coders[index] = NULL;
 
-  for (row = 0; row < max_row; row++) {
-    for (col = 0; col < max_col; col++) {
+  for (index = 0; index < groups; index++) {
 
-      if ((result = AppendNode(LIP, row, col)) != OK) return result;
+    coders[index] = AllocSPIHTCoder(options, stats);
 
-      if (IsValidNodeA(rows, cols, levels, LIP->end) == TRUE)
-      if ((result = AppendNode(LIS, row, col)) != OK) return result;
+    if (coders[index] == NULL) {
+      FreeGroups(coders, groups);
+      return NULL;
     }
+
+    if (options & SPIHT_LEVELS) {
+
+      SetupSPIHTCoder(coders[index], plane, map, state, rows, cols, levels, bits, 0, rows >> levels);
+      SetupLevelCoder(coders[index], index, (index > 0 ? coders[index - 1] : NULL));
+
+    } else SetupSPIHTCoder(coders[index], plane, map, state, rows, cols, levels, bits,
+    index * (rows >> levels) / groups, (index + 1) * (rows >> levels) / groups);
+
+    if (target_mse > 0) coders[index]->target = target_mse * GroupArea(coders[index]);
   }
 
-  return OK;
+  return coders;
 }
 
-static int SPIHTEncodeSignificancePass(double **dwt,
-                                       int rows,
-                                       int cols,
-                                       int levels,
-                                       int threshold,
-                                       NodeList *LIP,
-                                       NodeList *LSP,
-                                       NodeList *LIS,
-                                       BitStream *bit_stream,
-                                       ArithCoder *arith_coder)
+static void FreeGroups(SPIHTCoder **coders,
+                       int groups)
 {
-  int result1, result2, result3, result4, index;
-  Node offspring[4];
-  Node *node, *next;
+  int index;
 
-  node = LIP->start;
+  if (coders == NULL) return;
 
-  while (node != NULL) {
+  for (index = 0; index < groups; index++) FreeSPIHTCoder(coders[index]);
 
-    next = node->next;
+  free(coders);
+}
 
-    result1 = IsNodeSignificant(dwt, rows, cols, levels, threshold, TYPE_S, node);
+int SPIHTEncodeDWT(void *dwt_data,
+                   int dwt_type,
+                   int rows,
+                   int cols,
+                   int levels,
+                   unsigned char *buffer,
+                   int buffer_size,
+                   int *stream_size,
+                   SPIHTParams *params)
+{
+  return SPIHTEncodeDWTMulti(dwt_data, dwt_type, rows, cols, levels, &buffer, &buffer_size, stream_size, 1, params);
+}
 
-    if (result1 == TRUE) {
+/*
+ * Codes the plane once and writes a stream for every buffer, each one
+ * as large as its buffer allows. A SPIHT stream cut short is the stream
+ * coded for the shorter budget, so without SPIHT_BLOCKS the smaller
+ * outputs are plain prefixes of the largest one. With SPIHT_BLOCKS or
+ * SPIHT_LEVELS every output gets the groups of a stream coded for its
+ * size alone, and the plane is coded once for every group count. The
+ * smaller outputs of a count are cut from group streams coded with room
+ * for the largest one. So their last pass can be split a few bytes
+ * differently from a separate call with their size.
+ */
+int SPIHTEncodeDWTMulti(void *dwt_data,
+                        int dwt_type,
+                        int rows,
+                        int cols,
+                        int levels,
+                        unsigned char **buffers,
+                        int *buffer_sizes,
+                        int *stream_sizes,
+                        int count,
+                        SPIHTParams *params)
+{
+  SPIHTCoder **coders;
+  BitplaneMap *map;
+  unsigned char *state;
+  unsigned char **payloads, **set_payloads, *ptr;
+  int *payload_sizes, *marked, *group_counts;
+  int *members, *set_sizes, *set_streams, *set_marked;
+  int options, groups, threads, shift, tile_bits;
+  int bits, hdr_size, index, size, row, col;
+  int target, largest, smallest, first, members_count;
+  int result;
+  double target_mse;
+  CoeffPlane plane;
 
-      if ((result2 = EncodeSymbol(arith_coder, bit_stream, 1)) != OK) return result2;
-      UpdateModel(arith_coder, 1);
+  coders = NULL;
+  map = NULL;
+  state = NULL;
+  payloads = NULL;
+  payload_sizes = NULL;
+  marked = NULL;
+  set_payloads = NULL;
+  group_counts = NULL;
 
-      if ((result2 = EncodeSymbol(arith_coder, bit_stream, (dwt[node->row][node->col] > 0 ? 0 : 1))) != OK) return result2;
-      UpdateModel(arith_coder, (dwt[node->row][node->col] > 0 ? 0 : 1));
+  groups = 0;
 
-      if ((result2 = MoveNode(LIP, LSP, node)) != OK) return result2;
+  if (count < 1) return BAD_PARAMS;
 
-    } else if (result1 == FALSE) {
+  for (target = 0; target < count; target++) stream_sizes[target] = 0;
 
-      if ((result2 = EncodeSymbol(arith_coder, bit_stream, 0)) != OK) return result2;
-      UpdateModel(arith_coder, 0);
+  options = (params != NULL ? params->options : 0);
+  threads = (params != NULL ? params->threads : 1);
+  target_mse = (params != NULL ? params->target_mse : 0);
+  shift = (params != NULL && (options & SPIHT_ROI) ? params->roi_shift : 0);
+  tile_bits = TileBits(levels, (params != NULL ? params->layout : SPIHT_RASTER));
 
-    } else return result1;
+  if ((options & ~KNOWN_OPTIONS) != 0) {
+    result = BAD_PARAMS;
+    goto error;
+  }
+
+  /* any prefix of a single stream is a valid stream, marks are of no use */
+  if ((options & (SPIHT_BLOCKS | SPIHT_LEVELS)) == 0) options &= ~SPIHT_MARKS;
 
-    node = next;
+  /* resolutions are coded by the list engine with a model per group of decisions only */
+  if ((options & SPIHT_LEVELS) && (options & (SPIHT_BLOCKS | SPIHT_LISTFREE | SPIHT_CONTEXTS))) {
+    result = BAD_PARAMS;
+    goto error;
   }
 
-  node = LIS->start;
+  largest = smallest = 0;
 
-  while (node != NULL) {
+  for (target = 0; target < count; target++) {
 
-    next = node->next;
+    if (buffer_sizes[target] > buffer_sizes[largest]) largest = target;
+    if (buffer_sizes[target] < buffer_sizes[smallest]) smallest = target;
+  }
 
-    if (node->row > 0 || node->col > 0) {
+  size = buffer_sizes[smallest];
 
-      result1 = IsNodeSignificant(dwt, rows, cols, levels, threshold, TYPE_A, node);
+  if (size < HeaderSize(options) + 1 || ((options & (SPIHT_BLOCKS | SPIHT_LEVELS)) && size < HeaderSize(options) + BLOCK_COUNT)) {
+    result = INTERNAL_ERROR;
+    goto error;
+  }
 
-      if (result1 == TRUE) {
+  if ((options & SPIHT_ROI) && (shift < 1 || shift > MaxPlaneBits(SPIHT_INT32))) {
+    result = BAD_PARAMS;
+    goto error;
+  }
 
-        if ((result2 = EncodeSymbol(arith_coder, bit_stream, 1)) != OK) return result2;
-        UpdateModel(arith_coder, 1);
+  if ((options & SPIHT_BLOCKS) && (levels > MAX_RECTS / 2 || params->blocks < 1)) {
+    result = BAD_PARAMS;
+    goto error;
+  }
 
-        if ((result2 = GetNodeOffspring(rows, cols, levels, node, offspring)) != OK) return result2;
+  if ((result = InitPlane(&plane, dwt_data, dwt_type, cols, tile_bits)) != OK) goto error;
 
-        for (index = 0; index < 4; index++) {
+  map = AllocBitplaneMap(rows, cols, tile_bits);
+  payloads = (unsigned char **) malloc(count * sizeof(unsigned char *));
+  payload_sizes = (int *) malloc(count * sizeof(int));
+  marked = (int *) malloc(count * sizeof(int));
+  set_payloads = (unsigned char **) malloc(count * sizeof(unsigned char *));
 
-          result3 = IsNodeSignificant(dwt, rows, cols, levels, threshold, TYPE_S, &offspring[index]);
+  /* group count of every output, then the outputs coded together and their sizes */
+  group_counts = (int *) malloc(5 * count * sizeof(int));
 
-          if (result3 == TRUE) {
+  if (map == NULL || payloads == NULL || payload_sizes == NULL || marked == NULL || set_payloads == NULL || group_counts == NULL) {
+    result = MEMORY_ERROR;
+    goto error;
+  }
 
-            if ((result4 = EncodeSymbol(arith_coder, bit_stream, 1)) != OK) return result4;
-            UpdateModel(arith_coder, 1);
+  if (options & (SPIHT_LISTFREE | SPIHT_CONTEXTS)) {
 
-            if ((result4 = EncodeSymbol(arith_coder, bit_stream, (dwt[offspring[index].row][offspring[index].col]  > 0 ? 0 : 1))) != OK) return result4;
-            UpdateModel(arith_coder, (dwt[offspring[index].row][offspring[index].col]  > 0 ? 0 : 1));
+    state = (unsigned char *) malloc((size_t) rows * cols);
 
-            if ((result4 = AppendNode(LSP, offspring[index].row, offspring[index].col)) != OK) return result4;
+    if (state == NULL) {
+      result = MEMORY_ERROR;
+      goto error;
+    }
+  }
 
-          } else if (result3 == FALSE) {
+  bits = BuildBitplaneMap(&plane, map);
 
-            if ((result4 = EncodeSymbol(arith_coder, bit_stream, 0)) != OK) return result4;
-            UpdateModel(arith_coder, 0);
+  for (target = 0; target < count; target++) {
 
-            if ((result4 = AppendNode(LIP, offspring[index].row, offspring[index].col)) != OK) return result4;
+    hdr_size = WriteStreamHeader(buffers[target], buffer_sizes[target], bits, options, shift);
 
-          } else return result3;
+    payloads[target] = buffers[target] + hdr_size;
+    payload_sizes[target] = buffer_sizes[target] - hdr_size;
+  }
 
-        }
+  members = group_counts + count;
+  set_sizes = group_counts + 2 * count;
+  set_streams = group_counts + 3 * count;
+  set_marked = group_counts + 4 * count;
 
-        if (IsValidNodeB(rows, cols, levels, node) == TRUE) {
+  if (options & (SPIHT_BLOCKS | SPIHT_LEVELS)) {
 
-          ChangeNodeType(node);
+    for (target = 0; target < count; target++)
+    group_counts[target] = GroupCount(options, (params != NULL ? params->blocks : 0), rows, levels, payload_sizes[target]);
 
-          if ((result3 = MoveNode(LIS, LIS, node)) != OK) return result3;
+    /* the outputs with the group count of the largest one go last, its coders are kept for the MSE and statistics */
+    for (;;) {
 
-        } else {
+      for (first = 0; first < count && (group_counts[first] < 0 || group_counts[first] == group_counts[largest]); first++);
 
-          if ((result3 = RemoveNode(LIS, node)) != OK) return result3;
-        }
+      if (first == count) {
 
-      } else if (result1 == FALSE) {
+        if (group_counts[largest] < 0) break;
 
-        if ((result2 = EncodeSymbol(arith_coder, bit_stream, 0)) != OK) return result2;
-        UpdateModel(arith_coder, 0);
+        first = largest;
+      }
 
-      } else return result1;
+      FreeGroups(coders, groups);
 
-    } else {
+      coders = NULL;
+      groups = group_counts[first];
+      members_count = 0;
 
-      result1 = IsNodeSignificant(dwt, rows, cols, levels, threshold, TYPE_B, node);
+      for (target = 0; target < count; target++) {
 
-      if (result1 == TRUE) {
+        if (group_counts[target] != groups) continue;
 
-        if ((result2 = EncodeSymbol(arith_coder, bit_stream, 1)) != OK) return result2;
-        UpdateModel(arith_coder, 1);
+        set_payloads[members_count] = payloads[target];
+        set_sizes[members_count] = payload_sizes[target];
+        members[members_count++] = target;
 
-        if ((result2 = GetNodeOffspring(rows, cols, levels, node, offspring)) != OK) return result2;
+        group_counts[target] = -1;
+      }
 
-        for (index = 0; index < 4; index++) {
+      if (groups > 0) {
 
-          if ((result3 = AppendNode(LIS, offspring[index].row, offspring[index].col)) != OK) return result3;
+        coders = AllocGroups(groups, options, params != NULL && params->stats != NULL, &plane, map, state,
+                             rows, cols, levels, bits, target_mse);
 
+        if (coders == NULL) {
+          result = MEMORY_ERROR;
+          goto error;
         }
+      }
 
-        next = node->next;
+      result = EncodeBlocks(coders, groups, threads, options & SPIHT_MARKS, set_payloads, set_sizes,
+                            set_streams, set_marked, members_count);
 
-        if ((result3 = RemoveNode(LIS, node)) != OK) return result3;
+      if (result != OK) goto error;
 
-      } else if (result1 == FALSE) {
+      for (index = 0; index < members_count; index++) {
+        stream_sizes[members[index]] = set_streams[index];
+        marked[members[index]] = set_marked[index];
+      }
+    }
 
-        if ((result2 = EncodeSymbol(arith_coder, bit_stream, 0)) != OK) return result2;
-        UpdateModel(arith_coder, 0);
+    for (target = 0; target < count; target++)
+    if ((options & SPIHT_MARKS) && marked[target] == 0)
+    WriteStreamHeader(buffers[target], buffer_sizes[target], bits, options & ~SPIHT_MARKS, shift);
 
-      } else return result1;
+  } else {
+
+    groups = 1;
 
+    coders = AllocGroups(groups, options, params != NULL && params->stats != NULL, &plane, map, state,
+                         rows, cols, levels, bits, target_mse);
+
+    if (coders == NULL) {
+      result = MEMORY_ERROR;
+      goto error;
     }
 
-    node = next;
-  }
+    coders[0]->buffer = payloads[largest];
+    coders[0]->buffer_size = payload_sizes[largest];
 
-  return OK;
-}
+    /* a quality target and the statistics need the coder in step with the passes */
+    if (threads > 1 && target_mse <= 0 && coders[0]->stats == NULL) result = EncodePipelined(coders[0]);
+    else result = EncodeGroup(coders[0]);
 
-static int SPIHTEncodeRefinementPass(double **dwt,
-                                     int threshold,
-                                     NodeList *LSP,
-                                     BitStream *bit_stream,
-                                     ArithCoder *arith_coder)
-{
-  Node *node;
-  int result;
+    coders[0]->buffer = NULL;
 
-  node = LSP->start;
+    if (result != OK) goto error;
 
-  if (threshold > 0) {
+    for (target = 0; target < count; target++) {
 
-    while (node != NULL) {
+      stream_sizes[target] = MIN(payload_sizes[target], coders[0]->stream_size);
 
-      if ((result = EncodeSymbol(arith_coder, bit_stream, (((int) ABS(dwt[node->row][node->col])) & threshold ? 1 : 0))) != OK) return result;
-      UpdateModel(arith_coder, ((((int) ABS(dwt[node->row][node->col])) & threshold) ? 1 : 0));
-      node = node->next;
+      if (target != largest) memcpy(payloads[target], payloads[largest], stream_sizes[target]);
     }
   }
 
-  return OK;
-}
+  for (target = 0; target < count; target++) stream_sizes[target] += payloads[target] - buffers[target];
 
-static int SPIHTDecodeSignificancePass(double **dwt,
-                                       int rows,
-                                       int cols,
-                                       int levels,
-                                       int threshold,
-                                       NodeList *LIP,
-                                       NodeList *LSP,
-                                       NodeList *LIS,
-                                       BitStream *bit_stream,
-                                       ArithCoder *arith_coder)
-{
-  int result1, result2, result3, result4, index;
-  Node offspring[4];
-  Node *node, *next;
-  int bit;
+  if (target_mse > 0) {
 
-  node = LIP->start;
+    params->mse = 0;
 
-  while (node != NULL) {
+    /* groups may have been cut to share the largest buffer, see their table */
+    for (index = 0; index < groups; index++) {
 
-    next = node->next;
+      if (options & (SPIHT_BLOCKS | SPIHT_LEVELS)) {
+        ptr = payloads[largest] + BLOCK_COUNT + index * BLOCK_ENTRY;
+        size = (ptr[0] << 24) | (ptr[1] << 16) | (ptr[2] << 8) | ptr[3];
+      } else size = coders[index]->stream_size;
 
-    if ((result1 = DecodeSymbol(arith_coder, bit_stream, &bit)) != OK) return result1;
-    UpdateModel(arith_coder, bit);
+      params->mse += CutDistortion(coders[index], size);
+    }
 
-    if (bit == 1) {
+    /* no group fit in the buffer, nothing was coded */
+    if (groups == 0)
+    for (row = 0; row < rows; row++)
+    for (col = 0; col < cols; col++)
+    params->mse += (double) GetCoefficient(&plane, row, col) * GetCoefficient(&plane, row, col);
 
-      if ((result2 = DecodeSymbol(arith_coder, bit_stream, &bit)) != OK) return result2;
-      UpdateModel(arith_coder, bit);
+    params->mse /= (double) rows * cols;
+  }
 
-      InitCoefficient(dwt, threshold, bit, node);
+  /* of the groups as coded, before they were cut to fit */
+  if (params != NULL && params->stats != NULL) CollectStats(coders, groups, params->stats);
 
-      if ((result2 = MoveNode(LIP, LSP, node)) != OK) return result2;
-    }
+  result = OK;
 
-    node = next;
-  }
+  error:
 
-  node = LIS->start;
+  FreeGroups(coders, groups);
 
-  while (node != NULL) {
+  free(state);
+  free(payloads);
+  free(payload_sizes);
+  free(marked);
+  free(set_payloads);
+  free(group_counts);
 
-    next = node->next;
+  FreeBitplaneMap(map);
 
-    if (node->row > 0 || node->col > 0) {
+  return result;
+}
+
+int SPIHTDecodeDWT(void *dwt_data,
+                   int dwt_type,
+                   int rows,
+                   int cols,
+                   int levels,
+                   unsigned char *buffer,
+                   int buffer_size,
+                   SPIHTParams *params)
+{
+  SPIHTCoder **coders;
+  unsigned char *state, *ptr, *end, *avail;
+  int bits, result, options, threads, shift, tile_bits;
+  int hdr_size, groups, first, count, index, size;
+  CoeffPlane plane;
 
-      if ((result1 = DecodeSymbol(arith_coder, bit_stream, &bit)) != OK) return result1;
-      UpdateModel(arith_coder, bit);
+  coders = NULL;
+  state = NULL;
 
-      if (bit == 1) {
+  groups = 0;
+  shift = 0;
 
-        if ((result2 = GetNodeOffspring(rows, cols, levels, node, offspring)) != OK) return result2;
+  threads = (params != NULL ? params->threads : 1);
+  tile_bits = TileBits(levels, (params != NULL ? params->layout : SPIHT_RASTER));
 
-        for (index = 0; index < 4; index++) {
+  if (buffer_size < 2) {
+    result = INTERNAL_ERROR;
+    goto error;
+  }
 
-          if ((result3 = DecodeSymbol(arith_coder, bit_stream, &bit)) != OK) return result3;
-          UpdateModel(arith_coder, bit);
+  if ((result = InitPlane(&plane, dwt_data, dwt_type, cols, tile_bits)) != OK) goto error;
 
-          if (bit == 1) {
+  ResetPlane(&plane, rows, cols);
 
-            if ((result4 = DecodeSymbol(arith_coder, bit_stream, &bit)) != OK) return result4;
-            UpdateModel(arith_coder, bit);
+  end = buffer + buffer_size;
 
-            InitCoefficient(dwt, threshold, bit, &offspring[index]);
+  avail = WaitData(params, buffer + 4, end);
 
-            if ((result4 = AppendNode(LSP, offspring[index].row, offspring[index].col)) != OK) return result4;
+  hdr_size = ReadStreamHeader(buffer, avail - buffer, &bits, &options, &shift);
 
-          } else {
+  if (hdr_size == 0) {
+    result = BUFFER_EMPTY;
+    goto error;
+  }
 
-            if ((result4 = AppendNode(LIP, offspring[index].row, offspring[index].col)) != OK) return result4;
+  if ((options & ~KNOWN_OPTIONS) != 0) {
+    result = DAMAGED_HEADER;
+    goto error;
+  }
 
-          }
+  if ((options & SPIHT_LEVELS) && (options & (SPIHT_BLOCKS | SPIHT_LISTFREE | SPIHT_CONTEXTS))) {
+    result = DAMAGED_HEADER;
+    goto error;
+  }
 
-        }
+  if (bits > MaxPlaneBits(dwt_type)) {
+    result = (bits > MaxPlaneBits(SPIHT_INT32) ? DAMAGED_HEADER : BAD_PARAMS);
+    goto error;
+  }
 
-        if (IsValidNodeB(rows, cols, levels, node) == TRUE) {
+  if ((options & SPIHT_ROI) && (shift < 1 || shift > MaxPlaneBits(SPIHT_INT32))) {
+    result = DAMAGED_HEADER;
+    goto error;
+  }
 
-          ChangeNodeType(node);
+  ptr = buffer + hdr_size;
 
-          if ((result3 = MoveNode(LIS, LIS, node)) != OK) return result3;
+  if (options & (SPIHT_BLOCKS | SPIHT_LEVELS)) {
 
-        } else {
+    avail = WaitData(params, ptr + BLOCK_COUNT + BLOCK_ENTRY, end);
 
-          if ((result3 = RemoveNode(LIS, node)) != OK) return result3;
+    if (avail - ptr < BLOCK_COUNT + BLOCK_ENTRY) {
+      result = BUFFER_EMPTY;
+      goto error;
+    }
 
-        }
+    groups = (ptr[0] << 8) | ptr[1];
 
-      }
+    ptr += BLOCK_COUNT;
 
-    } else {
+    if (((options & SPIHT_BLOCKS) && groups > rows >> levels) || levels > MAX_RECTS / 2) {
+      result = DAMAGED_HEADER;
+      goto error;
+    }
 
-      if ((result1 = DecodeSymbol(arith_coder, bit_stream, &bit)) != OK) return result1;
-      UpdateModel(arith_coder, bit);
+    /* all resolutions or none of them */
+    if ((options & SPIHT_LEVELS) && groups != 0 && groups != levels + 1) {
+      result = DAMAGED_HEADER;
+      goto error;
+    }
 
-      if (bit == 1) {
+    avail = WaitData(params, ptr + groups * BLOCK_ENTRY, end);
 
-        if ((result2 = GetNodeOffspring(rows, cols, levels, node, offspring)) != OK) return result2;
+    /* the sub-streams follow the table, so nothing is there to decode */
+    if (avail - ptr < groups * BLOCK_ENTRY) {
+      groups = 0;
+      result = BUFFER_EMPTY;
+      goto error;
+    }
 
-        for (index = 0; index < 4; index++) {
+  } else groups = 1;
 
-          if ((result3 = AppendNode(LIS, offspring[index].row, offspring[index].col)) != OK) return result3;
+  if (options & (SPIHT_LISTFREE | SPIHT_CONTEXTS)) {
 
-        }
+    state = (unsigned char *) malloc((size_t) rows * cols);
 
-        next = node->next;
+    if (state == NULL) {
+      result = MEMORY_ERROR;
+      goto error;
+    }
+  }
 
-        if ((result3 = RemoveNode(LIS, node)) != OK) return result3;
+  if (groups > 0) {
 
-      }
+    coders = (SPIHTCoder **) malloc(groups * sizeof(SPIHTCoder *));
 
+    if (coders == NULL) {
+      result = MEMORY_ERROR;
+      goto error;
     }
 
-    node = next;
+    for (index = 0; index < groups; index++) coders[index] = NULL;
   }
 
-  return OK;
-}
+  for (index = 0; index < groups; index++) {
 
-static int SPIHTDecodeRefinementPass(double **dwt,
-                                     int threshold,
-                                     NodeList *LSP,
-                                     BitStream *bit_stream,
-                                     ArithCoder *arith_coder)
-{
-  int result, coeff, bit;
-  Node *node;
+    coders[index] = AllocSPIHTCoder(options, params != NULL && params->stats != NULL);
 
-  node = LSP->start;
+    if (coders[index] == NULL) {
+      result = MEMORY_ERROR;
+      goto error;
+    }
 
-  if (threshold > 0) {
+    if (params != NULL) {
+      coders[index]->bit_stream->wait = params->wait;
+      coders[index]->bit_stream->wait_context = params->wait_context;
+    }
 
-    while (node != NULL) {
+    if (options & SPIHT_LEVELS) {
 
-      coeff = (int) dwt[node->row][node->col];
+      SetupSPIHTCoder(coders[index], &plane, NULL, state, rows, cols, levels, bits, 0, rows >> levels);
+      SetupLevelCoder(coders[index], index, (index > 0 ? coders[index - 1] : NULL));
 
-      if ((result = DecodeSymbol(arith_coder, bit_stream, &bit)) != OK) return result;
-      UpdateModel(arith_coder, bit);
+    } else SetupSPIHTCoder(coders[index], &plane, NULL, state, rows, cols, levels, bits,
+    index * (rows >> levels) / groups, (index + 1) * (rows >> levels) / groups);
 
-      if (coeff > 0) coeff -= threshold;
-      else coeff += threshold;
+    if (options & (SPIHT_BLOCKS | SPIHT_LEVELS)) {
 
-      if (bit == 1) {
-        if (coeff > 0) coeff += threshold;
-        else coeff -= threshold;
-      }
+      size = (ptr[index * BLOCK_ENTRY + 0] << 24) | (ptr[index * BLOCK_ENTRY + 1] << 16) |
+             (ptr[index * BLOCK_ENTRY + 2] << 8) | (ptr[index * BLOCK_ENTRY + 3] << 0);
 
-      if (coeff > 0) coeff += (threshold >> 1);
-      else coeff -= (threshold >> 1);
+      if (index == 0) coders[index]->buffer = ptr + groups * BLOCK_ENTRY;
+      else coders[index]->buffer = coders[index - 1]->buffer + coders[index - 1]->buffer_size;
 
-      dwt[node->row][node->col] = coeff;
+      if (size < 0 || size > end - coders[index]->buffer) size = end - coders[index]->buffer;
 
-      node = node->next;
+    } else {
+
+      coders[index]->buffer = ptr;
+
+      size = end - ptr;
     }
-  }
 
-  return OK;
-}
+    coders[index]->buffer_size = size;
+  }
 
-int SPIHTEncodeDWT(double *dwt_data,
-                   int rows,
-                   int cols,
-                   int levels,
-                   unsigned char *buffer,
-                   int buffer_size,
-                   int *stream_size)
-{
-  NodeList *LIP, *LSP, *LIS;
-  BitStream *bit_stream;
-  ArithCoder *arith_coder;
-  int bits, temp, index;
-  int result, threshold;
-  double **dwt;
-  int *cum_freq;
+  /* a resolution needs the nodes the coarser one hands over */
+  if (options & SPIHT_LEVELS) threads = 1;
 
-  LIP = LSP = LIS = NULL;
-  bit_stream = NULL;
-  arith_coder = NULL;
-  dwt = NULL;
-  cum_freq = NULL;
+  /* the finest resolutions are left out of a reduced decode */
+  first = 0;
+  count = groups;
 
-  *stream_size = 0;
+  if ((options & SPIHT_LEVELS) && params != NULL && params->reduce > 0)
+    count = (params->reduce < groups ? groups - params->reduce : 0);
 
-  if (buffer_size < 2) {
-    result = INTERNAL_ERROR;
-    goto error;
-  }
+  /* and the tree groups off a region of interest */
+  if ((options & SPIHT_BLOCKS) && params != NULL && params->row_end > 0) {
 
-  LIP = AllocNodeList();
-  LSP = AllocNodeList();
-  LIS = AllocNodeList();
+    while (first < groups && (first + 1) * (rows >> levels) / groups <= params->row_start) first++;
+    while (count > first && (count - 1) * (rows >> levels) / groups >= params->row_end) count--;
 
-  bit_stream = AllocBitStream();
-  arith_coder = AllocArithCoder();
+    count -= first;
+  }
 
-  dwt = (double **) malloc(rows * sizeof(double *));
-  cum_freq = (int *) malloc((ALPHA_SIZE + 1) * sizeof(int));
+  result = RunTasks(DecodeGroup, (void **) (coders + first), count, threads);
 
-  if (LIP == NULL || LSP == NULL || LIS == NULL ||
-      bit_stream == NULL || arith_coder == NULL ||
-      dwt == NULL || cum_freq == NULL) {
+  if (shift > 0 && (result == OK || result == BUFFER_EMPTY)) UndoShift(&plane, rows, cols, shift);
 
-    result = MEMORY_ERROR;
-    goto error;
-  }
+  if (params != NULL && params->stats != NULL) CollectStats(coders, groups, params->stats);
 
-  bit_stream->buffer = buffer + 1;
-  bit_stream->buffer_size = buffer_size - 1;
+  error:
 
-  InitWriteBits(bit_stream);
+  if (coders != NULL)
+  for (index = 0; index < groups; index++) FreeSPIHTCoder(coders[index]);
 
-  arith_coder->cum_freq = cum_freq;
+  free(coders);
+  free(state);
 
-  InitModel(arith_coder);
-  InitEncoder(arith_coder);
+  if (result == BUFFER_EMPTY) result = OK;
 
-  for (index = 0; index < rows; index++) dwt[index] = dwt_data + index * cols;
+  return result;
+}
 
-  threshold = InitialThreshold(dwt, rows, cols);
+/*
+ * Writes the stream of at most out_size bytes that is left of a coded
+ * stream when it is cut down, without decoding it: a single stream is
+ * cut as it is, and the sub-streams of SPIHT_BLOCKS are cut to a new
+ * split of the budget, made from the pass marks of SPIHT_MARKS streams
+ * or in proportion to the sub-stream lengths otherwise. Without marks
+ * the resolutions of SPIHT_LEVELS are kept whole, coarse first. The
+ * buffers must not overlap.
+ */
+int SPIHTTruncate(unsigned char *buffer,
+                  int buffer_size,
+                  unsigned char *out,
+                  int out_size,
+                  int *stream_size)
+{
+  SPIHTCoder *group_data;
+  SPIHTCoder **coders;
+  unsigned char *ptr, *end;
+  int *alloc;
+  int bits, options, shift, hdr_size, groups, index, size, marks;
+  int result;
 
-  temp = threshold;
-  bits = 0;
+  group_data = NULL;
+  coders = NULL;
+  alloc = NULL;
 
-  while (temp != 0) {
-    temp >>= 1;
-    bits++;
-  }
+  *stream_size = 0;
 
-  buffer[0] = (unsigned char) bits;
+  hdr_size = ReadStreamHeader(buffer, buffer_size, &bits, &options, &shift);
 
-  result = SPIHTInit(rows, cols, levels, LIP, LIS);
+  if (hdr_size == 0) return BUFFER_EMPTY;
 
-  if (result != OK) goto error;
+  if ((options & ~KNOWN_OPTIONS) != 0) return DAMAGED_HEADER;
 
-  while (threshold > 0) {
+  if (out_size < hdr_size + 1 || ((options & (SPIHT_BLOCKS | SPIHT_LEVELS)) && out_size < hdr_size + BLOCK_COUNT))
+  return INTERNAL_ERROR;
 
-    result = SPIHTEncodeSignificancePass(dwt, rows, cols, levels, threshold, LIP, LSP, LIS, bit_stream, arith_coder);
+  ptr = buffer + hdr_size;
+  end = buffer + buffer_size;
 
-    if (result != OK) goto error;
+  groups = 0;
 
-    result = SPIHTEncodeRefinementPass(dwt, threshold >> 1, LSP, bit_stream, arith_coder);
+  if ((options & (SPIHT_BLOCKS | SPIHT_LEVELS)) && end - ptr >= BLOCK_COUNT) {
 
-    if (result != OK) goto error;
+    groups = (ptr[0] << 8) | ptr[1];
 
-    threshold >>= 1;
+    if (end - ptr < BLOCK_COUNT + groups * BLOCK_ENTRY) groups = 0;
   }
 
-  error:
+  /* nothing but the stream itself to cut */
+  if (groups == 0) {
 
-  if (result == BUFFER_FULL || result == OK) {
+    *stream_size = MIN(buffer_size, out_size);
 
-    DoneEncoder(arith_coder, bit_stream);
-    FlushBits(bit_stream);
+    memcpy(out, buffer, *stream_size);
 
-    *stream_size = bit_stream->next_byte - bit_stream->buffer + 1;
+    return OK;
   }
 
-  free(cum_freq);
-  free(dwt);
-
-  FreeArithCoder(arith_coder);
-  FreeBitStream(bit_stream);
+  /* too small for the table, or for every resolution: no groups, as the encoder does */
+  if (out_size - hdr_size < BLOCK_COUNT + groups * BLOCK_ENTRY ||
+      ((options & SPIHT_LEVELS) && GroupCount(options, 0, 0, groups - 1, out_size - hdr_size) == 0)) {
 
-  FreeNodeList(LIP);
-  FreeNodeList(LSP);
-  FreeNodeList(LIS);
+    WriteStreamHeader(out, out_size, bits, options & ~SPIHT_MARKS, shift);
 
-  if (result == BUFFER_FULL) result = OK;
+    WriteBlocks(NULL, 0, NULL, 0, out + hdr_size, &size);
 
-  return result;
-}
+    *stream_size = hdr_size + size;
 
-int SPIHTDecodeDWT(double *dwt_data,
-                   int rows,
-                   int cols,
-                   int levels,
-                   unsigned char *buffer,
-                   int buffer_size)
-{
-  NodeList *LIP, *LSP, *LIS;
-  BitStream *bit_stream;
-  ArithCoder *arith_coder;
-  int bits, index, result, threshold;
-  double **dwt;
-  int *cum_freq;
+    return OK;
+  }
 
-  LIP = LSP = LIS = NULL;
-  bit_stream = NULL;
-  arith_coder = NULL;
-  dwt = NULL;
-  cum_freq = NULL;
+  group_data = (SPIHTCoder *) malloc(groups * sizeof(SPIHTCoder));
+  coders = (SPIHTCoder **) malloc(groups * sizeof(SPIHTCoder *));
+  alloc = (int *) malloc(groups * sizeof(int));
 
-  if (buffer_size < 2) {
-    result = INTERNAL_ERROR;
+  if (group_data == NULL || coders == NULL || alloc == NULL) {
+    result = MEMORY_ERROR;
     goto error;
   }
 
-  LIP = AllocNodeList();
-  LSP = AllocNodeList();
-  LIS = AllocNodeList();
+  ptr += BLOCK_COUNT;
 
-  bit_stream = AllocBitStream();
-  arith_coder = AllocArithCoder();
+  for (index = 0; index < groups; index++) {
 
-  dwt = (double **) malloc(rows * sizeof(double *));
-  cum_freq = (int *) malloc((ALPHA_SIZE + 1) * sizeof(int));
+    coders[index] = &group_data[index];
 
-  if (LIP == NULL || LSP == NULL || LIS == NULL ||
-      bit_stream == NULL || arith_coder == NULL ||
-      dwt == NULL || cum_freq == NULL) {
+    size = (ptr[index * BLOCK_ENTRY + 0] << 24) | (ptr[index * BLOCK_ENTRY + 1] << 16) |
+           (ptr[index * BLOCK_ENTRY + 2] << 8) | (ptr[index * BLOCK_ENTRY + 3] << 0);
 
-    result = MEMORY_ERROR;
-    goto error;
-  }
+    if (index == 0) coders[index]->buffer = ptr + groups * BLOCK_ENTRY;
+    else coders[index]->buffer = coders[index - 1]->buffer + coders[index - 1]->stream_size;
 
-  for (index = 0; index < rows; index++) dwt[index] = dwt_data + index * cols;
+    if (size < 0 || size > end - coders[index]->buffer) size = end - coders[index]->buffer;
 
-  ResetDWT(dwt, rows, cols);
+    coders[index]->stream_size = size;
+    coders[index]->passes = 0;
+    coders[index]->options = options;
+  }
 
-  bit_stream->buffer = buffer + 1;
-  bit_stream->buffer_size = buffer_size - 1;
+  marks = 0;
 
-  InitReadBits(bit_stream);
+  if (options & SPIHT_MARKS) {
 
-  arith_coder->cum_freq = cum_freq;
+    ptr = coders[groups - 1]->buffer + coders[groups - 1]->stream_size;
 
-  InitModel(arith_coder);
-  result = InitDecoder(arith_coder, bit_stream);
+    marks = (ReadMarks(coders, groups, ptr, end) == TRUE);
+  }
 
-  if (result != OK) goto error;
+  marks = PlanBlocks(coders, groups, marks, out_size - hdr_size, alloc);
 
-  bits = buffer[0];
+  WriteStreamHeader(out, out_size, bits, (marks ? options : options & ~SPIHT_MARKS), shift);
 
-  if (bits > 0) threshold = 1 << (bits - 1);
-  else threshold = 0;
+  WriteBlocks(coders, groups, alloc, marks, out + hdr_size, &size);
 
-  result = SPIHTInit(rows, cols, levels, LIP, LIS);
+  *stream_size = hdr_size + size;
 
-  if (result != OK) goto error;
+  result = OK;
 
-  while (threshold > 0) {
+  error:
 
-    result = SPIHTDecodeSignificancePass(dwt, rows, cols, levels, threshold, LIP, LSP, LIS, bit_stream, arith_coder);
+  free(group_data);
+  free(coders);
+  free(alloc);
 
-    if (result != OK) goto error;
+  return result;
+}
 
-    result = SPIHTDecodeRefinementPass(dwt, threshold >> 1, LSP, bit_stream, arith_coder);
+int SPIHTStreamOptions(unsigned char *buffer,
+                       int buffer_size)
+{
+  int bits, options, shift;
 
-    if (result != OK) goto error;
+  if (ReadStreamHeader(buffer, buffer_size, &bits, &options, &shift) == 0) return 0;
 
-    threshold >>= 1;
-  }
+  return options;
+}
 
-  error:
+/*
+ * Shift of the region coefficients of a SPIHT_ROI stream, 0 for other
+ * streams or while the header is incomplete.
+ */
+int SPIHTRegionShift(unsigned char *buffer,
+                     int buffer_size)
+{
+  int bits, options, shift;
 
-  free(cum_freq);
-  free(dwt);
+  if (ReadStreamHeader(buffer, buffer_size, &bits, &options, &shift) == 0) return 0;
 
-  FreeArithCoder(arith_coder);
-  FreeBitStream(bit_stream);
+  return shift;
+}
 
-  FreeNodeList(LIP);
-  FreeNodeList(LSP);
-  FreeNodeList(LIS);
+int SPIHTPlaneType(unsigned char *buffer,
+                   int buffer_size)
+{
+  int bits, options, shift;
 
-  if (result == BUFFER_EMPTY) result = OK;
+  if (ReadStreamHeader(buffer, buffer_size, &bits, &options, &shift) == 0) return SPIHT_INT16;
 
-  return result;
+  return (bits > MaxPlaneBits(SPIHT_INT16) ? SPIHT_INT32 : SPIHT_INT16);
+}
+
+/*
+ * Offset of coefficient (row, col) in dwt_data laid out for a transform
+ * of the given depth, the callers fill and read the plane through it.
+ */
+size_t SPIHTPlaneOffset(int row,
+                        int col,
+                        int cols,
+                        int levels,
+                        int layout)
+{
+  return PlaneOffset(row, col, cols, TileBits(levels, layout));
 }
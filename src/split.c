@@ -22,8 +22,14 @@
  *
  */
 
+#include <memory.h>
+#include "../include/split.h"
+#include "../include/errcodes.h"
+
 #define MIN(x, y) (x < y ? x : y)
 
+static int NextPackage(ChannelSplitter *splitter);
+
 void MergeChannels(unsigned char *buf,
                    unsigned char *lum,
                    unsigned char *cb,
@@ -184,3 +190,131 @@ void SplitChannels(unsigned char *buf,
     if (buf >= pn) return;
   }
 }
+
+void InitSplitter(ChannelSplitter *splitter,
+                  int n_lum,
+                  int n_cb,
+                  int n_cr)
+{
+  int i;
+
+  splitter->size[0] = n_lum;
+  splitter->size[1] = n_cb;
+  splitter->size[2] = n_cr;
+
+  splitter->min = MIN(n_lum, MIN(n_cb, n_cr));
+  splitter->pkg = 0;
+
+  for (i = 0; i < 3; i++) {
+
+    splitter->count[i] = 0;
+    splitter->left[i] = 0;
+    splitter->rem[i] = 0;
+
+    if (splitter->min <= 0) continue;
+
+    splitter->div[i] = splitter->size[i] / splitter->min;
+    splitter->tr0[i] = splitter->div[i] * splitter->min;
+    splitter->tr1[i] = splitter->tr0[i] + splitter->min;
+  }
+}
+
+/*
+ * Moves to the next package once the current one is through, FALSE
+ * after the last one.
+ */
+static int NextPackage(ChannelSplitter *splitter)
+{
+  int i, cur;
+
+  for (i = 0; i < 3 && splitter->left[i] == 0; i++);
+
+  if (i < 3) return TRUE;
+
+  if (splitter->pkg >= splitter->min) return FALSE;
+
+  for (i = 0; i < 3; i++) {
+
+    cur = splitter->size[i] + splitter->rem[i];
+
+    if (cur >= splitter->tr1[i]) {
+      splitter->left[i] = splitter->div[i] + 1;
+      splitter->rem[i] = cur - splitter->tr1[i];
+    } else {
+      splitter->left[i] = splitter->div[i];
+      splitter->rem[i] = cur - splitter->tr0[i];
+    }
+  }
+
+  splitter->pkg++;
+
+  return TRUE;
+}
+
+void SplitBytes(ChannelSplitter *splitter,
+                unsigned char *buf,
+                int n_buf,
+                unsigned char *lum,
+                unsigned char *cb,
+                unsigned char *cr)
+{
+  unsigned char *dst[3];
+  int i, n;
+
+  dst[0] = lum;
+  dst[1] = cb;
+  dst[2] = cr;
+
+  while (n_buf > 0 && NextPackage(splitter) == TRUE) {
+
+    for (i = 0; splitter->left[i] == 0; i++);
+
+    n = MIN(n_buf, splitter->left[i]);
+
+    memcpy(dst[i] + splitter->count[i], buf, n);
+
+    splitter->count[i] += n;
+    splitter->left[i] -= n;
+
+    buf += n;
+    n_buf -= n;
+  }
+}
+
+/*
+ * Incremental form of MergeChannels(): fills buf with up to n_buf bytes
+ * of the merged stream, taken from the channels where the last call
+ * left off, and returns their number, 0 once the channels are through.
+ */
+int MergeBytes(ChannelSplitter *splitter,
+               unsigned char *buf,
+               int n_buf,
+               unsigned char *lum,
+               unsigned char *cb,
+               unsigned char *cr)
+{
+  unsigned char *src[3];
+  int i, n, total;
+
+  src[0] = lum;
+  src[1] = cb;
+  src[2] = cr;
+
+  total = 0;
+
+  while (total < n_buf && NextPackage(splitter) == TRUE) {
+
+    for (i = 0; splitter->left[i] == 0; i++);
+
+    n = MIN(n_buf - total, splitter->left[i]);
+
+    memcpy(buf + total, src[i] + splitter->count[i], n);
+
+    splitter->count[i] += n;
+    splitter->left[i] -= n;
+
+    total += n;
+  }
+
+  return total;
+}
@@ -0,0 +1,184 @@
+/*
+ * The TiLib: wavelet based lossy image compression library
+ * Copyright (C) 1998-2004 Alexander Simakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * QuikInfo:
+ *
+ * Single producer, single consumer pipe of coder symbols. The producer
+ * queues symbols into the free entries of the current chunk and calls
+ * PublishChunk() once it is full; a thread of the pipe hands the chunks
+ * to a ChunkFunc in order. Up to PIPE_CHUNKS chunks are in flight.
+ *
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "../include/symbolpipe.h"
+#include "../include/errcodes.h"
+
+static void *PipeThread(void *arg);
+
+SymbolPipe *AllocSymbolPipe(void)
+{
+  SymbolPipe *pipe;
+
+  pipe = (SymbolPipe *) malloc(sizeof(SymbolPipe));
+
+  if (pipe == NULL) return NULL;
+
+  pipe->chunks = (QueuedSymbol *) malloc(PIPE_CHUNKS * CHUNK_SYMBOLS * sizeof(QueuedSymbol));
+
+  if (pipe->chunks == NULL) {
+    free(pipe);
+    return NULL;
+  }
+
+  pthread_mutex_init(&pipe->lock, NULL);
+  pthread_cond_init(&pipe->cond, NULL);
+
+  return pipe;
+}
+
+void FreeSymbolPipe(SymbolPipe *pipe)
+{
+  if (pipe == NULL) return;
+
+  pthread_mutex_destroy(&pipe->lock);
+  pthread_cond_destroy(&pipe->cond);
+
+  free(pipe->chunks);
+  free(pipe);
+}
+
+/*
+ * Hands the chunks over to func until the pipe is drained or func
+ * fails.
+ */
+static void *PipeThread(void *arg)
+{
+  SymbolPipe *pipe;
+  QueuedSymbol *chunk;
+  int result;
+
+  pipe = (SymbolPipe *) arg;
+
+  result = OK;
+
+  pthread_mutex_lock(&pipe->lock);
+
+  while (result == OK) {
+
+    while (pipe->tail == pipe->head && pipe->done == 0) pthread_cond_wait(&pipe->cond, &pipe->lock);
+
+    if (pipe->tail == pipe->head) break;
+
+    pthread_mutex_unlock(&pipe->lock);
+
+    chunk = pipe->chunks + (size_t) (pipe->tail % PIPE_CHUNKS) * CHUNK_SYMBOLS;
+
+    result = pipe->func(pipe->arg, chunk, pipe->counts[pipe->tail % PIPE_CHUNKS]);
+
+    pthread_mutex_lock(&pipe->lock);
+
+    pipe->tail++;
+
+    if (result != OK) pipe->stop = 1;
+
+    pthread_cond_broadcast(&pipe->cond);
+  }
+
+  pthread_mutex_unlock(&pipe->lock);
+
+  pipe->result = result;
+
+  return NULL;
+}
+
+/*
+ * Starts the pipe thread on an empty pipe. INTERNAL_ERROR if the thread
+ * cannot be created, the producer then has to code in place.
+ */
+int StartPipe(SymbolPipe *pipe,
+              ChunkFunc func,
+              void *arg)
+{
+  pipe->func = func;
+  pipe->arg = arg;
+
+  pipe->head = pipe->tail = 0;
+  pipe->done = pipe->stop = 0;
+  pipe->result = OK;
+
+  pipe->next = pipe->chunks;
+  pipe->end = pipe->chunks + CHUNK_SYMBOLS;
+
+  if (pthread_create(&pipe->thread, NULL, PipeThread, pipe) != 0) return INTERNAL_ERROR;
+
+  return OK;
+}
+
+/*
+ * Hands the chunk being filled over to the pipe thread and waits for
+ * a free one. BUFFER_FULL once func has failed: the symbols still
+ * queued would not be coded anyway.
+ */
+int PublishChunk(SymbolPipe *pipe)
+{
+  QueuedSymbol *chunk;
+  int stop;
+
+  chunk = pipe->chunks + (size_t) (pipe->head % PIPE_CHUNKS) * CHUNK_SYMBOLS;
+
+  pthread_mutex_lock(&pipe->lock);
+
+  pipe->counts[pipe->head % PIPE_CHUNKS] = pipe->next - chunk;
+  pipe->head++;
+
+  pthread_cond_broadcast(&pipe->cond);
+
+  while (pipe->stop == 0 && pipe->head - pipe->tail == PIPE_CHUNKS) pthread_cond_wait(&pipe->cond, &pipe->lock);
+
+  stop = pipe->stop;
+
+  pthread_mutex_unlock(&pipe->lock);
+
+  pipe->next = pipe->chunks + (size_t) (pipe->head % PIPE_CHUNKS) * CHUNK_SYMBOLS;
+  pipe->end = pipe->next + CHUNK_SYMBOLS;
+
+  return (stop ? BUFFER_FULL : OK);
+}
+
+/*
+ * Sends the last symbols if flush is set, waits for the pipe thread
+ * and returns the result of func.
+ */
+int FinishPipe(SymbolPipe *pipe,
+               int flush)
+{
+  if (flush) PublishChunk(pipe);
+
+  pthread_mutex_lock(&pipe->lock);
+
+  pipe->done = 1;
+
+  pthread_cond_broadcast(&pipe->cond);
+  pthread_mutex_unlock(&pipe->lock);
+
+  pthread_join(pipe->thread, NULL);
+
+  return pipe->result;
+}
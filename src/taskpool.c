@@ -0,0 +1,121 @@
+/*
+ * The TiLib: wavelet based lossy image compression library
+ * Copyright (C) 1998-2004 Alexander Simakov
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ *
+ * QuikInfo:
+ *
+ * Minimal pool of worker threads for running independent tasks. Workers
+ * take tasks in order from a shared counter until all of them are done;
+ * the result of the first failed task is returned.
+ *
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "../include/taskpool.h"
+#include "../include/errcodes.h"
+
+#define MAX_THREADS (64)
+
+typedef struct
+{
+  pthread_mutex_t lock;
+
+  TaskFunc func;
+  void **tasks;
+
+  int count;
+  int next;
+  int result;
+
+} TaskPool;
+
+static void *Worker(void *arg);
+
+static void *Worker(void *arg)
+{
+  TaskPool *pool;
+  int index, result;
+
+  pool = (TaskPool *) arg;
+
+  for (;;) {
+
+    pthread_mutex_lock(&pool->lock);
+
+    index = (pool->result == OK ? pool->next++ : pool->count);
+
+    pthread_mutex_unlock(&pool->lock);
+
+    if (index >= pool->count) break;
+
+    result = pool->func(pool->tasks[index]);
+
+    if (result != OK) {
+
+      pthread_mutex_lock(&pool->lock);
+
+      if (pool->result == OK) pool->result = result;
+
+      pthread_mutex_unlock(&pool->lock);
+    }
+  }
+
+  return NULL;
+}
+
+int RunTasks(TaskFunc func,
+             void **tasks,
+             int count,
+             int threads)
+{
+  pthread_t workers[MAX_THREADS];
+  TaskPool pool;
+  int index, started, result;
+
+  if (threads > MAX_THREADS) threads = MAX_THREADS;
+  if (threads > count) threads = count;
+
+  /* not worth a thread */
+  if (threads <= 1) {
+
+    for (index = 0; index < count; index++)
+    if ((result = func(tasks[index])) != OK) return result;
+
+    return OK;
+  }
+
+  if (pthread_mutex_init(&pool.lock, NULL) != 0) return INTERNAL_ERROR;
+
+  pool.func = func;
+  pool.tasks = tasks;
+  pool.count = count;
+  pool.next = 0;
+  pool.result = OK;
+
+  /* the calling thread works too */
+  for (started = 0; started < threads - 1; started++)
+  if (pthread_create(&workers[started], NULL, Worker, &pool) != 0) break;
+
+  Worker(&pool);
+
+  for (index = 0; index < started; index++) pthread_join(workers[index], NULL);
+
+  pthread_mutex_destroy(&pool.lock);
+
+  return pool.result;
+}
@@ -26,11 +26,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <math.h>
 #include "../include/pbm.h"
 #include "../include/tilib.h"
 #include "../include/errcodes.h"
 
 #define MAX_LINE 1024
+#define MAX_SIZES 16
+#define MAX_ROI 16
 
 #define OPT_ENCODE      0
 #define OPT_DECODE      1
@@ -41,16 +44,45 @@
 #define OPT_DAUBECHIES  6
 #define OPT_LEVELS      7
 #define OPT_HELP        8
+#define OPT_LISTFREE    9
+#define OPT_BLOCKS      10
+#define OPT_THREADS     11
+#define OPT_CONTEXTS    12
+#define OPT_BYPASS      13
+#define OPT_CHUNK       14
+#define OPT_TRUNCATE    15
+#define OPT_MARKS       16
+#define OPT_QUALITY     17
+#define OPT_PROGRESSIVE 18
+#define OPT_SCALE       19
+#define OPT_WINDOW      20
+#define OPT_ROI         21
+#define OPT_MORTON      22
+#define OPT_RANGE       23
+#define OPT_STATES      24
+#define OPT_LANES       25
 
 int encode;
+int transcode;          /* Cut an encoded image down instead */
 char infile[MAX_LINE];  /* Input file name */
 char outfile[MAX_LINE]; /* Output file name */
 int levels;             /* Number of transform levels */
 int lum;                /* Bit budget for Y channel */
 int cb;                 /* Bit budget for Cb channel */
 int cr;                 /* Bit budget for Cr channel */
-int size;               /* Desired encoded image size */
+int sizes[MAX_SIZES];   /* Desired encoded image sizes */
+int n_sizes;            /* Number of desired sizes */
 int filter;             /* Use Butterworth or Daubechies filter */
+int options;            /* TiCompressEx() options */
+int blocks;             /* Number of tree groups */
+int threads;            /* Number of coding threads */
+int chunk;              /* Feed the decoder this many bytes at a time */
+double quality;         /* Target PSNR in dB, 0 for none */
+int reduce;             /* Decode at 1/2^reduce of the size */
+int window[4];          /* Decode only this rectangle: left, top, width, height */
+int roi[MAX_ROI * 4];   /* Regions of interest: left, top, width, height each */
+int n_roi;              /* Number of regions of interest */
+int layout;             /* Coefficient layout of the codec */
 
 void usage()
 {
@@ -60,31 +92,57 @@ void usage()
 "Usage: ticodec [options]\n"
 "-e, --encode: Encode image\n"
 "-d, --decode: Decode image\n"
+"-x, --truncate: Cut encoded image down to a smaller size without decoding\n"
 "-i, --input <filename>: Input file name\n"
 "-o, --output <filename>: Output file name\n"
-"-s, --size <num>: Desired encoded file size in bytes\n"
+"-s, --size <num>[,<num>...]: Desired encoded file size(s) in bytes\n"
+"-q, --quality <dB>: Stop at this PSNR, -s gives the largest size\n"
 "-B, --butterworth: Use Butterworth wavelet transform\n"
 "-D, --daubechies: Use Daubechies 9/7 wavelet transform (default)\n"
 "-l, --levels <num>: Number of DWT transform levels (default = 5)\n"
 "-y <num>: Bit budget (in %%) for Y channel (default = 90)\n"
 "-b <num>: Bit budget (in %%) for Cb channel (default = 5)\n"
 "-r <num>: Bit budget (in %%) for Cr channel (default = 5)\n"
+"-L, --listfree: Use fixed-memory list-free SPIHT engine\n"
+"-C, --contexts: Use context modeling for SPIHT decisions\n"
+"-R, --bypass: Code sign and refinement bits without modeling (faster)\n"
+"-a, --range: Use the byte oriented range coder (faster)\n"
+"-S, --states: Use the range coder with probability states (fastest)\n"
+"-n, --lanes: Interleave four range coders per tree group (faster to decode)\n"
+"-k, --blocks <num>: Code the image as <num> independent tree groups\n"
+"-P, --progressive: Order the stream by resolution, coarse scales first\n"
+"-M, --marks: Keep pass boundaries of the tree groups (or scales) for -x\n"
+"-I, --roi <x>,<y>,<w>,<h>[,...]: Code these rectangles first\n"
+"-Z, --morton: Keep coefficients in Z order while coding (faster without -L)\n"
+"-t, --threads <num>: Number of coding threads (default = 1)\n"
+"-p, --chunk <num>: Decode incrementally, <num> bytes at a time\n"
+"-z, --scale <num>: Decode at 1/2^<num> of the size, fastest with -P streams\n"
+"-w, --window <x>,<y>,<w>,<h>: Decode only this rectangle of the image\n"
 "-h, --help: Show this help message\n"
 "Note: Y%% + Cb%% + Cr%% must equals to 100%%\n"
 "Examples:\n"
 "ticodec -e -i foobar.ppm -o foobar.Ti -s 7777\n"
 "ticodec -d -i somefile.Ti -o somefile.pgm\n"
-"ticodec -e -i test.ppm -o test.Ti -s 10000 -B -l 9 -y 70 -b 20 -r 10\n");
+"ticodec -e -i test.ppm -o test.Ti -s 10000 -B -l 9 -y 70 -b 20 -r 10\n"
+"ticodec -e -i huge.pgm -o huge.Ti -s 500000 -k 16 -t 4\n"
+"ticodec -e -i test.pgm -o test.Ti -s 2000,8000,32000 (writes test.Ti.2000, ...)\n"
+"ticodec -x -i big.Ti -o small.Ti -s 5000\n"
+"ticodec -e -i test.pgm -o test.Ti -s 100000 -q 38.5\n"
+"ticodec -e -i test.pgm -o test.Ti -s 50000 -P -M\n"
+"ticodec -d -i test.Ti -o thumb.pgm -z 2\n"
+"ticodec -d -i huge.Ti -o tile.pgm -w 4096,2048,512,512\n"
+"ticodec -e -i scan.pgm -o scan.Ti -s 20000 -I 40,30,200,60\n");
   exit(1);
 }
 
 void validate_args(int argc, char **argv)
 {
-  int ed_flg, i_flg, o_flg, l_flg, s_flg, y_flg, b_flg, r_flg, BD_flg;
+  int ed_flg, i_flg, o_flg, l_flg, s_flg, y_flg, b_flg, r_flg, BD_flg, L_flg, C_flg, R_flg, k_flg, t_flg, p_flg, M_flg, q_flg, P_flg, z_flg, w_flg, I_flg, Z_flg, a_flg, S_flg, n_flg;
   struct option opts[] =
   {
     {"encode",      no_argument,       0, OPT_ENCODE},
     {"decode",      no_argument,       0, OPT_DECODE},
+    {"truncate",    no_argument,       0, OPT_TRUNCATE},
 	{"input",       required_argument, 0, OPT_INPUT},
 	{"output",      required_argument, 0, OPT_OUTPUT},
 	{"size",        required_argument, 0, OPT_SIZE},
@@ -92,15 +150,41 @@ void validate_args(int argc, char **argv)
 	{"daubechies",  no_argument,       0, OPT_DAUBECHIES},
 	{"levels",      required_argument, 0, OPT_LEVELS},
 	{"help",        no_argument,       0, OPT_HELP},
+	{"listfree",    no_argument,       0, OPT_LISTFREE},
+	{"contexts",    no_argument,       0, OPT_CONTEXTS},
+	{"bypass",      no_argument,       0, OPT_BYPASS},
+	{"blocks",      required_argument, 0, OPT_BLOCKS},
+	{"threads",     required_argument, 0, OPT_THREADS},
+	{"chunk",       required_argument, 0, OPT_CHUNK},
+	{"marks",       no_argument,       0, OPT_MARKS},
+	{"quality",     required_argument, 0, OPT_QUALITY},
+	{"progressive", no_argument,       0, OPT_PROGRESSIVE},
+	{"scale",       required_argument, 0, OPT_SCALE},
+	{"window",      required_argument, 0, OPT_WINDOW},
+	{"roi",         required_argument, 0, OPT_ROI},
+	{"morton",      no_argument,       0, OPT_MORTON},
+	{"range",       no_argument,       0, OPT_RANGE},
+	{"states",      no_argument,       0, OPT_STATES},
+	{"lanes",       no_argument,       0, OPT_LANES},
     {0,             0,                 0, 0}
   };
-  int opt;
-
-  ed_flg = i_flg = o_flg = l_flg = s_flg = y_flg = b_flg = r_flg = BD_flg = 0;
+  int opt, i;
+  char *arg;
+
+  ed_flg = i_flg = o_flg = l_flg = s_flg = y_flg = b_flg = r_flg = BD_flg = L_flg = C_flg = R_flg = k_flg = t_flg = p_flg = M_flg = q_flg = P_flg = z_flg = w_flg = I_flg = Z_flg = a_flg = S_flg = n_flg = 0;
+  transcode = 0;
+  options = 0;
+  blocks = 0;
+  threads = 1;
+  chunk = 0;
+  quality = 0;
+  reduce = 0;
+  n_roi = 0;
+  layout = TI_RASTER;
 
   opterr = 0;
 
-  while ((opt = getopt_long(argc, argv, "edi:o:s:BDl:y:b:r:", opts, NULL)) != -1)
+  while ((opt = getopt_long(argc, argv, "edxi:o:s:q:BDl:y:b:r:LCRaSnMPk:t:p:z:w:I:Z", opts, NULL)) != -1)
   {
     switch (opt)
 	{
@@ -119,6 +203,14 @@ void validate_args(int argc, char **argv)
 		ed_flg = 1; encode = 0;
 		break;
 	  }
+
+	  case 'x':
+	  case OPT_TRUNCATE:
+	  {
+		if (ed_flg) usage();
+		ed_flg = 1; encode = 0; transcode = 1;
+		break;
+	  }
 	  
 	  case 'i':
 	  case OPT_INPUT:
@@ -143,7 +235,11 @@ void validate_args(int argc, char **argv)
 	  {
 		if (s_flg) usage();
 		s_flg = 1;
-		size = atoi(optarg);
+		n_sizes = 0;
+		for (arg = strtok(optarg, ","); arg != NULL; arg = strtok(NULL, ",")) {
+		  if (n_sizes == MAX_SIZES) usage();
+		  sizes[n_sizes++] = atoi(arg);
+		}
 		break;
 	  }
 
@@ -198,6 +294,163 @@ void validate_args(int argc, char **argv)
 		break;
 	  }
 	  
+	  case 'L':
+	  case OPT_LISTFREE:
+	  {
+		if (L_flg) usage();
+		L_flg = 1;
+		options |= TI_LISTFREE;
+		break;
+	  }
+
+	  case 'C':
+	  case OPT_CONTEXTS:
+	  {
+		if (C_flg) usage();
+		C_flg = 1;
+		options |= TI_CONTEXTS;
+		break;
+	  }
+
+	  case 'R':
+	  case OPT_BYPASS:
+	  {
+		if (R_flg) usage();
+		R_flg = 1;
+		options |= TI_BYPASS;
+		break;
+	  }
+
+	  case 'a':
+	  case OPT_RANGE:
+	  {
+		if (a_flg) usage();
+		a_flg = 1;
+		options |= TI_RANGE;
+		break;
+	  }
+
+	  case 'S':
+	  case OPT_STATES:
+	  {
+		if (S_flg) usage();
+		S_flg = 1;
+		options |= TI_STATES;
+		break;
+	  }
+
+	  case 'n':
+	  case OPT_LANES:
+	  {
+		if (n_flg) usage();
+		n_flg = 1;
+		options |= TI_LANES;
+		break;
+	  }
+
+	  case 'q':
+	  case OPT_QUALITY:
+	  {
+		if (q_flg) usage();
+		q_flg = 1;
+		quality = atof(optarg);
+		break;
+	  }
+
+	  case 'M':
+	  case OPT_MARKS:
+	  {
+		if (M_flg) usage();
+		M_flg = 1;
+		options |= TI_MARKS;
+		break;
+	  }
+
+	  case 'P':
+	  case OPT_PROGRESSIVE:
+	  {
+		if (P_flg) usage();
+		P_flg = 1;
+		options |= TI_LEVELS;
+		break;
+	  }
+
+	  case 'k':
+	  case OPT_BLOCKS:
+	  {
+		if (k_flg) usage();
+		k_flg = 1;
+		blocks = atoi(optarg);
+		options |= TI_BLOCKS;
+		break;
+	  }
+
+	  case 't':
+	  case OPT_THREADS:
+	  {
+		if (t_flg) usage();
+		t_flg = 1;
+		threads = atoi(optarg);
+		break;
+	  }
+
+	  case 'p':
+	  case OPT_CHUNK:
+	  {
+		if (p_flg) usage();
+		p_flg = 1;
+		chunk = atoi(optarg);
+		break;
+	  }
+
+	  case 'z':
+	  case OPT_SCALE:
+	  {
+		if (z_flg) usage();
+		z_flg = 1;
+		reduce = atoi(optarg);
+		break;
+	  }
+
+	  case 'w':
+	  case OPT_WINDOW:
+	  {
+		if (w_flg) usage();
+		w_flg = 1;
+		i = 0;
+		for (arg = strtok(optarg, ","); arg != NULL; arg = strtok(NULL, ",")) {
+		  if (i == 4) usage();
+		  window[i++] = atoi(arg);
+		}
+		if (i != 4) usage();
+		break;
+	  }
+
+	  case 'I':
+	  case OPT_ROI:
+	  {
+		if (I_flg) usage();
+		I_flg = 1;
+		i = 0;
+		for (arg = strtok(optarg, ","); arg != NULL; arg = strtok(NULL, ",")) {
+		  if (i == MAX_ROI * 4) usage();
+		  roi[i++] = atoi(arg);
+		}
+		if (i == 0 || i % 4 != 0) usage();
+		n_roi = i / 4;
+		options |= TI_ROI;
+		break;
+	  }
+
+	  case 'Z':
+	  case OPT_MORTON:
+	  {
+		if (Z_flg) usage();
+		Z_flg = 1;
+		layout = TI_MORTON;
+		break;
+	  }
+
 	  case ':':
 	  case '?':
 	  case 'h':
@@ -215,37 +468,97 @@ void validate_args(int argc, char **argv)
   /* check options */
 
   if (ed_flg == 0 || i_flg == 0 || o_flg == 0) usage();
+  if (t_flg && threads < 1) usage();
+  if (p_flg && (encode == 1 || chunk < 1)) usage();
+  if (z_flg && (encode == 1 || p_flg || reduce < 0)) usage();
+  if (w_flg && (encode == 1 || p_flg || z_flg || window[2] <= 0 || window[3] <= 0)) usage();
 
-  if (encode == 1) {
+  if (encode == 1 || transcode == 1) {
     if (s_flg == 0) usage();
-    if (size < 26) usage(); /* HDRSIZE + 2 + 2 + 2 */
+    if (n_sizes == 0) usage();
+    for (i = 0; i < n_sizes; i++)
+      if (sizes[i] < 26) usage(); /* HDRSIZE + 2 + 2 + 2 */
     if ((y_flg + b_flg + r_flg) != 0 && (y_flg + b_flg + r_flg) != 3) usage();
     if (l_flg == 0) levels = 0;
     if (BD_flg == 0) filter = DAUB97;
     if (y_flg + b_flg + r_flg == 0) lum = cb = cr = 0;
     if ((y_flg + b_flg + r_flg == 3) && (lum <= 0 || cb <= 0 || cr <= 0)) usage();
     if ((y_flg + b_flg + r_flg == 3) && (lum + cb + cr != 100)) usage();
-  } else {
-    if (l_flg + s_flg + y_flg + b_flg + r_flg + BD_flg != 0) usage();
+    if (k_flg && blocks < 1) usage();
+    if (M_flg && k_flg + P_flg == 0) usage();
+    if (P_flg && L_flg + C_flg + k_flg != 0) usage();
+    if (q_flg && (quality <= 0 || n_sizes != 1)) usage();
+    if (q_flg && I_flg) usage();
+  }
+
+  if (transcode == 1) {
+    if (q_flg + p_flg + l_flg + BD_flg + L_flg + C_flg + R_flg + k_flg + M_flg + P_flg + z_flg + w_flg + I_flg + Z_flg + a_flg + S_flg + n_flg != 0) usage();
+  } else if (encode == 0) {
+    if (l_flg + s_flg + y_flg + b_flg + r_flg + BD_flg + L_flg + C_flg + R_flg + k_flg + M_flg + q_flg + P_flg + I_flg + a_flg + S_flg + n_flg != 0) usage();
+  }
+}
+
+void WriteStreams(unsigned char **out_buf, int *actual_sizes)
+{
+  FILE *out_file;
+  char name[MAX_LINE + 16];
+  int i;
+
+  /* store encoded streams to files, <outfile>.<size> for several sizes */
+
+  for (i = 0; i < n_sizes; i++) {
+    if (n_sizes == 1)
+      snprintf(name, sizeof(name), "%s", outfile);
+    else
+      snprintf(name, sizeof(name), "%s.%d", outfile, sizes[i]);
+
+    out_file = fopen(name, "wb");
+
+    if (out_file == NULL) {
+      perror("fopen() failed");
+      exit(1);
+    }
+
+    fwrite(out_buf[i], 1, actual_sizes[i], out_file);
+    fclose(out_file);
   }
 }
 
+/* TiSink and TiSource on stdio files */
+
+int WriteChunk(void *context, unsigned char *data, int size)
+{
+  return (fwrite(data, 1, size, (FILE *) context) == (size_t) size ? 0 : 1);
+}
+
+int ReadChunk(void *context, unsigned char *data, int size)
+{
+  size_t count;
+
+  /* hand the decoder chunk bytes at a time */
+  count = fread(data, 1, (size < chunk ? size : chunk), (FILE *) context);
+
+  return (ferror((FILE *) context) ? -1 : (int) count);
+}
+
 void CompressFile()
 {
   FILE *in_file, *out_file;
-  unsigned char *in_buf, *out_buf;
-  int width, height, actual_size;
-  int result;
+  unsigned char *in_buf, *out_buf[MAX_SIZES], *mask;
+  int width, height, actual_sizes[MAX_SIZES];
+  int result, i, x, y;
+  double mse;
+  TiParams params;
   pbm_hdr h;
 
-  in_buf = out_buf = NULL;
+  in_buf = NULL;
+  mask = NULL;
 
-  /* open files */
+  /* open input file */
 
   in_file = fopen(infile, "rb");
-  out_file = fopen(outfile, "wb");
 
-  if (in_file == NULL || out_file == NULL) {
+  if (in_file == NULL) {
     perror("fopen() failed");
     exit(1);
   }
@@ -259,22 +572,81 @@ void CompressFile()
 
   /* allocate memory */
 
-  in_buf = (unsigned char *) malloc(width * height * (h.type == PGM ? 1 : 3));
-  out_buf = (unsigned char *) malloc(size);
+  in_buf = (unsigned char *) malloc((size_t) width * height * (h.type == PGM ? 1 : 3));
 
-  if (in_buf == NULL || out_buf == NULL) {
+  if (in_buf == NULL) {
     perror("malloc() failed");
     exit(1);
   }
 
+  /* a single stream goes straight to the output file */
+
+  for (i = 0; i < n_sizes && (n_sizes > 1 || quality > 0); i++) {
+    out_buf[i] = (unsigned char *) malloc(sizes[i]);
+
+    if (out_buf[i] == NULL) {
+      perror("malloc() failed");
+      exit(1);
+    }
+  }
+
   /* read whole image into the buffer */
 
-  fread(in_buf, 1, width * height * (h.type == PGM ? 1 : 3), in_file);
+  fread(in_buf, 1, (size_t) width * height * (h.type == PGM ? 1 : 3), in_file);
+
+  /* compress it at every desired size (with only one function call!) */
 
-  /* compress it (with only one function call!) */
+  /* mark the regions of interest, clipped to the image */
 
-  result = TiCompress(in_buf, out_buf, width, height, filter, (h.type == PGM ? GRAYSCALE : TRUECOLOR),
-  size, &actual_size, lum, cb, cr, levels);
+  if (n_roi > 0) {
+
+    mask = (unsigned char *) calloc((size_t) width * height, 1);
+
+    if (mask == NULL) {
+      perror("calloc() failed");
+      exit(1);
+    }
+
+    for (i = 0; i < n_roi; i++)
+    for (y = (roi[4 * i + 1] > 0 ? roi[4 * i + 1] : 0); y < roi[4 * i + 1] + roi[4 * i + 3] && y < height; y++)
+    for (x = (roi[4 * i + 0] > 0 ? roi[4 * i + 0] : 0); x < roi[4 * i + 0] + roi[4 * i + 2] && x < width; x++)
+    mask[(size_t) y * width + x] = 1;
+  }
+
+  params.options = options;
+  params.blocks = blocks;
+  params.threads = threads;
+  params.roi = mask;
+  params.layout = layout;
+
+  if (quality > 0) {
+
+    /* stop as soon as the PSNR is reached */
+
+    result = TiCompressQuality(in_buf, out_buf[0], width, height, filter, (h.type == PGM ? GRAYSCALE : TRUECOLOR),
+    255.0 * 255.0 / pow(10.0, quality / 10.0), sizes[0], &actual_sizes[0], &mse, lum, cb, cr, levels, &params);
+
+    if (result == OK) printf("PSNR: %.2f dB, size: %d bytes\n", (mse > 0 ? 10.0 * log10(255.0 * 255.0 / mse) : 99.99), actual_sizes[0]);
+
+  } else if (n_sizes == 1) {
+
+    out_file = fopen(outfile, "wb");
+
+    if (out_file == NULL) {
+      perror("fopen() failed");
+      exit(1);
+    }
+
+    result = TiCompressSink(in_buf, WriteChunk, out_file, width, height, filter, (h.type == PGM ? GRAYSCALE : TRUECOLOR),
+    sizes[0], &actual_sizes[0], lum, cb, cr, levels, &params);
+
+    fclose(out_file);
+
+  } else {
+
+    result = TiCompressMulti(in_buf, out_buf, width, height, filter, (h.type == PGM ? GRAYSCALE : TRUECOLOR),
+    sizes, actual_sizes, n_sizes, lum, cb, cr, levels, &params);
+  }
 
   /* if something wrong ... */
 
@@ -283,9 +655,62 @@ void CompressFile()
     exit(1);
   }
 
-  /* store encoded stream to file */
+  if (n_sizes > 1 || quality > 0) WriteStreams(out_buf, actual_sizes);
+}
+
+void TruncateFile()
+{
+  FILE *in_file;
+  unsigned char *in_buf, *out_buf[MAX_SIZES];
+  int stream_size, actual_sizes[MAX_SIZES];
+  int result, i;
+
+  /* open input file */
+
+  in_file = fopen(infile, "rb");
+
+  if (in_file == NULL) {
+    perror("fopen() failed");
+    exit(1);
+  }
+
+  stream_size = file_size(in_file);
+
+  /* allocate memory */
+
+  in_buf = (unsigned char *) malloc(stream_size);
+
+  if (in_buf == NULL) {
+    perror("malloc() failed");
+    exit(1);
+  }
+
+  for (i = 0; i < n_sizes; i++) {
+    out_buf[i] = (unsigned char *) malloc(sizes[i]);
+
+    if (out_buf[i] == NULL) {
+      perror("malloc() failed");
+      exit(1);
+    }
+  }
 
-  fwrite(out_buf, 1, actual_size, out_file);
+  /* read whole stream into the buffer */
+
+  fread(in_buf, 1, stream_size, in_file);
+
+  /* cut it down to every desired size */
+
+  for (i = 0; i < n_sizes; i++) {
+
+    result = TiTruncate(in_buf, stream_size, out_buf[i], sizes[i], &actual_sizes[i], lum, cb, cr);
+
+    if (result != OK) {
+      printf("TiTruncate() failed: %d\n", result);
+      exit(1);
+    }
+  }
+
+  WriteStreams(out_buf, actual_sizes);
 }
 
 void DecompressFile()
@@ -293,6 +718,7 @@ void DecompressFile()
   FILE *in_file, *out_file;
   unsigned char *in_buf, *out_buf;
   int width, height, type, result, stream_size;
+  TiParams params;
 
   in_buf = out_buf = NULL;
 
@@ -334,11 +760,30 @@ void DecompressFile()
 
   /* allocate memory for a decoded image */
 
-  out_buf = (unsigned char *) malloc(width * height * (type == GRAYSCALE ? 1 : 3));
+  out_buf = (unsigned char *) malloc((size_t) width * height * (type == GRAYSCALE ? 1 : 3));
 
   /* decode it! */
 
-  result = TiDecompress(in_buf, out_buf, width, height, type, stream_size);
+  params.options = 0;
+  params.blocks = 0;
+  params.threads = threads;
+  params.roi = NULL;
+  params.layout = layout;
+
+  if (window[2] > 0) {
+
+    result = TiDecompressRegion(in_buf, out_buf, width, height, type, stream_size, window[0], window[1], window[2], window[3], &params);
+
+    width = window[2];
+    height = window[3];
+
+  } else {
+
+    result = TiDecompressScaled(in_buf, out_buf, width, height, type, stream_size, reduce, &params);
+
+    width >>= reduce;
+    height >>= reduce;
+  }
 
   /* if something wrong ... */
 
@@ -353,7 +798,74 @@ void DecompressFile()
 
   /* store decoded image (PGM or PPM) to file */
 
-  fwrite(out_buf, 1, width * height * (type == GRAYSCALE ? 1 : 3), out_file);
+  fwrite(out_buf, 1, (size_t) width * height * (type == GRAYSCALE ? 1 : 3), out_file);
+}
+
+void DecompressFileIncremental()
+{
+  FILE *in_file, *out_file;
+  unsigned char *out_buf;
+  int width, height, type, result;
+  TiDecoder *decoder;
+
+  out_buf = NULL;
+
+  /* open files */
+
+  in_file = fopen(infile, "rb");
+  out_file = fopen(outfile, "wb");
+
+  if (in_file == NULL || out_file == NULL) {
+    perror("fopen() failed");
+    exit(1);
+  }
+
+  decoder = TiDecoderCreate();
+
+  if (decoder == NULL) {
+    perror("malloc() failed");
+    exit(1);
+  }
+
+  /* feed the decoder as the data comes, it decodes in the background */
+
+  result = TiDecoderRead(decoder, ReadChunk, in_file);
+
+  if (result != OK) {
+    printf("TiDecoderRead() failed: %d\n", result);
+    exit(1);
+  }
+
+  result = TiDecoderInfo(decoder, &width, &height, &type);
+
+  if (result != OK) {
+    printf("TiDecoderInfo() failed: %d\n", result);
+    exit(1);
+  }
+
+  out_buf = (unsigned char *) malloc((size_t) width * height * (type == GRAYSCALE ? 1 : 3));
+
+  if (out_buf == NULL) {
+    perror("malloc() failed");
+    exit(1);
+  }
+
+  result = TiDecoderRender(decoder, out_buf);
+
+  if (result != OK) {
+    printf("TiDecoderRender() failed: %d\n", result);
+    exit(1);
+  }
+
+  TiDecoderFree(decoder);
+
+  /* write PGM of PPM header */
+
+  fprintf(out_file, "P%s\n%d %d\n255\n", type == GRAYSCALE ? "5" : "6", width, height);
+
+  /* store decoded image (PGM or PPM) to file */
+
+  fwrite(out_buf, 1, (size_t) width * height * (type == GRAYSCALE ? 1 : 3), out_file);
 }
 
 int main(int argc, char *argv[])
@@ -361,6 +873,8 @@ int main(int argc, char *argv[])
   validate_args(argc, argv);
 
   if (encode) CompressFile();
+  else if (transcode) TruncateFile();
+  else if (chunk > 0) DecompressFileIncremental();
   else DecompressFile();
 
   return 0;
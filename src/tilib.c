@@ -24,6 +24,7 @@
 
 #include <stdlib.h>
 #include <memory.h>
+#include <pthread.h>
 
 #include "../include/tilib.h"
 #include "../include/color.h"
@@ -34,7 +35,8 @@
 #include "../include/split.h"
 #include "../include/errcodes.h"
 
-#define HDRSIZE    (22)
+#define HDRSIZE    (22) /* version 1, 16-bit dimensions */
+#define HDRSIZE_V2 (28) /* version 2, 32-bit dimensions */
 #define DEF_SCALES (5)
 
 #define DEF_LUM (90)
@@ -66,8 +68,225 @@
                                                        (buf_[offs_ + 2] << 8)  |\
                                                        (buf_[offs_ + 3] << 0)))
 
+#define MAX_HDRSIZE (HDRSIZE_V2)
+
+/* in place of the high byte of a version 1 width, which is below 0x40 */
+#define V2_MARK (0xff)
+
+#define MAX_V1_SIZE  (16383)
+#define MAX_IMG_SIZE (0x3fffffff)
+
+#define MAX_CHANNELS (3)
+
+/* largest piece of stream handed to a TiSink or asked of a TiSource */
+#define SINK_CHUNK (65536)
+
+/* analysis filter reach of a low and a high band sample, 9/7 taps */
+#define LOW_REACH  (4)
+#define HIGH_REACH (3)
+
+/* RGB squared error per unit of Y, Cb and Cr squared error, mean over R, G and B */
+#define WEIGHT_LUM (1.0)
+#define WEIGHT_CB  (1.086)
+#define WEIGHT_CR  (0.825)
+
+typedef struct
+{
+  int size; /* HDRSIZE or HDRSIZE_V2 */
+
+  int img_width;
+  int img_height;
+  int scales;
+  int img_type;
+  int wavelet;
+
+  int sizes[MAX_CHANNELS]; /* channel sub-stream lengths */
+
+} StreamHeader;
+
+typedef struct
+{
+  TiDecoder *decoder;
+
+  unsigned char *buffer;
+  int size;  /* sub-stream length from the header */
+  int count; /* bytes received so far */
+
+  int *coeff_data;
+
+  unsigned char *need; /* what the decoding thread waits for, or NULL */
+  int started;
+  int done;
+  int result;
+
+  pthread_t thread;
+
+} DecoderChannel;
+
+/*
+ * Every channel is decoded by its own thread running SPIHTDecodeDWT().
+ * When the thread runs out of data it blocks in WaitChannel() with all
+ * of its lists and coder state intact until TiDecoderFeed() brings more.
+ * A blocked thread has decoded everything received, so its coefficients
+ * can be rendered at any time as if the stream ended there.
+ */
+struct TiDecoderTag
+{
+  pthread_mutex_t lock;
+  pthread_cond_t data_cond; /* data arrived or the decoder is closing */
+  pthread_cond_t idle_cond; /* a channel thread blocked or finished */
+
+  unsigned char header[MAX_HDRSIZE];
+
+  int received;    /* bytes of the whole stream received so far */
+  int stream_size; /* whole stream length, 0 while the header is incomplete */
+  int result;
+
+  int img_width;
+  int img_height;
+  int img_type;
+  int scales;
+  int wavelet;
+
+  int align_width;
+  int align_height;
+
+  int closed;
+
+  ChannelSplitter splitter;
+
+  DecoderChannel channel[MAX_CHANNELS];
+  int channels;
+
+  double *dwt_data;
+  unsigned char *image_buf;
+};
+
 static unsigned char check_sum(unsigned char *buf, int len);
 
+static int ShareOf(int size,
+                   int ratio);
+
+static int HeaderSize(int img_width,
+                      int img_height);
+
+static int ReadHeader(unsigned char *stream,
+                      int stream_size,
+                      StreamHeader *header);
+
+static int MinChannelSize(int options);
+
+static void FootprintLine(unsigned char *in,
+                          unsigned char *out,
+                          int length);
+
+static int RegionFootprint(unsigned char *roi,
+                           unsigned char *mask,
+                           double *plane,
+                           int img_width,
+                           int img_height,
+                           int align_rows,
+                           int align_cols,
+                           int scales);
+
+static int ShiftRegion(double *dwt_data,
+                       unsigned char *mask,
+                       size_t n_samples,
+                       int *shift);
+
+static int CompressImage(unsigned char *image,
+                         unsigned char **streams,
+                         int img_width,
+                         int img_height,
+                         int wavelet,
+                         int img_type,
+                         int *desired_sizes,
+                         int *actual_sizes,
+                         int count,
+                         int lum_ratio,
+                         int cb_ratio,
+                         int cr_ratio,
+                         int scales,
+                         TiParams *params,
+                         double target_mse,
+                         double *mse,
+                         TiSink sink,
+                         void *sink_context);
+
+static int SinkStream(TiSink sink,
+                      void *sink_context,
+                      unsigned char **buffers,
+                      int *sizes,
+                      int img_width,
+                      int img_height,
+                      int scales,
+                      int img_type,
+                      int wavelet);
+
+static void WriteHeader(unsigned char *stream,
+                        int img_width,
+                        int img_height,
+                        int scales,
+                        int img_type,
+                        int wavelet,
+                        int lum_size,
+                        int cb_size,
+                        int cr_size);
+
+static int EncodeChannel(double *dwt_data,
+                         int rows,
+                         int cols,
+                         int scales,
+                         unsigned char **buffers,
+                         int *buffer_sizes,
+                         int *stream_sizes,
+                         int count,
+                         SPIHTParams *params);
+
+static int DecodeChannel(double *dwt_data,
+                         int rows,
+                         int cols,
+                         int scales,
+                         unsigned char *buffer,
+                         int buffer_size,
+                         SPIHTParams *params);
+
+static int SynthesizeChannel(double *dwt_data,
+                             unsigned char *image,
+                             int align_rows,
+                             int align_cols,
+                             int rows,
+                             int cols,
+                             int scales,
+                             int wavelet,
+                             int reduce,
+                             int left,
+                             int top,
+                             int width,
+                             int height);
+
+static int DecompressImage(unsigned char *stream,
+                           unsigned char *image,
+                           int img_width,
+                           int img_height,
+                           int img_type,
+                           int stream_size,
+                           int reduce,
+                           int left,
+                           int top,
+                           int width,
+                           int height,
+                           TiParams *params);
+
+static unsigned char *WaitChannel(void *context,
+                                  unsigned char *need);
+
+static void *DecodeChannelThread(void *arg);
+
+static int StartDecoder(TiDecoder *decoder);
+
+static int IsChannelIdle(DecoderChannel *channel);
+
 static unsigned char check_sum(unsigned char *buf, int len)
 {
   unsigned char s1 = 1;
@@ -83,6 +302,449 @@ static unsigned char check_sum(unsigned char *buf, int len)
   return (unsigned char) ((s2 << 4) + s1);
 }
 
+/*
+ * ratio percent of size, rounded down. Stream sizes run up to 2^31,
+ * too large for the product in an int.
+ */
+static int ShareOf(int size,
+                   int ratio)
+{
+  return (int) ((double) size * ratio / 100);
+}
+
+/*
+ * Images up to MAX_V1_SIZE pixels a side keep the version 1 header, so
+ * their streams are readable by older decoders.
+ */
+static int HeaderSize(int img_width,
+                      int img_height)
+{
+  return (img_width > MAX_V1_SIZE || img_height > MAX_V1_SIZE ? HDRSIZE_V2 : HDRSIZE);
+}
+
+static int ReadHeader(unsigned char *stream,
+                      int stream_size,
+                      StreamHeader *header)
+{
+  if (stream_size < 3) return DAMAGED_HEADER;
+
+  header->size = (stream[2] == V2_MARK ? HDRSIZE_V2 : HDRSIZE);
+
+  if (stream_size < header->size) return DAMAGED_HEADER;
+
+  if (check_sum(stream, header->size - 1) != stream[header->size - 1]) return DAMAGED_HEADER;
+
+  if (header->size == HDRSIZE) {
+
+    READ_WORD(stream, header->img_width, 2);
+    READ_WORD(stream, header->img_height, 4);
+
+    READ_BYTE(stream, header->scales, 6);
+    READ_BYTE(stream, header->img_type, 7);
+    READ_BYTE(stream, header->wavelet, 8);
+
+    READ_DWORD(stream, header->sizes[0], 9);
+    READ_DWORD(stream, header->sizes[1], 13);
+    READ_DWORD(stream, header->sizes[2], 17);
+
+    return OK;
+  }
+
+  if (stream[3] != 2) return DAMAGED_HEADER;
+
+  READ_DWORD(stream, header->img_width, 4);
+  READ_DWORD(stream, header->img_height, 8);
+
+  READ_BYTE(stream, header->scales, 12);
+  READ_BYTE(stream, header->img_type, 13);
+  READ_BYTE(stream, header->wavelet, 14);
+
+  READ_DWORD(stream, header->sizes[0], 15);
+  READ_DWORD(stream, header->sizes[1], 19);
+  READ_DWORD(stream, header->sizes[2], 23);
+
+  return OK;
+}
+
+/*
+ * Smallest channel stream: stream header, options word, the shift of
+ * TI_ROI and the group count of TI_BLOCKS or TI_LEVELS.
+ */
+static int MinChannelSize(int options)
+{
+  int size;
+
+  size = (options & (TI_BLOCKS | TI_LEVELS) ? 5 : (options == 0 ? 2 : 4));
+
+  return (options & TI_ROI ? size + 1 : size);
+}
+
+/*
+ * Marks the samples of a line whose analysis filters reach a marked
+ * input sample, the low band in the first half of out.
+ */
+static void FootprintLine(unsigned char *in,
+                          unsigned char *out,
+                          int length)
+{
+  int i, j, half;
+
+  half = length >> 1;
+
+  for (i = 0; i < half; i++) {
+
+    out[i] = out[half + i] = 0;
+
+    for (j = MAX(0, 2 * i - LOW_REACH); j <= MIN(length - 1, 2 * i + LOW_REACH); j++) out[i] |= in[j];
+    for (j = MAX(0, 2 * i + 1 - HIGH_REACH); j <= MIN(length - 1, 2 * i + 1 + HIGH_REACH); j++) out[half + i] |= in[j];
+  }
+}
+
+/*
+ * Maps the region of interest onto the wavelet coefficients: a
+ * coefficient is in the footprint once its filters reach a region
+ * pixel at some level. The reach of the 9/7 filters is used for the
+ * Butterworth ones as well, their taps fade out about as fast. mask
+ * gets align_rows x align_cols flags, plane is scratch of that size.
+ */
+static int RegionFootprint(unsigned char *roi,
+                           unsigned char *mask,
+                           double *plane,
+                           int img_width,
+                           int img_height,
+                           int align_rows,
+                           int align_cols,
+                           int scales)
+{
+  unsigned char *line_in, *line_out;
+  int level, rows, cols, i, j;
+  size_t index;
+
+  line_in = (unsigned char *) malloc(MAX(align_rows, align_cols));
+  line_out = (unsigned char *) malloc(MAX(align_rows, align_cols));
+
+  if (line_in == NULL || line_out == NULL) {
+    free(line_in);
+    free(line_out);
+    return MEMORY_ERROR;
+  }
+
+  /* the padding mirrors the image, and so the region */
+  ExtendImage(roi, plane, img_height, img_width, align_rows, align_cols);
+
+  for (index = 0; index < (size_t) align_rows * align_cols; index++) mask[index] = (plane[index] != 0);
+
+  rows = align_rows;
+  cols = align_cols;
+
+  /* same order as the analysis: columns, then rows */
+  for (level = 1; level <= scales; level++) {
+
+    for (j = 0; j < cols; j++) {
+
+      for (i = 0; i < rows; i++) line_in[i] = mask[(size_t) i * align_cols + j];
+
+      FootprintLine(line_in, line_out, rows);
+
+      for (i = 0; i < rows; i++) mask[(size_t) i * align_cols + j] = line_out[i];
+    }
+
+    for (i = 0; i < rows; i++) {
+
+      memcpy(line_in, mask + (size_t) i * align_cols, cols);
+
+      FootprintLine(line_in, mask + (size_t) i * align_cols, cols);
+    }
+
+    rows >>= 1;
+    cols >>= 1;
+  }
+
+  free(line_in);
+  free(line_out);
+
+  return OK;
+}
+
+/*
+ * Maxshift: scales the footprint coefficients up by 2^shift, with
+ * shift the bit length of the largest magnitude outside it. Every
+ * region coefficient then codes before any other at its bit plane.
+ */
+static int ShiftRegion(double *dwt_data,
+                       unsigned char *mask,
+                       size_t n_samples,
+                       int *shift)
+{
+  double max_in, max_out, value;
+  size_t i;
+
+  max_in = max_out = 0;
+
+  for (i = 0; i < n_samples; i++) {
+
+    value = (dwt_data[i] < 0 ? -dwt_data[i] : dwt_data[i]);
+
+    if (mask[i]) max_in = MAX(max_in, value);
+    else max_out = MAX(max_out, value);
+  }
+
+  for (*shift = 1; (double) (1 << *shift) <= max_out; (*shift)++);
+
+  /* SPIHT planes hold magnitudes up to 2^31 */
+  if (max_in * (1 << *shift) >= 2147483648.0) return BAD_PARAMS;
+
+  for (i = 0; i < n_samples; i++)
+  if (mask[i]) dwt_data[i] *= (1 << *shift);
+
+  return OK;
+}
+
+static void WriteHeader(unsigned char *stream,
+                        int img_width,
+                        int img_height,
+                        int scales,
+                        int img_type,
+                        int wavelet,
+                        int lum_size,
+                        int cb_size,
+                        int cr_size)
+{
+  WRITE_BYTE(stream, 0x54, 0);
+  WRITE_BYTE(stream, 0x69, 1);
+
+  if (HeaderSize(img_width, img_height) == HDRSIZE) {
+
+    WRITE_WORD(stream, img_width, 2);
+    WRITE_WORD(stream, img_height, 4);
+
+    WRITE_BYTE(stream, scales, 6);
+    WRITE_BYTE(stream, img_type, 7);
+    WRITE_BYTE(stream, (wavelet == BUTTERWORTH ? 0 : 1), 8);
+
+    WRITE_DWORD(stream, lum_size, 9);
+    WRITE_DWORD(stream, cb_size, 13);
+    WRITE_DWORD(stream, cr_size, 17);
+
+    WRITE_BYTE(stream, check_sum(stream, HDRSIZE - 1), 21);
+
+    return;
+  }
+
+  WRITE_BYTE(stream, V2_MARK, 2);
+  WRITE_BYTE(stream, 2, 3);
+
+  WRITE_DWORD(stream, img_width, 4);
+  WRITE_DWORD(stream, img_height, 8);
+
+  WRITE_BYTE(stream, scales, 12);
+  WRITE_BYTE(stream, img_type, 13);
+  WRITE_BYTE(stream, (wavelet == BUTTERWORTH ? 0 : 1), 14);
+
+  WRITE_DWORD(stream, lum_size, 15);
+  WRITE_DWORD(stream, cb_size, 19);
+  WRITE_DWORD(stream, cr_size, 23);
+
+  WRITE_BYTE(stream, check_sum(stream, HDRSIZE_V2 - 1), 27);
+}
+
+/*
+ * The wavelet transforms leave rounded coefficients in a double plane.
+ * SPIHT gets them as a short plane when every magnitude fits in 15 bits
+ * and as an int plane otherwise. In raster order the samples are narrowed
+ * in place, both types are smaller than a double; other layouts need a
+ * plane of their own, sized for the chosen type. dwt_data is clobbered.
+ */
+static int EncodeChannel(double *dwt_data,
+                         int rows,
+                         int cols,
+                         int scales,
+                         unsigned char **buffers,
+                         int *buffer_sizes,
+                         int *stream_sizes,
+                         int count,
+                         SPIHTParams *params)
+{
+  size_t i, n_samples;
+  int coeff_type, result, row, col;
+  void *coeff_data;
+  short *data16;
+  int *data32;
+  double max;
+
+  n_samples = (size_t) rows * cols;
+
+  max = 0;
+
+  for (i = 0; i < n_samples; i++) {
+    if (dwt_data[i] > max) max = dwt_data[i];
+    if (-dwt_data[i] > max) max = -dwt_data[i];
+  }
+
+  coeff_type = (max < 32768 ? SPIHT_INT16 : SPIHT_INT32);
+
+  if (params->layout == SPIHT_RASTER) coeff_data = dwt_data;
+  else coeff_data = malloc(n_samples * (coeff_type == SPIHT_INT16 ? sizeof(short) : sizeof(int)));
+
+  if (coeff_data == NULL) return MEMORY_ERROR;
+
+  if (coeff_type == SPIHT_INT16) {
+
+    data16 = (short *) coeff_data;
+
+    if (params->layout == SPIHT_RASTER) for (i = 0; i < n_samples; i++) data16[i] = (short) dwt_data[i];
+    else for (row = 0, i = 0; row < rows; row++) for (col = 0; col < cols; col++, i++)
+    data16[SPIHTPlaneOffset(row, col, cols, scales, params->layout)] = (short) dwt_data[i];
+
+  } else {
+
+    data32 = (int *) coeff_data;
+
+    if (params->layout == SPIHT_RASTER) for (i = 0; i < n_samples; i++) data32[i] = (int) dwt_data[i];
+    else for (row = 0, i = 0; row < rows; row++) for (col = 0; col < cols; col++, i++)
+    data32[SPIHTPlaneOffset(row, col, cols, scales, params->layout)] = (int) dwt_data[i];
+  }
+
+  result = SPIHTEncodeDWTMulti(coeff_data, coeff_type, rows, cols, scales, buffers, buffer_sizes, stream_sizes, count, params);
+
+  if (coeff_data != dwt_data) free(coeff_data);
+
+  return result;
+}
+
+/*
+ * The decoded plane type comes from the stream header. In raster order
+ * SPIHT decodes into the front of dwt_data and the samples are widened
+ * back to front, so none is overwritten before it is read.
+ */
+static int DecodeChannel(double *dwt_data,
+                         int rows,
+                         int cols,
+                         int scales,
+                         unsigned char *buffer,
+                         int buffer_size,
+                         SPIHTParams *params)
+{
+  size_t i, n_samples;
+  int coeff_type, result, row, col;
+  void *coeff_data;
+  short *data16;
+  int *data32;
+
+  n_samples = (size_t) rows * cols;
+
+  coeff_type = SPIHTPlaneType(buffer, buffer_size);
+
+  if (params->layout == SPIHT_RASTER) coeff_data = dwt_data;
+  else coeff_data = malloc(n_samples * (coeff_type == SPIHT_INT16 ? sizeof(short) : sizeof(int)));
+
+  if (coeff_data == NULL) return MEMORY_ERROR;
+
+  result = SPIHTDecodeDWT(coeff_data, coeff_type, rows, cols, scales, buffer, buffer_size, params);
+
+  if (result != OK && result != BUFFER_EMPTY) goto error;
+
+  if (coeff_type == SPIHT_INT16) {
+
+    data16 = (short *) coeff_data;
+
+    if (params->layout == SPIHT_RASTER) for (i = n_samples; i > 0; i--) dwt_data[i - 1] = data16[i - 1];
+    else for (row = 0, i = 0; row < rows; row++) for (col = 0; col < cols; col++, i++)
+    dwt_data[i] = data16[SPIHTPlaneOffset(row, col, cols, scales, params->layout)];
+
+  } else {
+
+    data32 = (int *) coeff_data;
+
+    if (params->layout == SPIHT_RASTER) for (i = n_samples; i > 0; i--) dwt_data[i - 1] = data32[i - 1];
+    else for (row = 0, i = 0; row < rows; row++) for (col = 0; col < cols; col++, i++)
+    dwt_data[i] = data32[SPIHTPlaneOffset(row, col, cols, scales, params->layout)];
+  }
+
+  error:
+
+  if (coeff_data != dwt_data) free(coeff_data);
+
+  return result;
+}
+
+/*
+ * Inverse transform of a decoded channel, the width x height pixels at
+ * (left, top) of the rows x cols image go to image. With reduce > 0
+ * only the top left 1/2^reduce of the plane is synthesized: every
+ * analysis level doubles the low band, so the coefficients are scaled
+ * down by 2^reduce on the way to keep the mean level. Daubechies 9/7
+ * synthesizes a part of the image only over the samples it depends
+ * on, the recursive Butterworth filters always need the whole plane.
+ */
+static int SynthesizeChannel(double *dwt_data,
+                             unsigned char *image,
+                             int align_rows,
+                             int align_cols,
+                             int rows,
+                             int cols,
+                             int scales,
+                             int wavelet,
+                             int reduce,
+                             int left,
+                             int top,
+                             int width,
+                             int height)
+{
+  int row, col, sub_rows, sub_cols, value, result;
+  size_t index;
+  double scale, *src;
+
+  if (reduce > 0) {
+
+    sub_rows = align_rows >> reduce;
+    sub_cols = align_cols >> reduce;
+
+    scale = 1.0 / (1 << reduce);
+
+    /* rows move down to the compact layout, never over data not read yet */
+    for (row = 0; row < sub_rows; row++)
+    for (col = 0; col < sub_cols; col++)
+    dwt_data[(size_t) row * sub_cols + col] = dwt_data[(size_t) row * align_cols + col] * scale;
+
+    align_rows = sub_rows;
+    align_cols = sub_cols;
+    scales -= reduce;
+  }
+
+  /* the image sits in the middle of the plane, see ExtractImage() */
+  top += (align_rows - rows) >> 1;
+  left += (align_cols - cols) >> 1;
+
+  if (scales == 0) {
+
+    /* the LL band itself, only the DC level shift is left */
+    for (index = 0; index < (size_t) align_rows * align_cols; index++) {
+      value = (int) (dwt_data[index] + 128.5);
+      dwt_data[index] = MIN(MAX(value, 0), 255);
+    }
+
+    result = OK;
+
+  } else if (wavelet == BUTTERWORTH)
+    result = ButterworthSynthesis2D(dwt_data, align_cols, align_rows, scales);
+  else if (width < cols || height < rows)
+    result = Daub97SynthesisRegion(dwt_data, align_rows, align_cols, scales, top, left, top + height, left + width);
+  else
+    result = Daub97Synthesis2D(dwt_data, align_rows, align_cols, scales);
+
+  if (result != OK) return result;
+
+  for (row = 0; row < height; row++) {
+
+    src = dwt_data + (size_t) (top + row) * align_cols + left;
+
+    for (col = 0; col < width; col++) *image++ = (unsigned char) src[col];
+  }
+
+  return OK;
+}
+
 int TiCompress(unsigned char *image,
                unsigned char *stream,
                int img_width,
@@ -95,32 +757,201 @@ int TiCompress(unsigned char *image,
                int cb_ratio,
                int cr_ratio,
                int scales)
+{
+  return TiCompressEx(image, stream, img_width, img_height, wavelet, img_type,
+                      desired_size, actual_size, lum_ratio, cb_ratio, cr_ratio, scales, NULL);
+}
+
+int TiCompressEx(unsigned char *image,
+                 unsigned char *stream,
+                 int img_width,
+                 int img_height,
+                 int wavelet,
+                 int img_type,
+                 int desired_size,
+                 int *actual_size,
+                 int lum_ratio,
+                 int cb_ratio,
+                 int cr_ratio,
+                 int scales,
+                 TiParams *params)
+{
+  return TiCompressMulti(image, &stream, img_width, img_height, wavelet, img_type,
+                         &desired_size, actual_size, 1, lum_ratio, cb_ratio, cr_ratio, scales, params);
+}
+
+/*
+ * Encodes the image once for several sizes: streams[i] gets the stream
+ * TiCompressEx() would produce for desired_sizes[i]. The transforms and
+ * SPIHT run once, every output is cut from the same embedded streams.
+ * With TI_BLOCKS or TI_LEVELS SPIHT runs once per group count. Smaller
+ * outputs get the group table of a separate call but may split their
+ * last pass a few bytes differently, see SPIHTEncodeDWTMulti().
+ */
+int TiCompressMulti(unsigned char *image,
+                    unsigned char **streams,
+                    int img_width,
+                    int img_height,
+                    int wavelet,
+                    int img_type,
+                    int *desired_sizes,
+                    int *actual_sizes,
+                    int count,
+                    int lum_ratio,
+                    int cb_ratio,
+                    int cr_ratio,
+                    int scales,
+                    TiParams *params)
+{
+  return CompressImage(image, streams, img_width, img_height, wavelet, img_type, desired_sizes, actual_sizes, count,
+                       lum_ratio, cb_ratio, cr_ratio, scales, params, 0, NULL, NULL, NULL);
+}
+
+/*
+ * Encodes the image until its MSE is down to target_mse, with max_size
+ * as the limit on the stream size, and reports the MSE reached. It is
+ * measured on the wavelet coefficients while coding, so no decoding is
+ * needed; for TRUECOLOR images the Y, Cb and Cr errors are weighted as
+ * they show up in R, G and B.
+ */
+int TiCompressQuality(unsigned char *image,
+                      unsigned char *stream,
+                      int img_width,
+                      int img_height,
+                      int wavelet,
+                      int img_type,
+                      double target_mse,
+                      int max_size,
+                      int *actual_size,
+                      double *actual_mse,
+                      int lum_ratio,
+                      int cb_ratio,
+                      int cr_ratio,
+                      int scales,
+                      TiParams *params)
+{
+  if (target_mse <= 0 || actual_mse == NULL) return BAD_PARAMS;
+
+  return CompressImage(image, &stream, img_width, img_height, wavelet, img_type, &max_size, actual_size, 1,
+                       lum_ratio, cb_ratio, cr_ratio, scales, params, target_mse, actual_mse, NULL, NULL);
+}
+
+/*
+ * Encodes the image as TiCompressEx() does, handing the stream to sink
+ * instead of a buffer. The header holds the final sub-stream lengths and
+ * the channels are merged by them, so the stream goes out once coding is
+ * done, in pieces of up to SINK_CHUNK bytes; the only full size buffer
+ * is the one the channels are coded into.
+ */
+int TiCompressSink(unsigned char *image,
+                   TiSink sink,
+                   void *sink_context,
+                   int img_width,
+                   int img_height,
+                   int wavelet,
+                   int img_type,
+                   int desired_size,
+                   int *actual_size,
+                   int lum_ratio,
+                   int cb_ratio,
+                   int cr_ratio,
+                   int scales,
+                   TiParams *params)
+{
+  if (sink == NULL) return BAD_PARAMS;
+
+  return CompressImage(image, NULL, img_width, img_height, wavelet, img_type, &desired_size, actual_size, 1,
+                       lum_ratio, cb_ratio, cr_ratio, scales, params, 0, NULL, sink, sink_context);
+}
+
+static int CompressImage(unsigned char *image,
+                         unsigned char **streams,
+                         int img_width,
+                         int img_height,
+                         int wavelet,
+                         int img_type,
+                         int *desired_sizes,
+                         int *actual_sizes,
+                         int count,
+                         int lum_ratio,
+                         int cb_ratio,
+                         int cr_ratio,
+                         int scales,
+                         TiParams *params,
+                         double target_mse,
+                         double *mse,
+                         TiSink sink,
+                         void *sink_context)
 {
   int align_width, align_height;
   int width_bits, height_bits, temp;
-  int lum_size, cb_size, cr_size;
-  int lum_actual, cb_actual, cr_actual;
+  int min_size, min_desired, total, target, channels, index, hdr_size;
   int result;
   unsigned char *image_buf, *stream_buf;
   unsigned char *src, *dst, *end;
+  unsigned char **buffers, *footprint;
+  int *sizes, *actual;
   double *dwt_data;
+  double weight[MAX_CHANNELS];
+  SPIHTParams spiht_params;
+
+  spiht_params.options = (params != NULL ? params->options : 0);
+  spiht_params.blocks = (params != NULL ? params->blocks : 0);
+  spiht_params.threads = (params != NULL ? params->threads : 1);
+  spiht_params.wait = NULL;
+  spiht_params.wait_context = NULL;
+  spiht_params.mse = 0;
+  spiht_params.reduce = 0;
+  spiht_params.row_start = 0;
+  spiht_params.row_end = 0;
+  spiht_params.roi_shift = 0;
+  spiht_params.stats = NULL;
+  spiht_params.layout = (params != NULL ? params->layout : TI_RASTER);
+
+  if (mse != NULL) *mse = 0;
+
+  min_size = MinChannelSize(spiht_params.options);
+
+  if (image == NULL || (streams == NULL && sink == NULL) || desired_sizes == NULL || actual_sizes == NULL) return BAD_PARAMS;
+  if (count < 1 || (sink != NULL && count > 1)) return BAD_PARAMS;
+
+  hdr_size = HeaderSize(img_width, img_height);
+
+  min_desired = desired_sizes[0];
+  total = 0;
+
+  for (target = 0; target < count; target++) {
+    if (sink == NULL && streams[target] == NULL) return BAD_PARAMS;
+    if (desired_sizes[target] < min_desired) min_desired = desired_sizes[target];
+    total += desired_sizes[target] - hdr_size;
+  }
 
-  if (image == NULL || stream == NULL) return BAD_PARAMS;
   if (img_width <= 0 || img_height <= 0) return BAD_PARAMS;
-  if (img_width > 16383 || img_height > 16383) return BAD_PARAMS;
+  if (img_width > MAX_IMG_SIZE || img_height > MAX_IMG_SIZE) return BAD_PARAMS;
   if (wavelet != BUTTERWORTH && wavelet != DAUB97) return BAD_PARAMS;
   if (img_type != GRAYSCALE && img_type != TRUECOLOR) return BAD_PARAMS;
-  if (img_type == GRAYSCALE && desired_size < HDRSIZE + 2) return BAD_PARAMS;
-  if (img_type == TRUECOLOR && desired_size < HDRSIZE + 6) return BAD_PARAMS;
+  if ((spiht_params.options & ~(TI_LISTFREE | TI_BLOCKS | TI_CONTEXTS | TI_BYPASS | TI_MARKS | TI_LEVELS | TI_ROI | TI_RANGE | TI_STATES | TI_LANES)) != 0) return BAD_PARAMS;
+  if ((spiht_params.options & TI_ROI) && (params->roi == NULL || target_mse > 0)) return BAD_PARAMS;
+  if ((spiht_params.options & TI_BLOCKS) && spiht_params.blocks < 1) return BAD_PARAMS;
+  if ((spiht_params.options & TI_LEVELS) && (spiht_params.options & (TI_LISTFREE | TI_BLOCKS | TI_CONTEXTS))) return BAD_PARAMS;
+  if (img_type == GRAYSCALE && min_desired < hdr_size + min_size) return BAD_PARAMS;
+  if (img_type == TRUECOLOR && min_desired < hdr_size + 3 * min_size) return BAD_PARAMS;
   if (lum_ratio * cb_ratio * cr_ratio == 0 && (lum_ratio != 0 || cb_ratio != 0 || cr_ratio != 0)) return BAD_PARAMS;
   if (lum_ratio + cb_ratio + cr_ratio != 0 && lum_ratio + cb_ratio + cr_ratio != 100) return BAD_PARAMS;
   if (scales < 0) return BAD_PARAMS;
 
-  *actual_size = 0;
+  for (target = 0; target < count; target++) actual_sizes[target] = 0;
 
   dwt_data = NULL;
   image_buf = NULL;
   stream_buf = NULL;
+  buffers = NULL;
+  footprint = NULL;
+  sizes = NULL;
+  actual = NULL;
+
+  /* tree groups are made of LL band rows, so keep the LL band tall enough */
+  if (scales == 0 && (spiht_params.options & TI_BLOCKS)) scales = DEF_SCALES;
 
   if (scales == 0) {
 
@@ -143,19 +974,110 @@ int TiCompress(unsigned char *image,
     scales = MAX(DEF_SCALES, MIN(width_bits, height_bits));
   }
 
+  if (lum_ratio == 0) {
+    lum_ratio = DEF_LUM;
+    cb_ratio = DEF_CB;
+    cr_ratio = DEF_CR;
+  }
+
+  channels = (img_type == GRAYSCALE ? 1 : 3);
+
+  weight[0] = WEIGHT_LUM;
+  weight[1] = WEIGHT_CB;
+  weight[2] = WEIGHT_CR;
+
+  /* every channel stops at the same error, which then adds up to target_mse in RGB */
+  if (img_type == GRAYSCALE) spiht_params.target_mse = target_mse;
+  else spiht_params.target_mse = target_mse / (WEIGHT_LUM + WEIGHT_CB + WEIGHT_CR);
+
   align_width = ALIGN(img_width, scales);
   align_height = ALIGN(img_height, scales);
 
-  dwt_data = (double *) malloc(align_width * align_height * sizeof(double));
+  dwt_data = (double *) malloc((size_t) align_width * align_height * sizeof(double));
 
-  if (dwt_data == NULL) {
+  /* channel streams of every output, channel after channel */
+  buffers = (unsigned char **) malloc(channels * count * sizeof(unsigned char *));
+  sizes = (int *) malloc(channels * count * sizeof(int));
+  actual = (int *) malloc(channels * count * sizeof(int));
+
+  if (dwt_data == NULL || buffers == NULL || sizes == NULL || actual == NULL) {
     result = MEMORY_ERROR;
     goto error;
   }
 
+  if (spiht_params.options & TI_ROI) {
+
+    footprint = (unsigned char *) malloc((size_t) align_width * align_height);
+
+    if (footprint == NULL) {
+      result = MEMORY_ERROR;
+      goto error;
+    }
+
+    result = RegionFootprint(params->roi, footprint, dwt_data, img_width, img_height, align_height, align_width, scales);
+
+    if (result != OK) goto error;
+  }
+
   if (img_type == GRAYSCALE) {
 
-    ExtendImage(image, dwt_data, img_height, img_width, align_height, align_width);
+    /* the sink takes the header first, so the channel waits for its size */
+    if (sink != NULL && (stream_buf = (unsigned char *) malloc(total)) == NULL) {
+      result = MEMORY_ERROR;
+      goto error;
+    }
+
+    for (target = 0; target < count; target++) {
+      buffers[target] = (sink != NULL ? stream_buf : streams[target] + hdr_size);
+      sizes[target] = desired_sizes[target] - hdr_size;
+    }
+
+  } else {
+
+    image_buf = (unsigned char *) malloc((size_t) img_width * img_height);
+    stream_buf = (unsigned char *) malloc(total);
+
+    if (image_buf == NULL || stream_buf == NULL) {
+      result = MEMORY_ERROR;
+      goto error;
+    }
+
+    dst = stream_buf;
+
+    for (target = 0; target < count; target++) {
+
+      sizes[2 * count + target] = MAX(min_size, ShareOf(desired_sizes[target] - hdr_size, cr_ratio) - 4);
+      sizes[1 * count + target] = MAX(min_size, ShareOf(desired_sizes[target] - hdr_size, cb_ratio) - 4);
+      sizes[0 * count + target] = (desired_sizes[target] - hdr_size) - sizes[2 * count + target] - sizes[1 * count + target];
+
+      for (index = 0; index < 3; index++) {
+        buffers[index * count + target] = dst;
+        dst += sizes[index * count + target];
+      }
+    }
+
+    ConvertRGBToYCbCr(image, (size_t) img_width * img_height * 3);
+  }
+
+  for (index = 0; index < channels; index++) {
+
+    if (img_type == GRAYSCALE) {
+
+      ExtendImage(image, dwt_data, img_height, img_width, align_height, align_width);
+
+    } else {
+
+      src = image + index;
+      dst = image_buf;
+      end = image + (size_t) img_width * img_height * 3;
+
+      while (src < end) {
+        *dst = *src;
+        dst++; src += 3;
+      }
+
+      ExtendImage(image_buf, dwt_data, img_height, img_width, align_height, align_width);
+    }
 
     if (wavelet == BUTTERWORTH)
       result = ButterworthAnalysis2D(dwt_data, align_width, align_height, scales);
@@ -164,149 +1086,248 @@ int TiCompress(unsigned char *image,
 
     if (result != OK) goto error;
 
-    result = SPIHTEncodeDWT(dwt_data, align_height, align_width, scales, stream + HDRSIZE, desired_size - HDRSIZE, actual_size);
+    /* chroma keeps its order: a small fixed budget would go to the region alone */
+    if (footprint != NULL && index == 0) {
+
+      result = ShiftRegion(dwt_data, footprint, (size_t) align_width * align_height, &spiht_params.roi_shift);
+
+      if (result != OK) goto error;
+
+    } else {
+
+      spiht_params.options &= ~TI_ROI;
+      spiht_params.roi_shift = 0;
+    }
+
+    result = EncodeChannel(dwt_data, align_height, align_width, scales,
+    buffers + index * count, sizes + index * count, actual + index * count, count, &spiht_params);
 
     if (result != OK && result != BUFFER_FULL) goto error;
 
-    WRITE_BYTE(stream, 0x54, 0);
-    WRITE_BYTE(stream, 0x69, 1);
+    if (mse != NULL) *mse += (img_type == GRAYSCALE ? spiht_params.mse : spiht_params.mse * weight[index]);
+  }
 
-    WRITE_WORD(stream, img_width, 2);
-    WRITE_WORD(stream, img_height, 4);
+  if (sink != NULL) {
 
-    WRITE_BYTE(stream, scales, 6);
-    WRITE_BYTE(stream, img_type, 7);
-    WRITE_BYTE(stream, (wavelet == BUTTERWORTH ? 0 : 1), 8);
+    result = SinkStream(sink, sink_context, buffers, actual, img_width, img_height, scales, img_type, wavelet);
 
-    WRITE_DWORD(stream, *actual_size, 9);
-    WRITE_DWORD(stream, 0, 13);
-    WRITE_DWORD(stream, 0, 17);
+    if (result != OK) goto error;
 
-    WRITE_BYTE(stream, check_sum(stream, HDRSIZE - 1), 21);
+    actual_sizes[0] = actual[0] + hdr_size;
 
-    *actual_size += HDRSIZE;
+    if (img_type == TRUECOLOR) actual_sizes[0] += actual[1] + actual[2];
+  }
 
-    result = OK;
+  for (target = 0; target < count && sink == NULL; target++) {
 
-  } else {
+    if (img_type == GRAYSCALE) {
 
-    if (lum_ratio == 0) {
+      WriteHeader(streams[target], img_width, img_height, scales, img_type, wavelet, actual[target], 0, 0);
 
-      cr_size = MAX(2, ((desired_size - HDRSIZE) * DEF_CR / 100) - 4);
-      cb_size = MAX(2, ((desired_size - HDRSIZE) * DEF_CB / 100) - 4);
-      lum_size = (desired_size - HDRSIZE) - cr_size - cb_size;
+      actual_sizes[target] = actual[target] + hdr_size;
 
     } else {
 
-      cr_size = MAX(2, ((desired_size - HDRSIZE) * cr_ratio / 100) - 4);
-      cb_size = MAX(2, ((desired_size - HDRSIZE) * cb_ratio / 100) - 4);
-      lum_size = (desired_size - HDRSIZE) - cr_size - cb_size;
-    }
+      MergeChannels(streams[target] + hdr_size, buffers[target], buffers[count + target], buffers[2 * count + target],
+      actual[target], actual[count + target], actual[2 * count + target]);
 
-    image_buf = (unsigned char *) malloc(img_width * img_height);
-    stream_buf = (unsigned char *) malloc((desired_size - HDRSIZE));
+      WriteHeader(streams[target], img_width, img_height, scales, img_type, wavelet,
+      actual[target], actual[count + target], actual[2 * count + target]);
 
-    if (image_buf == NULL || stream_buf == NULL) {
-      result = MEMORY_ERROR;
-      goto error;
+      actual_sizes[target] = actual[target] + actual[count + target] + actual[2 * count + target] + hdr_size;
     }
+  }
 
-    ConvertRGBToYCbCr(image, img_width * img_height * 3);
+  result = OK;
 
-    src = image;
-    dst = image_buf;
-    end = image + img_width * img_height * 3;
+  error:
 
-    while (src < end) {
-      *dst = *src;
-      dst++; src += 3;
-    }
+  free(dwt_data);
+  free(image_buf);
+  free(stream_buf);
+  free(buffers);
+  free(footprint);
+  free(sizes);
+  free(actual);
 
-    ExtendImage(image_buf, dwt_data, img_height, img_width, align_height, align_width);
+  return result;
+}
 
-    if (wavelet == BUTTERWORTH)
-      result = ButterworthAnalysis2D(dwt_data, align_width, align_height, scales);
-    else 
-      result = Daub97Analysis2D(dwt_data, align_height, align_width, scales);
+/*
+ * Hands the header and then the merged channel streams to sink.
+ */
+static int SinkStream(TiSink sink,
+                      void *sink_context,
+                      unsigned char **buffers,
+                      int *sizes,
+                      int img_width,
+                      int img_height,
+                      int scales,
+                      int img_type,
+                      int wavelet)
+{
+  unsigned char header[MAX_HDRSIZE];
+  unsigned char *chunk;
+  ChannelSplitter merger;
+  int offset, count, result;
 
-    if (result != OK) goto error;
+  if (img_type == GRAYSCALE) WriteHeader(header, img_width, img_height, scales, img_type, wavelet, sizes[0], 0, 0);
+  else WriteHeader(header, img_width, img_height, scales, img_type, wavelet, sizes[0], sizes[1], sizes[2]);
 
-    result = SPIHTEncodeDWT(dwt_data, align_height, align_width, scales, stream_buf, lum_size, &lum_actual);
+  if (sink(sink_context, header, HeaderSize(img_width, img_height)) != 0) return STREAM_ERROR;
 
-    if (result != OK && result != BUFFER_FULL) goto error;
+  if (img_type == GRAYSCALE) {
 
-    src = image + 1;
-    dst = image_buf;
-    end = image + img_width * img_height * 3;
+    for (offset = 0; offset < sizes[0]; offset += count) {
 
-    while (src < end) {
-      *dst = *src;
-      dst++; src += 3;
+      count = MIN(sizes[0] - offset, SINK_CHUNK);
+
+      if (sink(sink_context, buffers[0] + offset, count) != 0) return STREAM_ERROR;
     }
 
-    ExtendImage(image_buf, dwt_data, img_height, img_width, align_height, align_width);
+    return OK;
+  }
 
-    if (wavelet == BUTTERWORTH)
-      result = ButterworthAnalysis2D(dwt_data, align_width, align_height, scales);
-    else
-      result = Daub97Analysis2D(dwt_data, align_height, align_width, scales);
+  chunk = (unsigned char *) malloc(SINK_CHUNK);
 
-    if (result != OK) goto error;
+  if (chunk == NULL) return MEMORY_ERROR;
 
-    result = SPIHTEncodeDWT(dwt_data, align_height, align_width, scales, stream_buf + lum_actual, cb_size, &cb_actual);
+  InitSplitter(&merger, sizes[0], sizes[1], sizes[2]);
 
-    if (result != OK && result != BUFFER_FULL) goto error;
+  result = OK;
 
-    src = image + 2;
-    dst = image_buf;
-    end = image + img_width * img_height * 3;
+  while ((count = MergeBytes(&merger, chunk, SINK_CHUNK, buffers[0], buffers[1], buffers[2])) > 0)
+  if (sink(sink_context, chunk, count) != 0) {
+    result = STREAM_ERROR;
+    break;
+  }
 
-    while (src < end) {
-      *dst = *src;
-      dst++; src += 3;
+  free(chunk);
+
+  return result;
+}
+
+/*
+ * Cuts a stream down to desired_size bytes without decoding it. Every
+ * channel gets the share of the new size TiCompress() would give it for
+ * the same ratios and is cut as SPIHTTruncate() does; without TI_BLOCKS
+ * or TI_LEVELS the result is the stream TiCompress() makes for desired_size.
+ */
+int TiTruncate(unsigned char *stream,
+               int stream_size,
+               unsigned char *out,
+               int desired_size,
+               int *actual_size,
+               int lum_ratio,
+               int cb_ratio,
+               int cr_ratio)
+{
+  int sizes[MAX_CHANNELS], avail[MAX_CHANNELS], budget[MAX_CHANNELS], actual[MAX_CHANNELS];
+  int channels, index, min_size;
+  int result;
+  unsigned char *src[MAX_CHANNELS], *dst[MAX_CHANNELS];
+  unsigned char *split_buf, *merge_buf;
+  StreamHeader header;
+
+  if (stream == NULL || out == NULL || actual_size == NULL) return BAD_PARAMS;
+  if (lum_ratio * cb_ratio * cr_ratio == 0 && (lum_ratio != 0 || cb_ratio != 0 || cr_ratio != 0)) return BAD_PARAMS;
+  if (lum_ratio + cb_ratio + cr_ratio != 0 && lum_ratio + cb_ratio + cr_ratio != 100) return BAD_PARAMS;
+
+  *actual_size = 0;
+
+  result = ReadHeader(stream, stream_size, &header);
+
+  if (result != OK) return result;
+
+  if (header.img_type != GRAYSCALE && header.img_type != TRUECOLOR) return DAMAGED_HEADER;
+
+  for (index = 0; index < MAX_CHANNELS; index++) sizes[index] = header.sizes[index];
+
+  if (lum_ratio == 0) {
+    lum_ratio = DEF_LUM;
+    cb_ratio = DEF_CB;
+    cr_ratio = DEF_CR;
+  }
+
+  channels = (header.img_type == GRAYSCALE ? 1 : 3);
+
+  split_buf = NULL;
+  merge_buf = NULL;
+
+  if (header.img_type == GRAYSCALE) {
+
+    src[0] = stream + header.size;
+    avail[0] = MIN(sizes[0], stream_size - header.size);
+
+    min_size = MinChannelSize(SPIHTStreamOptions(src[0], avail[0]));
+
+    if (desired_size < header.size + min_size) return BAD_PARAMS;
+
+    dst[0] = out + header.size;
+    budget[0] = desired_size - header.size;
+
+  } else {
+
+    if (sizes[0] <= 0 || sizes[1] <= 0 || sizes[2] <= 0) return DAMAGED_HEADER;
+
+    split_buf = (unsigned char *) malloc(sizes[0] + sizes[1] + sizes[2]);
+
+    if (split_buf == NULL) {
+      result = MEMORY_ERROR;
+      goto error;
     }
 
-    ExtendImage(image_buf, dwt_data, img_height, img_width, align_height, align_width);
+    src[0] = split_buf;
+    src[1] = src[0] + sizes[0];
+    src[2] = src[1] + sizes[1];
 
-    if (wavelet == BUTTERWORTH)
-      result = ButterworthAnalysis2D(dwt_data, align_width, align_height, scales);
-    else
-      result = Daub97Analysis2D(dwt_data, align_height, align_width, scales);
+    SplitChannels(stream + header.size, src[0], src[1], src[2],
+    stream_size - header.size, sizes[0], sizes[1], sizes[2], &avail[0], &avail[1], &avail[2]);
 
-    if (result != OK) goto error;
+    min_size = MinChannelSize(SPIHTStreamOptions(src[0], avail[0]));
 
-    result = SPIHTEncodeDWT(dwt_data, align_height, align_width, scales, stream_buf + lum_actual + cb_actual, cr_size, &cr_actual);
+    if (desired_size < header.size + 3 * min_size) {
+      result = BAD_PARAMS;
+      goto error;
+    }
 
-    if (result != OK && result != BUFFER_FULL) goto error;
+    budget[2] = MAX(min_size, ShareOf(desired_size - header.size, cr_ratio) - 4);
+    budget[1] = MAX(min_size, ShareOf(desired_size - header.size, cb_ratio) - 4);
+    budget[0] = (desired_size - header.size) - budget[2] - budget[1];
 
-    MergeChannels(stream + HDRSIZE, stream_buf, stream_buf + lum_actual, stream_buf + lum_actual + cb_actual, lum_actual, cb_actual, cr_actual);
+    merge_buf = (unsigned char *) malloc(desired_size - header.size);
 
-    WRITE_BYTE(stream, 0x54, 0);
-    WRITE_BYTE(stream, 0x69, 1);
+    if (merge_buf == NULL) {
+      result = MEMORY_ERROR;
+      goto error;
+    }
 
-    WRITE_WORD(stream, img_width, 2);
-    WRITE_WORD(stream, img_height, 4);
+    dst[0] = merge_buf;
+    dst[1] = dst[0] + budget[0];
+    dst[2] = dst[1] + budget[1];
+  }
 
-    WRITE_BYTE(stream, scales, 6);
-    WRITE_BYTE(stream, img_type, 7);
-    WRITE_BYTE(stream, (wavelet == BUTTERWORTH ? 0 : 1) , 8);
+  actual[1] = actual[2] = 0;
+
+  for (index = 0; index < channels; index++) {
+
+    result = SPIHTTruncate(src[index], avail[index], dst[index], budget[index], &actual[index]);
+
+    if (result != OK) goto error;
+  }
 
-    WRITE_DWORD(stream, lum_actual, 9);
-    WRITE_DWORD(stream, cb_actual, 13);
-    WRITE_DWORD(stream, cr_actual, 17);
+  if (header.img_type == TRUECOLOR) MergeChannels(out + header.size, dst[0], dst[1], dst[2], actual[0], actual[1], actual[2]);
 
-    WRITE_BYTE(stream, check_sum(stream, HDRSIZE - 1), 21);
+  WriteHeader(out, header.img_width, header.img_height, header.scales, header.img_type, header.wavelet, actual[0], actual[1], actual[2]);
 
-    *actual_size = lum_actual + cb_actual + cr_actual + HDRSIZE;
+  *actual_size = header.size + actual[0] + actual[1] + actual[2];
 
-    result = OK;
-  }
+  result = OK;
 
   error:
 
-  free(dwt_data);
-  free(image_buf);
-  free(stream_buf);
+  free(split_buf);
+  free(merge_buf);
 
   return result;
 }
@@ -317,13 +1338,16 @@ int TiCheckHeader(unsigned char *stream,
                   int *img_type,
                   int stream_size)
 {
-  if (stream_size < HDRSIZE) return DAMAGED_HEADER;
+  StreamHeader header;
+  int result;
+
+  result = ReadHeader(stream, stream_size, &header);
 
-  if (check_sum(stream, HDRSIZE - 1) != stream[21]) return DAMAGED_HEADER;
+  if (result != OK) return result;
 
-  READ_WORD(stream, *img_width, 2);
-  READ_WORD(stream, *img_height, 4);
-  READ_BYTE(stream, *img_type, 7);
+  *img_width = header.img_width;
+  *img_height = header.img_height;
+  *img_type = header.img_type;
 
   return OK;
 }
@@ -334,30 +1358,124 @@ int TiDecompress(unsigned char *stream,
                  int img_height,
                  int img_type,
                  int stream_size)
+{
+  return TiDecompressEx(stream, image, img_width, img_height, img_type, stream_size, NULL);
+}
+
+int TiDecompressEx(unsigned char *stream,
+                   unsigned char *image,
+                   int img_width,
+                   int img_height,
+                   int img_type,
+                   int stream_size,
+                   TiParams *params)
+{
+  return DecompressImage(stream, image, img_width, img_height, img_type, stream_size, 0, 0, 0, img_width, img_height, params);
+}
+
+/*
+ * Decodes the image at 1/2^reduce of its size into an image of
+ * (img_width >> reduce) x (img_height >> reduce) pixels. The finest
+ * reduce scales are never synthesized, and streams coded with TI_LEVELS
+ * are not even decoded past the resolution needed.
+ */
+int TiDecompressScaled(unsigned char *stream,
+                       unsigned char *image,
+                       int img_width,
+                       int img_height,
+                       int img_type,
+                       int stream_size,
+                       int reduce,
+                       TiParams *params)
+{
+  if (reduce < 0 || reduce > 15) return BAD_PARAMS;
+
+  return DecompressImage(stream, image, img_width, img_height, img_type, stream_size, reduce,
+  0, 0, img_width >> reduce, img_height >> reduce, params);
+}
+
+/*
+ * Decodes the width x height pixels at (left, top) of the image into
+ * image. Daubechies 9/7 images are synthesized only around the region,
+ * and of TI_BLOCKS streams only the tree groups the region depends on
+ * are decoded.
+ */
+int TiDecompressRegion(unsigned char *stream,
+                       unsigned char *image,
+                       int img_width,
+                       int img_height,
+                       int img_type,
+                       int stream_size,
+                       int left,
+                       int top,
+                       int width,
+                       int height,
+                       TiParams *params)
+{
+  return DecompressImage(stream, image, img_width, img_height, img_type, stream_size, 0, left, top, width, height, params);
+}
+
+static int DecompressImage(unsigned char *stream,
+                           unsigned char *image,
+                           int img_width,
+                           int img_height,
+                           int img_type,
+                           int stream_size,
+                           int reduce,
+                           int left,
+                           int top,
+                           int width,
+                           int height,
+                           TiParams *params)
 {
   int scales, lum_size, cb_size, cr_size;
   int lum_actual, cb_actual, cr_actual;
   int align_width, align_height, wavelet = 0;
+  int out_width, out_height, pad_top;
   int result;
   unsigned char *image_buf, *stream_buf;
   unsigned char *src, *dst, *end;
   double *dwt_data;
+  SPIHTParams spiht_params;
+  StreamHeader header;
+
+  spiht_params.options = 0;
+  spiht_params.blocks = 0;
+  spiht_params.threads = (params != NULL ? params->threads : 1);
+  spiht_params.wait = NULL;
+  spiht_params.wait_context = NULL;
+  spiht_params.target_mse = 0;
+  spiht_params.reduce = reduce;
+  spiht_params.row_start = 0;
+  spiht_params.row_end = 0;
+  spiht_params.roi_shift = 0;
+  spiht_params.stats = NULL;
+  spiht_params.layout = (params != NULL ? params->layout : TI_RASTER);
 
   if (image == NULL || stream == NULL) return BAD_PARAMS;
   if (img_width <= 0 || img_height <= 0) return BAD_PARAMS;
-  if (img_width > 16383 || img_height > 16383) return BAD_PARAMS;
+  if (img_width > MAX_IMG_SIZE || img_height > MAX_IMG_SIZE) return BAD_PARAMS;
   if (img_type != GRAYSCALE && img_type != TRUECOLOR) return BAD_PARAMS;
-  if (img_type == GRAYSCALE && stream_size < HDRSIZE + 2) return DAMAGED_HEADER;
-  if (img_type == TRUECOLOR && stream_size < HDRSIZE + 6) return DAMAGED_HEADER;
 
-  if (check_sum(stream, HDRSIZE - 1) != stream[21]) return DAMAGED_HEADER;
+  if ((result = ReadHeader(stream, stream_size, &header)) != OK) return result;
+
+  if (img_type == GRAYSCALE && stream_size < header.size + 2) return DAMAGED_HEADER;
+  if (img_type == TRUECOLOR && stream_size < header.size + 6) return DAMAGED_HEADER;
 
-  READ_BYTE(stream, scales, 6);
-  READ_BYTE(stream, wavelet, 8);
+  scales = header.scales;
+  wavelet = header.wavelet;
 
-  READ_DWORD(stream, lum_size, 9);
-  READ_DWORD(stream, cb_size, 13);
-  READ_DWORD(stream, cr_size, 17);
+  lum_size = header.sizes[0];
+  cb_size = header.sizes[1];
+  cr_size = header.sizes[2];
+
+  if (reduce < 0 || reduce > scales) return BAD_PARAMS;
+
+  out_width = img_width >> reduce;
+  out_height = img_height >> reduce;
+
+  if (left < 0 || top < 0 || width <= 0 || height <= 0) return BAD_PARAMS;
+  if (left + width > out_width || top + height > out_height) return BAD_PARAMS;
 
   dwt_data = NULL;
   image_buf = NULL;
@@ -366,7 +1484,21 @@ int TiDecompress(unsigned char *stream,
   align_width = ALIGN(img_width, scales);
   align_height = ALIGN(img_height, scales);
 
-  dwt_data = (double *) malloc(align_width * align_height * sizeof(double));
+  /* tree groups of the lowest band rows the region depends on */
+  if (wavelet == DAUB97 && height < out_height) {
+
+    pad_top = ((align_height >> reduce) - out_height) >> 1;
+
+    if (scales > reduce)
+      Daub97RegionSupport(align_height >> reduce, scales - reduce, pad_top + top, pad_top + top + height,
+      &spiht_params.row_start, &spiht_params.row_end);
+    else {
+      spiht_params.row_start = pad_top + top;
+      spiht_params.row_end = pad_top + top + height;
+    }
+  }
+
+  dwt_data = (double *) malloc((size_t) align_width * align_height * sizeof(double));
 
   if (dwt_data == NULL) {
     result = MEMORY_ERROR;
@@ -375,55 +1507,43 @@ int TiDecompress(unsigned char *stream,
 
   if (img_type == GRAYSCALE) {
 
-    result = SPIHTDecodeDWT(dwt_data, align_height, align_width, scales, stream + HDRSIZE, stream_size - HDRSIZE);
+    result = DecodeChannel(dwt_data, align_height, align_width, scales, stream + header.size, stream_size - header.size, &spiht_params);
 
     if (result != OK && result != BUFFER_EMPTY) goto error;
 
-    if (wavelet == BUTTERWORTH)
-      result = ButterworthSynthesis2D(dwt_data, align_width, align_height, scales);
-    else
-      result = Daub97Synthesis2D(dwt_data, align_height, align_width, scales);
+    result = SynthesizeChannel(dwt_data, image, align_height, align_width, out_height, out_width, scales, wavelet, reduce, left, top, width, height);
 
     if (result != OK) goto error;
 
-    ExtractImage(dwt_data, image, align_height, align_width, img_height, img_width);
-
-    result = OK;
-
   } else {
 
-    image_buf = (unsigned char *) malloc(img_width * img_height);
-    stream_buf = (unsigned char *) malloc(lum_size + cb_size + cr_size);
+    image_buf = (unsigned char *) malloc((size_t) width * height);
+    stream_buf = (unsigned char *) malloc((size_t) lum_size + cb_size + cr_size);
 
     if (image_buf == NULL || stream_buf == NULL) {
       result = MEMORY_ERROR;
       goto error;
     }
 
-    SplitChannels(stream + HDRSIZE, stream_buf, stream_buf + lum_size, stream_buf + lum_size + cb_size,
-    stream_size - HDRSIZE, lum_size, cb_size, cr_size, &lum_actual, &cb_actual, &cr_actual);
+    SplitChannels(stream + header.size, stream_buf, stream_buf + lum_size, stream_buf + lum_size + cb_size,
+    stream_size - header.size, lum_size, cb_size, cr_size, &lum_actual, &cb_actual, &cr_actual);
 
     if (lum_actual < 2) {
-      memset(dwt_data, 0, align_width * align_height * sizeof(double));
+      memset(dwt_data, 0, (size_t) align_width * align_height * sizeof(double));
       result = OK;
     } else {
-      result = SPIHTDecodeDWT(dwt_data, align_height, align_width, scales, stream_buf, lum_actual);
+      result = DecodeChannel(dwt_data, align_height, align_width, scales, stream_buf, lum_actual, &spiht_params);
     }
 
     if (result != OK && result != BUFFER_EMPTY) goto error;
 
-    if (wavelet == BUTTERWORTH)
-      result = ButterworthSynthesis2D(dwt_data, align_width, align_height, scales);
-    else
-      result = Daub97Synthesis2D(dwt_data, align_height, align_width, scales);
+    result = SynthesizeChannel(dwt_data, image_buf, align_height, align_width, out_height, out_width, scales, wavelet, reduce, left, top, width, height);
 
     if (result != OK) goto error;
 
-    ExtractImage(dwt_data, image_buf, align_height, align_width, img_height, img_width);
-
     src = image_buf;
     dst = image;
-    end = image_buf + img_width * img_height;
+    end = image_buf + (size_t) width * height;
 
     while (src < end) {
       *dst = *src;
@@ -431,26 +1551,21 @@ int TiDecompress(unsigned char *stream,
     }
 
     if (cb_actual < 2) {
-      memset(dwt_data, 0, align_width * align_height * sizeof(double));
+      memset(dwt_data, 0, (size_t) align_width * align_height * sizeof(double));
       result = OK;
     } else {
-      result = SPIHTDecodeDWT(dwt_data, align_height, align_width, scales, stream_buf + lum_size, cb_actual);
+      result = DecodeChannel(dwt_data, align_height, align_width, scales, stream_buf + lum_size, cb_actual, &spiht_params);
     }
 
     if (result != OK && result != BUFFER_EMPTY) goto error;
 
-    if (wavelet == BUTTERWORTH)
-      result = ButterworthSynthesis2D(dwt_data, align_width, align_height, scales);
-    else
-      result = Daub97Synthesis2D(dwt_data, align_height, align_width, scales);
+    result = SynthesizeChannel(dwt_data, image_buf, align_height, align_width, out_height, out_width, scales, wavelet, reduce, left, top, width, height);
 
     if (result != OK) goto error;
 
-    ExtractImage(dwt_data, image_buf, align_height, align_width, img_height, img_width);
-
     src = image_buf;
     dst = image + 1;
-    end = image_buf + img_width * img_height;
+    end = image_buf + (size_t) width * height;
 
     while (src < end) {
       *dst = *src;
@@ -458,37 +1573,32 @@ int TiDecompress(unsigned char *stream,
     }
 
     if (cr_actual < 2) {
-      memset(dwt_data, 0, align_width * align_height * sizeof(double));
+      memset(dwt_data, 0, (size_t) align_width * align_height * sizeof(double));
       result = OK;
     } else {
-      result = SPIHTDecodeDWT(dwt_data, align_height, align_width, scales, stream_buf + lum_size + cb_size, cr_actual);
+      result = DecodeChannel(dwt_data, align_height, align_width, scales, stream_buf + lum_size + cb_size, cr_actual, &spiht_params);
     }
 
     if (result != OK && result != BUFFER_EMPTY) goto error;
 
-    if (wavelet == BUTTERWORTH)
-      result = ButterworthSynthesis2D(dwt_data, align_width, align_height, scales);
-    else
-      result = Daub97Synthesis2D(dwt_data, align_height, align_width, scales);
+    result = SynthesizeChannel(dwt_data, image_buf, align_height, align_width, out_height, out_width, scales, wavelet, reduce, left, top, width, height);
 
     if (result != OK) goto error;
 
-    ExtractImage(dwt_data, image_buf, align_height, align_width, img_height, img_width);
-
     src = image_buf;
     dst = image + 2;
-    end = image_buf + img_width * img_height;
+    end = image_buf + (size_t) width * height;
 
     while (src < end) {
       *dst = *src;
        src++; dst += 3;
     }
 
-    ConvertYCbCrToRGB(image, img_width * img_height * 3);
-
-    result = OK;
+    ConvertYCbCrToRGB(image, (size_t) width * height * 3);
   }
 
+  result = OK;
+
   error:
 
   free(dwt_data);
@@ -497,3 +1607,448 @@ int TiDecompress(unsigned char *stream,
 
   return result;
 }
+
+static unsigned char *WaitChannel(void *context,
+                                  unsigned char *need)
+{
+  DecoderChannel *channel;
+  TiDecoder *decoder;
+  unsigned char *end;
+
+  channel = (DecoderChannel *) context;
+  decoder = channel->decoder;
+
+  pthread_mutex_lock(&decoder->lock);
+
+  while (channel->buffer + channel->count < need && decoder->closed == 0) {
+    channel->need = need;
+    pthread_cond_broadcast(&decoder->idle_cond);
+    pthread_cond_wait(&decoder->data_cond, &decoder->lock);
+  }
+
+  channel->need = NULL;
+
+  end = channel->buffer + channel->count;
+
+  pthread_mutex_unlock(&decoder->lock);
+
+  return end;
+}
+
+static void *DecodeChannelThread(void *arg)
+{
+  DecoderChannel *channel;
+  TiDecoder *decoder;
+  SPIHTParams params;
+  int result;
+
+  channel = (DecoderChannel *) arg;
+  decoder = channel->decoder;
+
+  params.options = 0;
+  params.blocks = 0;
+  params.threads = 1;
+  params.wait = WaitChannel;
+  params.wait_context = channel;
+  params.target_mse = 0;
+  params.reduce = 0;
+  params.row_start = 0;
+  params.row_end = 0;
+  params.roi_shift = 0;
+  params.stats = NULL;
+  params.layout = SPIHT_RASTER;
+
+  result = SPIHTDecodeDWT(channel->coeff_data, SPIHT_INT32, decoder->align_height, decoder->align_width,
+  decoder->scales, channel->buffer, channel->size, &params);
+
+  pthread_mutex_lock(&decoder->lock);
+
+  channel->result = result;
+  channel->done = 1;
+
+  pthread_cond_broadcast(&decoder->idle_cond);
+  pthread_mutex_unlock(&decoder->lock);
+
+  return NULL;
+}
+
+/*
+ * Called with the lock held once the whole header has arrived.
+ */
+static int StartDecoder(TiDecoder *decoder)
+{
+  StreamHeader header;
+  int *sizes;
+  int index, result;
+  size_t n_samples;
+
+  if ((result = ReadHeader(decoder->header, decoder->received, &header)) != OK) return result;
+
+  decoder->img_width = header.img_width;
+  decoder->img_height = header.img_height;
+  decoder->scales = header.scales;
+  decoder->img_type = header.img_type;
+  decoder->wavelet = header.wavelet;
+
+  sizes = header.sizes;
+
+  if (decoder->img_width <= 0 || decoder->img_height <= 0) return DAMAGED_HEADER;
+  if (decoder->img_width > MAX_IMG_SIZE || decoder->img_height > MAX_IMG_SIZE) return DAMAGED_HEADER;
+  if (decoder->img_type != GRAYSCALE && decoder->img_type != TRUECOLOR) return DAMAGED_HEADER;
+
+  decoder->channels = (decoder->img_type == GRAYSCALE ? 1 : 3);
+
+  for (index = 0; index < decoder->channels; index++)
+  if (sizes[index] < 0) return DAMAGED_HEADER;
+
+  decoder->align_width = ALIGN(decoder->img_width, decoder->scales);
+  decoder->align_height = ALIGN(decoder->img_height, decoder->scales);
+
+  n_samples = (size_t) decoder->align_width * decoder->align_height;
+
+  decoder->dwt_data = (double *) malloc(n_samples * sizeof(double));
+  decoder->image_buf = (unsigned char *) malloc((size_t) decoder->img_width * decoder->img_height);
+
+  if (decoder->dwt_data == NULL || decoder->image_buf == NULL) return MEMORY_ERROR;
+
+  decoder->stream_size = header.size;
+
+  for (index = 0; index < decoder->channels; index++) {
+
+    decoder->channel[index].size = sizes[index];
+    decoder->channel[index].buffer = (unsigned char *) malloc((size_t) sizes[index] + 1);
+    decoder->channel[index].coeff_data = (int *) calloc(n_samples, sizeof(int));
+
+    if (decoder->channel[index].buffer == NULL || decoder->channel[index].coeff_data == NULL) return MEMORY_ERROR;
+
+    decoder->stream_size += sizes[index];
+  }
+
+  if (decoder->channels == 3) InitSplitter(&decoder->splitter, sizes[0], sizes[1], sizes[2]);
+
+  /* a sub-stream shorter than 2 bytes decodes to an empty plane */
+  for (index = 0; index < decoder->channels; index++) {
+
+    if (decoder->channel[index].size < 2) continue;
+
+    if (pthread_create(&decoder->channel[index].thread, NULL, DecodeChannelThread, &decoder->channel[index]) != 0)
+    return INTERNAL_ERROR;
+
+    decoder->channel[index].started = 1;
+  }
+
+  return OK;
+}
+
+/*
+ * A channel can be rendered when its thread is finished or blocked for
+ * data that has not arrived yet. Called with the lock held.
+ */
+static int IsChannelIdle(DecoderChannel *channel)
+{
+  if (channel->started == 0 || channel->done) return TRUE;
+
+  if (channel->need != NULL && channel->buffer + channel->count < channel->need) return TRUE;
+
+  return FALSE;
+}
+
+/*
+ * Creates a decoder for a stream arriving in pieces: feed the bytes with
+ * TiDecoderFeed() as they come and call TiDecoderRender() whenever an
+ * intermediate image is wanted. Decoding goes on in the background and
+ * never starts over.
+ */
+TiDecoder *TiDecoderCreate(void)
+{
+  TiDecoder *decoder;
+  int index;
+
+  decoder = (TiDecoder *) malloc(sizeof(TiDecoder));
+
+  if (decoder == NULL) return NULL;
+
+  decoder->received = 0;
+  decoder->stream_size = 0;
+  decoder->result = OK;
+  decoder->closed = 0;
+  decoder->channels = 0;
+
+  decoder->dwt_data = NULL;
+  decoder->image_buf = NULL;
+
+  for (index = 0; index < MAX_CHANNELS; index++) {
+
+    decoder->channel[index].decoder = decoder;
+    decoder->channel[index].buffer = NULL;
+    decoder->channel[index].size = 0;
+    decoder->channel[index].count = 0;
+    decoder->channel[index].coeff_data = NULL;
+    decoder->channel[index].need = NULL;
+    decoder->channel[index].started = 0;
+    decoder->channel[index].done = 0;
+    decoder->channel[index].result = OK;
+  }
+
+  pthread_mutex_init(&decoder->lock, NULL);
+  pthread_cond_init(&decoder->data_cond, NULL);
+  pthread_cond_init(&decoder->idle_cond, NULL);
+
+  return decoder;
+}
+
+void TiDecoderFree(TiDecoder *decoder)
+{
+  int index;
+
+  if (decoder == NULL) return;
+
+  /* whatever has not arrived yet will not come */
+
+  pthread_mutex_lock(&decoder->lock);
+
+  decoder->closed = 1;
+
+  pthread_cond_broadcast(&decoder->data_cond);
+  pthread_mutex_unlock(&decoder->lock);
+
+  for (index = 0; index < MAX_CHANNELS; index++) {
+
+    if (decoder->channel[index].started) pthread_join(decoder->channel[index].thread, NULL);
+
+    free(decoder->channel[index].buffer);
+    free(decoder->channel[index].coeff_data);
+  }
+
+  pthread_mutex_destroy(&decoder->lock);
+  pthread_cond_destroy(&decoder->data_cond);
+  pthread_cond_destroy(&decoder->idle_cond);
+
+  free(decoder->dwt_data);
+  free(decoder->image_buf);
+  free(decoder);
+}
+
+/*
+ * Accepts the next piece of the stream, of any size. Bytes past the end
+ * of the stream given in its header are ignored.
+ */
+int TiDecoderFeed(TiDecoder *decoder,
+                  unsigned char *data,
+                  int size)
+{
+  int index, count, hdr_size, result;
+
+  if (decoder == NULL || (data == NULL && size > 0) || size < 0) return BAD_PARAMS;
+
+  pthread_mutex_lock(&decoder->lock);
+
+  if (decoder->result != OK) goto error;
+
+  /* the third byte tells a longer version 2 header */
+  hdr_size = (decoder->received >= 3 && decoder->header[2] == V2_MARK ? HDRSIZE_V2 : HDRSIZE);
+
+  while (decoder->received < hdr_size && size > 0) {
+
+    decoder->header[decoder->received++] = *data++;
+    size--;
+
+    if (decoder->received == 3 && decoder->header[2] == V2_MARK) hdr_size = HDRSIZE_V2;
+  }
+
+  if (decoder->received < hdr_size) goto error;
+
+  if (decoder->stream_size == 0) {
+
+    decoder->result = StartDecoder(decoder);
+
+    if (decoder->result != OK) goto error;
+  }
+
+  count = MIN(size, decoder->stream_size - decoder->received);
+
+  if (count <= 0) goto error;
+
+  if (decoder->channels == 1) {
+
+    memcpy(decoder->channel[0].buffer + decoder->channel[0].count, data, count);
+
+    decoder->channel[0].count += count;
+
+  } else {
+
+    SplitBytes(&decoder->splitter, data, count, decoder->channel[0].buffer,
+    decoder->channel[1].buffer, decoder->channel[2].buffer);
+
+    for (index = 0; index < 3; index++) decoder->channel[index].count = decoder->splitter.count[index];
+  }
+
+  decoder->received += count;
+
+  pthread_cond_broadcast(&decoder->data_cond);
+
+  error:
+
+  result = decoder->result;
+
+  pthread_mutex_unlock(&decoder->lock);
+
+  return result;
+}
+
+/*
+ * Feeds the decoder from source until the stream is complete or the
+ * source has no more, asking only for the bytes of this stream.
+ * Decoding goes on while the data is read.
+ */
+int TiDecoderRead(TiDecoder *decoder,
+                  TiSource source,
+                  void *source_context)
+{
+  unsigned char *chunk;
+  int want, count, result;
+
+  if (decoder == NULL || source == NULL) return BAD_PARAMS;
+
+  chunk = (unsigned char *) malloc(SINK_CHUNK);
+
+  if (chunk == NULL) return MEMORY_ERROR;
+
+  result = OK;
+
+  for (;;) {
+
+    pthread_mutex_lock(&decoder->lock);
+
+    if (decoder->stream_size > 0) want = decoder->stream_size - decoder->received;
+    else if (decoder->received >= 3 && decoder->header[2] == V2_MARK) want = HDRSIZE_V2 - decoder->received;
+    else want = HDRSIZE - decoder->received;
+
+    pthread_mutex_unlock(&decoder->lock);
+
+    if (want <= 0) break;
+
+    count = source(source_context, chunk, MIN(want, SINK_CHUNK));
+
+    if (count < 0) result = STREAM_ERROR;
+    if (count <= 0) break;
+
+    if ((result = TiDecoderFeed(decoder, chunk, count)) != OK) break;
+  }
+
+  free(chunk);
+
+  return result;
+}
+
+/*
+ * Gets image parameters once the header has arrived, BUFFER_EMPTY before.
+ */
+int TiDecoderInfo(TiDecoder *decoder,
+                  int *img_width,
+                  int *img_height,
+                  int *img_type)
+{
+  int result;
+
+  if (decoder == NULL) return BAD_PARAMS;
+
+  pthread_mutex_lock(&decoder->lock);
+
+  if (decoder->result != OK) result = decoder->result;
+  else if (decoder->stream_size == 0) result = BUFFER_EMPTY;
+  else {
+
+    *img_width = decoder->img_width;
+    *img_height = decoder->img_height;
+    *img_type = decoder->img_type;
+
+    result = OK;
+  }
+
+  pthread_mutex_unlock(&decoder->lock);
+
+  return result;
+}
+
+/*
+ * Reconstructs the image from everything fed so far. The image buffer
+ * must hold img_width * img_height pixels of the type from the header.
+ */
+int TiDecoderRender(TiDecoder *decoder,
+                    unsigned char *image)
+{
+  DecoderChannel *channel;
+  unsigned char *src, *dst, *end;
+  int index, shift, value, result;
+  size_t i, n_samples;
+
+  if (decoder == NULL || image == NULL) return BAD_PARAMS;
+
+  pthread_mutex_lock(&decoder->lock);
+
+  result = decoder->result;
+
+  if (result == OK && decoder->stream_size == 0) result = BUFFER_EMPTY;
+
+  pthread_mutex_unlock(&decoder->lock);
+
+  if (result != OK) return result;
+
+  n_samples = (size_t) decoder->align_width * decoder->align_height;
+
+  for (index = 0; index < decoder->channels; index++) {
+
+    channel = &decoder->channel[index];
+
+    pthread_mutex_lock(&decoder->lock);
+
+    while (IsChannelIdle(channel) == FALSE) pthread_cond_wait(&decoder->idle_cond, &decoder->lock);
+
+    result = (channel->done ? channel->result : OK);
+
+    /* SPIHTDecodeDWT() undoes the shift of TI_ROI only once it returns */
+    shift = (channel->done ? 0 : SPIHTRegionShift(channel->buffer, channel->count));
+
+    for (i = 0; i < n_samples; i++) {
+
+      value = channel->coeff_data[i];
+
+      if (shift > 0 && (value >= 1 << shift || value <= -(1 << shift)))
+        value = (value < 0 ? -((-value + (1 << (shift - 1))) >> shift) : (value + (1 << (shift - 1))) >> shift);
+
+      decoder->dwt_data[i] = value;
+    }
+
+    pthread_mutex_unlock(&decoder->lock);
+
+    if (result != OK && result != BUFFER_EMPTY) return result;
+
+    if (decoder->wavelet == BUTTERWORTH)
+      result = ButterworthSynthesis2D(decoder->dwt_data, decoder->align_width, decoder->align_height, decoder->scales);
+    else
+      result = Daub97Synthesis2D(decoder->dwt_data, decoder->align_height, decoder->align_width, decoder->scales);
+
+    if (result != OK) return result;
+
+    if (decoder->channels == 1) {
+      ExtractImage(decoder->dwt_data, image, decoder->align_height, decoder->align_width, decoder->img_height, decoder->img_width);
+      continue;
+    }
+
+    ExtractImage(decoder->dwt_data, decoder->image_buf, decoder->align_height, decoder->align_width, decoder->img_height, decoder->img_width);
+
+    src = decoder->image_buf;
+    dst = image + index;
+    end = decoder->image_buf + (size_t) decoder->img_width * decoder->img_height;
+
+    while (src < end) {
+      *dst = *src;
+       src++; dst += 3;
+    }
+  }
+
+  if (decoder->channels == 3) ConvertYCbCrToRGB(image, (size_t) decoder->img_width * decoder->img_height * 3);
+
+  return OK;
+}